@@ -1,4 +1,5 @@
 #include <nds.h>
+#include "ioring.h"
 
 //---------------------------------------------------------------------------------
 void VcountHandler() {
@@ -14,6 +15,26 @@ void powerButtonCB() {
 	exitflag = true;
 }
 
+static ioring_t *ring = 0;
+
+static int nand_read(u32 sector, u32 count, void *buffer) {
+	return sdmmc_nand_readsectors(sector, count, buffer);
+}
+
+static int nand_write(u32 sector, u32 count, void *buffer) {
+	return sdmmc_nand_writesectors(sector, count, buffer);
+}
+
+static const ioring_medium_t nand_medium = { nand_read, nand_write };
+
+// runs in the FIFO interrupt like libnds' own SDMMC handler, so the two never use the controller at once
+static void ioring_kick(u32 value, void *userdata) {
+	int i;
+	while (ring != 0 && (i = ioring_process(ring, &nand_medium)) >= 0) {
+		fifoSendValue32(IORING_FIFO, i);
+	}
+}
+
 //---------------------------------------------------------------------------------
 int main() {
 	//---------------------------------------------------------------------------------
@@ -31,6 +52,8 @@ int main() {
 
 	installSystemFIFO();
 
+	fifoSetValue32Handler(IORING_FIFO, ioring_kick, 0);
+
 	irqSet(IRQ_VCOUNT, VcountHandler);
 
 	irqEnable(IRQ_VBLANK | IRQ_VCOUNT);
@@ -59,6 +82,15 @@ int main() {
 				consoleid = REG_CONSOLEID;
 				fifoSendDatamsg(FIFO_USER_01, 8, (u8*)&consoleid);
 			} break;
+			case IORING_CMD_SETUP: {
+				while (!fifoCheckAddress(FIFO_USER_01)) swiIntrWait(1, IRQ_FIFO_NOT_EMPTY);
+				ring = (ioring_t*)fifoGetAddress(FIFO_USER_01);
+				fifoSendValue32(FIFO_USER_01, 0);
+			} break;
+			case IORING_CMD_TEARDOWN: {
+				ring = 0;
+				fifoSendValue32(FIFO_USER_01, 0);
+			} break;
 			}
 		}
 
@@ -1,6 +1,6 @@
 
 #include <nds.h>
-#include <malloc.h>
+#include <string.h>
 #include "aes.h"
 
 /* AES 128 ECB dug out from mbed TLS 2.5.1
@@ -14,125 +14,177 @@
 // make VC happy
 #ifdef _MSC_VER
 #define DTCM_BSS
+#define DTCM_DATA
 #define ITCM_CODE
+#define ARM_CODE
 #endif
 
-// it's interesting they mix unsigned char with uint32_t
-DTCM_BSS static unsigned char FSb[256];
-DTCM_BSS static uint32_t FT0[256];
-DTCM_BSS static uint32_t FT1[256];
-DTCM_BSS static uint32_t FT2[256];
-DTCM_BSS static uint32_t FT3[256];
-
-// AES-CTR/CCM only uses encrypt, so R tables are not used
-#define NO_R_TABLES
-#ifndef NO_R_TABLES
-static unsigned char RSb[256];
-static uint32_t RT0[256];
-static uint32_t RT1[256];
-static uint32_t RT2[256];
-static uint32_t RT3[256];
+// older libnds doesn't have this
+#ifndef ARM_CODE
+#define ARM_CODE __attribute__((target("arm")))
 #endif
 
-static uint32_t RCON[256];
+// tables are generated at compile time, same as MBEDTLS_AES_ROM_TABLES
+// forward tables go to DTCM since every round hits them
+// AES-CTR/CCM only uses encrypt, so R tables are not needed
 
 /*
- * Tables generation code
+ * Forward S-box
  */
-#define ROTL8(x) ( ( x << 8 ) & 0xFFFFFFFF ) | ( x >> 24 )
-#define XTIME(x) ( ( x << 1 ) ^ ( ( x & 0x80 ) ? 0x1B : 0x00 ) )
-#define MUL(x,y) ( ( x && y ) ? pow[(log[x]+log[y]) % 255] : 0 )
-
-void aes_gen_tables(void)
+DTCM_DATA static const unsigned char FSb[256] =
 {
-#ifdef NO_R_TABLES
-	unsigned char *RSb = memalign(32, 256);
-	uint32_t *RT0 = memalign(32, 256 * sizeof(uint32_t));
-	uint32_t *RT1 = memalign(32, 256 * sizeof(uint32_t));
-	uint32_t *RT2 = memalign(32, 256 * sizeof(uint32_t));
-	uint32_t *RT3 = memalign(32, 256 * sizeof(uint32_t));
-#endif
-
-	int i, x, y, z;
-	int pow[256];
-	int log[256];
-
-	/*
-	 * compute pow and log tables over GF(2^8)
-	 */
-	for (i = 0, x = 1; i < 256; i++)
-	{
-		pow[i] = x;
-		log[x] = i;
-		x = (x ^ XTIME(x)) & 0xFF;
-	}
-
-	/*
-	 * calculate the round constants
-	 */
-	for (i = 0, x = 1; i < 10; i++)
-	{
-		RCON[i] = (uint32_t)x;
-		x = XTIME(x) & 0xFF;
-	}
-
-	/*
-	 * generate the forward and reverse S-boxes
-	 */
-	FSb[0x00] = 0x63;
-	RSb[0x63] = 0x00;
-
-	for (i = 1; i < 256; i++)
-	{
-		x = pow[255 - log[i]];
-
-		y = x; y = ((y << 1) | (y >> 7)) & 0xFF;
-		x ^= y; y = ((y << 1) | (y >> 7)) & 0xFF;
-		x ^= y; y = ((y << 1) | (y >> 7)) & 0xFF;
-		x ^= y; y = ((y << 1) | (y >> 7)) & 0xFF;
-		x ^= y ^ 0x63;
-
-		FSb[i] = (unsigned char)x;
-		RSb[x] = (unsigned char)i;
-	}
+	0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5,
+	0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+	0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0,
+	0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+	0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC,
+	0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+	0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A,
+	0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+	0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0,
+	0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+	0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B,
+	0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+	0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85,
+	0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+	0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5,
+	0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+	0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17,
+	0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+	0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88,
+	0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+	0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C,
+	0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+	0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9,
+	0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+	0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6,
+	0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+	0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E,
+	0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+	0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94,
+	0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+	0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68,
+	0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16,
+};
 
-	/*
-	 * generate the forward and reverse tables
-	 */
-	for (i = 0; i < 256; i++)
-	{
-		x = FSb[i];
-		y = XTIME(x) & 0xFF;
-		z = (y ^ x) & 0xFF;
-
-		FT0[i] = ((uint32_t)y) ^
-			((uint32_t)x << 8) ^
-			((uint32_t)x << 16) ^
-			((uint32_t)z << 24);
-
-		FT1[i] = ROTL8(FT0[i]);
-		FT2[i] = ROTL8(FT1[i]);
-		FT3[i] = ROTL8(FT2[i]);
-
-		x = RSb[i];
-
-		RT0[i] = ((uint32_t)MUL(0x0E, x)) ^
-			((uint32_t)MUL(0x09, x) << 8) ^
-			((uint32_t)MUL(0x0D, x) << 16) ^
-			((uint32_t)MUL(0x0B, x) << 24);
-
-		RT1[i] = ROTL8(RT0[i]);
-		RT2[i] = ROTL8(RT1[i]);
-		RT3[i] = ROTL8(RT2[i]);
-	}
-#ifdef NO_R_TABLES
-	free(RSb);
-	free(RT0);
-	free(RT1);
-	free(RT2);
-	free(RT3);
+/*
+ * Forward tables
+ */
+#define FT \
+\
+    V(A5,63,63,C6), V(84,7C,7C,F8), V(99,77,77,EE), V(8D,7B,7B,F6), \
+    V(0D,F2,F2,FF), V(BD,6B,6B,D6), V(B1,6F,6F,DE), V(54,C5,C5,91), \
+    V(50,30,30,60), V(03,01,01,02), V(A9,67,67,CE), V(7D,2B,2B,56), \
+    V(19,FE,FE,E7), V(62,D7,D7,B5), V(E6,AB,AB,4D), V(9A,76,76,EC), \
+    V(45,CA,CA,8F), V(9D,82,82,1F), V(40,C9,C9,89), V(87,7D,7D,FA), \
+    V(15,FA,FA,EF), V(EB,59,59,B2), V(C9,47,47,8E), V(0B,F0,F0,FB), \
+    V(EC,AD,AD,41), V(67,D4,D4,B3), V(FD,A2,A2,5F), V(EA,AF,AF,45), \
+    V(BF,9C,9C,23), V(F7,A4,A4,53), V(96,72,72,E4), V(5B,C0,C0,9B), \
+    V(C2,B7,B7,75), V(1C,FD,FD,E1), V(AE,93,93,3D), V(6A,26,26,4C), \
+    V(5A,36,36,6C), V(41,3F,3F,7E), V(02,F7,F7,F5), V(4F,CC,CC,83), \
+    V(5C,34,34,68), V(F4,A5,A5,51), V(34,E5,E5,D1), V(08,F1,F1,F9), \
+    V(93,71,71,E2), V(73,D8,D8,AB), V(53,31,31,62), V(3F,15,15,2A), \
+    V(0C,04,04,08), V(52,C7,C7,95), V(65,23,23,46), V(5E,C3,C3,9D), \
+    V(28,18,18,30), V(A1,96,96,37), V(0F,05,05,0A), V(B5,9A,9A,2F), \
+    V(09,07,07,0E), V(36,12,12,24), V(9B,80,80,1B), V(3D,E2,E2,DF), \
+    V(26,EB,EB,CD), V(69,27,27,4E), V(CD,B2,B2,7F), V(9F,75,75,EA), \
+    V(1B,09,09,12), V(9E,83,83,1D), V(74,2C,2C,58), V(2E,1A,1A,34), \
+    V(2D,1B,1B,36), V(B2,6E,6E,DC), V(EE,5A,5A,B4), V(FB,A0,A0,5B), \
+    V(F6,52,52,A4), V(4D,3B,3B,76), V(61,D6,D6,B7), V(CE,B3,B3,7D), \
+    V(7B,29,29,52), V(3E,E3,E3,DD), V(71,2F,2F,5E), V(97,84,84,13), \
+    V(F5,53,53,A6), V(68,D1,D1,B9), V(00,00,00,00), V(2C,ED,ED,C1), \
+    V(60,20,20,40), V(1F,FC,FC,E3), V(C8,B1,B1,79), V(ED,5B,5B,B6), \
+    V(BE,6A,6A,D4), V(46,CB,CB,8D), V(D9,BE,BE,67), V(4B,39,39,72), \
+    V(DE,4A,4A,94), V(D4,4C,4C,98), V(E8,58,58,B0), V(4A,CF,CF,85), \
+    V(6B,D0,D0,BB), V(2A,EF,EF,C5), V(E5,AA,AA,4F), V(16,FB,FB,ED), \
+    V(C5,43,43,86), V(D7,4D,4D,9A), V(55,33,33,66), V(94,85,85,11), \
+    V(CF,45,45,8A), V(10,F9,F9,E9), V(06,02,02,04), V(81,7F,7F,FE), \
+    V(F0,50,50,A0), V(44,3C,3C,78), V(BA,9F,9F,25), V(E3,A8,A8,4B), \
+    V(F3,51,51,A2), V(FE,A3,A3,5D), V(C0,40,40,80), V(8A,8F,8F,05), \
+    V(AD,92,92,3F), V(BC,9D,9D,21), V(48,38,38,70), V(04,F5,F5,F1), \
+    V(DF,BC,BC,63), V(C1,B6,B6,77), V(75,DA,DA,AF), V(63,21,21,42), \
+    V(30,10,10,20), V(1A,FF,FF,E5), V(0E,F3,F3,FD), V(6D,D2,D2,BF), \
+    V(4C,CD,CD,81), V(14,0C,0C,18), V(35,13,13,26), V(2F,EC,EC,C3), \
+    V(E1,5F,5F,BE), V(A2,97,97,35), V(CC,44,44,88), V(39,17,17,2E), \
+    V(57,C4,C4,93), V(F2,A7,A7,55), V(82,7E,7E,FC), V(47,3D,3D,7A), \
+    V(AC,64,64,C8), V(E7,5D,5D,BA), V(2B,19,19,32), V(95,73,73,E6), \
+    V(A0,60,60,C0), V(98,81,81,19), V(D1,4F,4F,9E), V(7F,DC,DC,A3), \
+    V(66,22,22,44), V(7E,2A,2A,54), V(AB,90,90,3B), V(83,88,88,0B), \
+    V(CA,46,46,8C), V(29,EE,EE,C7), V(D3,B8,B8,6B), V(3C,14,14,28), \
+    V(79,DE,DE,A7), V(E2,5E,5E,BC), V(1D,0B,0B,16), V(76,DB,DB,AD), \
+    V(3B,E0,E0,DB), V(56,32,32,64), V(4E,3A,3A,74), V(1E,0A,0A,14), \
+    V(DB,49,49,92), V(0A,06,06,0C), V(6C,24,24,48), V(E4,5C,5C,B8), \
+    V(5D,C2,C2,9F), V(6E,D3,D3,BD), V(EF,AC,AC,43), V(A6,62,62,C4), \
+    V(A8,91,91,39), V(A4,95,95,31), V(37,E4,E4,D3), V(8B,79,79,F2), \
+    V(32,E7,E7,D5), V(43,C8,C8,8B), V(59,37,37,6E), V(B7,6D,6D,DA), \
+    V(8C,8D,8D,01), V(64,D5,D5,B1), V(D2,4E,4E,9C), V(E0,A9,A9,49), \
+    V(B4,6C,6C,D8), V(FA,56,56,AC), V(07,F4,F4,F3), V(25,EA,EA,CF), \
+    V(AF,65,65,CA), V(8E,7A,7A,F4), V(E9,AE,AE,47), V(18,08,08,10), \
+    V(D5,BA,BA,6F), V(88,78,78,F0), V(6F,25,25,4A), V(72,2E,2E,5C), \
+    V(24,1C,1C,38), V(F1,A6,A6,57), V(C7,B4,B4,73), V(51,C6,C6,97), \
+    V(23,E8,E8,CB), V(7C,DD,DD,A1), V(9C,74,74,E8), V(21,1F,1F,3E), \
+    V(DD,4B,4B,96), V(DC,BD,BD,61), V(86,8B,8B,0D), V(85,8A,8A,0F), \
+    V(90,70,70,E0), V(42,3E,3E,7C), V(C4,B5,B5,71), V(AA,66,66,CC), \
+    V(D8,48,48,90), V(05,03,03,06), V(01,F6,F6,F7), V(12,0E,0E,1C), \
+    V(A3,61,61,C2), V(5F,35,35,6A), V(F9,57,57,AE), V(D0,B9,B9,69), \
+    V(91,86,86,17), V(58,C1,C1,99), V(27,1D,1D,3A), V(B9,9E,9E,27), \
+    V(38,E1,E1,D9), V(13,F8,F8,EB), V(B3,98,98,2B), V(33,11,11,22), \
+    V(BB,69,69,D2), V(70,D9,D9,A9), V(89,8E,8E,07), V(A7,94,94,33), \
+    V(B6,9B,9B,2D), V(22,1E,1E,3C), V(92,87,87,15), V(20,E9,E9,C9), \
+    V(49,CE,CE,87), V(FF,55,55,AA), V(78,28,28,50), V(7A,DF,DF,A5), \
+    V(8F,8C,8C,03), V(F8,A1,A1,59), V(80,89,89,09), V(17,0D,0D,1A), \
+    V(DA,BF,BF,65), V(31,E6,E6,D7), V(C6,42,42,84), V(B8,68,68,D0), \
+    V(C3,41,41,82), V(B0,99,99,29), V(77,2D,2D,5A), V(11,0F,0F,1E), \
+    V(CB,B0,B0,7B), V(FC,54,54,A8), V(D6,BB,BB,6D), V(3A,16,16,2C)
+
+#define V(a,b,c,d) 0x##a##b##c##d
+DTCM_DATA static const uint32_t FT0[256] = { FT };
+#undef V
+
+#ifndef AES_FEWER_TABLES
+
+#define V(a,b,c,d) 0x##b##c##d##a
+DTCM_DATA static const uint32_t FT1[256] = { FT };
+#undef V
+
+#define V(a,b,c,d) 0x##c##d##a##b
+DTCM_DATA static const uint32_t FT2[256] = { FT };
+#undef V
+
+#define V(a,b,c,d) 0x##d##a##b##c
+DTCM_DATA static const uint32_t FT3[256] = { FT };
+#undef V
+
+#endif /* AES_FEWER_TABLES */
+
+#undef FT
+
+// FT1..FT3 are just FT0 rotated, as in MBEDTLS_AES_FEWER_TABLES
+// on ARM the rotate folds into the EOR operand, so the single table costs no extra instructions
+#define ROTL8(x)  ( (uint32_t)( ( x ) <<  8 ) + (uint32_t)( ( x ) >> 24 ) )
+#define ROTL16(x) ( (uint32_t)( ( x ) << 16 ) + (uint32_t)( ( x ) >> 16 ) )
+#define ROTL24(x) ( (uint32_t)( ( x ) << 24 ) + (uint32_t)( ( x ) >>  8 ) )
+
+#ifdef AES_FEWER_TABLES
+#define AES_FT0(idx) FT0[idx]
+#define AES_FT1(idx) ROTL8(  FT0[idx] )
+#define AES_FT2(idx) ROTL16( FT0[idx] )
+#define AES_FT3(idx) ROTL24( FT0[idx] )
+#else
+#define AES_FT0(idx) FT0[idx]
+#define AES_FT1(idx) FT1[idx]
+#define AES_FT2(idx) FT2[idx]
+#define AES_FT3(idx) FT3[idx]
 #endif
-}
+
+/*
+ * Round constants
+ */
+static const uint32_t RCON[10] =
+{
+    0x00000001, 0x00000002, 0x00000004, 0x00000008, 0x00000010,
+    0x00000020, 0x00000040, 0x00000080, 0x0000001B, 0x00000036
+};
 
 // did a little counting to understand why original mbedTLS buf is [68]
 // in set key, they generated:
@@ -167,33 +219,334 @@ void aes_set_key_enc_128_be(uint32_t rk[RK_LEN], const unsigned char *key) {
 	}
 }
 
-#define AES_FROUND(X0,X1,X2,X3,Y0,Y1,Y2,Y3)     \
+#define AES_FROUND(X0,X1,X2,X3,Y0,Y1,Y2,Y3)         \
+{                                                   \
+    X0 = *RK++ ^ AES_FT0( ( Y0       ) & 0xFF ) ^   \
+                 AES_FT1( ( Y1 >>  8 ) & 0xFF ) ^   \
+                 AES_FT2( ( Y2 >> 16 ) & 0xFF ) ^   \
+                 AES_FT3( ( Y3 >> 24 ) & 0xFF );    \
+                                                    \
+    X1 = *RK++ ^ AES_FT0( ( Y1       ) & 0xFF ) ^   \
+                 AES_FT1( ( Y2 >>  8 ) & 0xFF ) ^   \
+                 AES_FT2( ( Y3 >> 16 ) & 0xFF ) ^   \
+                 AES_FT3( ( Y0 >> 24 ) & 0xFF );    \
+                                                    \
+    X2 = *RK++ ^ AES_FT0( ( Y2       ) & 0xFF ) ^   \
+                 AES_FT1( ( Y3 >>  8 ) & 0xFF ) ^   \
+                 AES_FT2( ( Y0 >> 16 ) & 0xFF ) ^   \
+                 AES_FT3( ( Y1 >> 24 ) & 0xFF );    \
+                                                    \
+    X3 = *RK++ ^ AES_FT0( ( Y3       ) & 0xFF ) ^   \
+                 AES_FT1( ( Y0 >>  8 ) & 0xFF ) ^   \
+                 AES_FT2( ( Y1 >> 16 ) & 0xFF ) ^   \
+                 AES_FT3( ( Y2 >> 24 ) & 0xFF );    \
+}
+
+#define AES_FLAST(X0,X1,X2,X3,Y0,Y1,Y2,Y3)     \
 {                                               \
-    X0 = *RK++ ^ FT0[ ( Y0       ) & 0xFF ] ^   \
-                 FT1[ ( Y1 >>  8 ) & 0xFF ] ^   \
-                 FT2[ ( Y2 >> 16 ) & 0xFF ] ^   \
-                 FT3[ ( Y3 >> 24 ) & 0xFF ];    \
+    X0 = *RK++ ^                                \
+        ((uint32_t)FSb[ ( Y0       ) & 0xFF ]      ) ^ \
+        ((uint32_t)FSb[ ( Y1 >>  8 ) & 0xFF ] <<  8) ^ \
+        ((uint32_t)FSb[ ( Y2 >> 16 ) & 0xFF ] << 16) ^ \
+        ((uint32_t)FSb[ ( Y3 >> 24 ) & 0xFF ] << 24);  \
                                                 \
-    X1 = *RK++ ^ FT0[ ( Y1       ) & 0xFF ] ^   \
-                 FT1[ ( Y2 >>  8 ) & 0xFF ] ^   \
-                 FT2[ ( Y3 >> 16 ) & 0xFF ] ^   \
-                 FT3[ ( Y0 >> 24 ) & 0xFF ];    \
+    X1 = *RK++ ^                                \
+        ((uint32_t)FSb[ ( Y1       ) & 0xFF ]      ) ^ \
+        ((uint32_t)FSb[ ( Y2 >>  8 ) & 0xFF ] <<  8) ^ \
+        ((uint32_t)FSb[ ( Y3 >> 16 ) & 0xFF ] << 16) ^ \
+        ((uint32_t)FSb[ ( Y0 >> 24 ) & 0xFF ] << 24);  \
                                                 \
-    X2 = *RK++ ^ FT0[ ( Y2       ) & 0xFF ] ^   \
-                 FT1[ ( Y3 >>  8 ) & 0xFF ] ^   \
-                 FT2[ ( Y0 >> 16 ) & 0xFF ] ^   \
-                 FT3[ ( Y1 >> 24 ) & 0xFF ];    \
+    X2 = *RK++ ^                                \
+        ((uint32_t)FSb[ ( Y2       ) & 0xFF ]      ) ^ \
+        ((uint32_t)FSb[ ( Y3 >>  8 ) & 0xFF ] <<  8) ^ \
+        ((uint32_t)FSb[ ( Y0 >> 16 ) & 0xFF ] << 16) ^ \
+        ((uint32_t)FSb[ ( Y1 >> 24 ) & 0xFF ] << 24);  \
                                                 \
-    X3 = *RK++ ^ FT0[ ( Y3       ) & 0xFF ] ^   \
-                 FT1[ ( Y0 >>  8 ) & 0xFF ] ^   \
-                 FT2[ ( Y1 >> 16 ) & 0xFF ] ^   \
-                 FT3[ ( Y2 >> 24 ) & 0xFF ];    \
+    /* removed a ++ here */                     \
+    X3 = *RK ^                                  \
+        ((uint32_t)FSb[ ( Y3       ) & 0xFF ]      ) ^ \
+        ((uint32_t)FSb[ ( Y0 >>  8 ) & 0xFF ] <<  8) ^ \
+        ((uint32_t)FSb[ ( Y1 >> 16 ) & 0xFF ] << 16) ^ \
+        ((uint32_t)FSb[ ( Y2 >> 24 ) & 0xFF ] << 24);  \
+}
+
+ITCM_CODE ARM_CODE void aes_encrypt_128_be(const uint32_t rk[RK_LEN],
+	const unsigned char input[16], unsigned char output[16])
+{
+	// state and round key pointer are locals so they can live in registers,
+	// the T tables are the only memory operands left in the rounds
+	const uint32_t *RK = rk;
+	uint32_t X0, X1, X2, X3, Y0, Y1, Y2, Y3;
+
+	GET_UINT32_BE(X0, input, 12);
+	GET_UINT32_BE(X1, input, 8);
+	GET_UINT32_BE(X2, input, 4);
+	GET_UINT32_BE(X3, input, 0);
+
+	X0 ^= *RK++;
+	X1 ^= *RK++;
+	X2 ^= *RK++;
+	X3 ^= *RK++;
+
+	// loop unrolled
+	AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+	AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+	AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+	AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+	AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+	AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+	AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+	AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+	AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+
+	AES_FLAST(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+
+	PUT_UINT32_BE(X0, output, 12);
+	PUT_UINT32_BE(X1, output, 8);
+	PUT_UINT32_BE(X2, output, 4);
+	PUT_UINT32_BE(X3, output, 0);
+}
+
+// mbedTLS loads the input little endian, the _be byte reversal above turns
+// the counter word order around and byte swaps each word, same for output
+#define BSWAP32(x) __builtin_bswap32(x)
+
+// AES-CTR on whole blocks, the way crypto.c lays out its counters:
+// ctr[0] is the lowest word, passed as bytes to aes_encrypt_128_be()
+// only ctr[0] changes between blocks, so the upper 3 state words are computed once
+// and the 128 bit carry is only taken when ctr[0] wraps
+// in/out must be aligned to 32 bit, can work in place, ctr is advanced by count
+ITCM_CODE ARM_CODE void aes_crypt_ctr_128_be(const uint32_t rk[RK_LEN], uint32_t ctr[4],
+	uint32_t *out, const uint32_t *in, unsigned count)
+{
+	const uint32_t *RK;
+	uint32_t X0, X1, X2, X3, Y0, Y1, Y2, Y3;
+	uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+	uint32_t k0 = BSWAP32(c3) ^ rk[0];
+	uint32_t k1 = BSWAP32(c2) ^ rk[1];
+	uint32_t k2 = BSWAP32(c1) ^ rk[2];
+
+	while (count > 0) {
+		// blocks before c0 wraps
+		unsigned n = count;
+		if (c0 + (n - 1) < c0) {
+			n = -c0;
+		}
+		count -= n;
+		do {
+			RK = rk + 4;
+			X0 = k0;
+			X1 = k1;
+			X2 = k2;
+			X3 = BSWAP32(c0) ^ rk[3];
+			++c0;
+
+			AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+			AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+			AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+			AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+			AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+			AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+			AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+			AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+			AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+
+			AES_FLAST(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+
+			// keystream goes straight into the output store
+			out[0] = in[0] ^ BSWAP32(X3);
+			out[1] = in[1] ^ BSWAP32(X2);
+			out[2] = in[2] ^ BSWAP32(X1);
+			out[3] = in[3] ^ BSWAP32(X0);
+			out += 4;
+			in += 4;
+		} while (--n > 0);
+		if (c0 == 0) {
+			if (++c1 == 0) {
+				if (++c2 == 0) {
+					++c3;
+					k0 = BSWAP32(c3) ^ rk[0];
+				}
+				k1 = BSWAP32(c2) ^ rk[1];
+			}
+			k2 = BSWAP32(c1) ^ rk[2];
+		}
+	}
+
+	ctr[0] = c0;
+	ctr[1] = c1;
+	ctr[2] = c2;
+	ctr[3] = c3;
+}
+
+// two independent blocks under the same key, round keys are loaded once for both
+// the two dependency chains interleave, hiding table load latency
+#define AES_FT_WORD(K,A,B,C,D)                      \
+    ( K ^ AES_FT0( ( A       ) & 0xFF ) ^           \
+          AES_FT1( ( B >>  8 ) & 0xFF ) ^           \
+          AES_FT2( ( C >> 16 ) & 0xFF ) ^           \
+          AES_FT3( ( D >> 24 ) & 0xFF ) )
+
+#define AES_FSB_WORD(K,A,B,C,D)                     \
+    ( K ^ ((uint32_t)FSb[ ( A       ) & 0xFF ]      ) ^ \
+          ((uint32_t)FSb[ ( B >>  8 ) & 0xFF ] <<  8) ^ \
+          ((uint32_t)FSb[ ( C >> 16 ) & 0xFF ] << 16) ^ \
+          ((uint32_t)FSb[ ( D >> 24 ) & 0xFF ] << 24) )
+
+#define AES_FROUND2(X0,X1,X2,X3,Y0,Y1,Y2,Y3,U0,U1,U2,U3,V0,V1,V2,V3) \
+{                                                   \
+    uint32_t k_;                                    \
+    k_ = *RK++;                                     \
+    X0 = AES_FT_WORD(k_, Y0, Y1, Y2, Y3);           \
+    U0 = AES_FT_WORD(k_, V0, V1, V2, V3);           \
+    k_ = *RK++;                                     \
+    X1 = AES_FT_WORD(k_, Y1, Y2, Y3, Y0);           \
+    U1 = AES_FT_WORD(k_, V1, V2, V3, V0);           \
+    k_ = *RK++;                                     \
+    X2 = AES_FT_WORD(k_, Y2, Y3, Y0, Y1);           \
+    U2 = AES_FT_WORD(k_, V2, V3, V0, V1);           \
+    k_ = *RK++;                                     \
+    X3 = AES_FT_WORD(k_, Y3, Y0, Y1, Y2);           \
+    U3 = AES_FT_WORD(k_, V3, V0, V1, V2);           \
 }
 
+#define AES_FLAST2(X0,X1,X2,X3,Y0,Y1,Y2,Y3,U0,U1,U2,U3,V0,V1,V2,V3) \
+{                                                   \
+    X0 = AES_FSB_WORD(RK[0], Y0, Y1, Y2, Y3);       \
+    U0 = AES_FSB_WORD(RK[0], V0, V1, V2, V3);       \
+    X1 = AES_FSB_WORD(RK[1], Y1, Y2, Y3, Y0);       \
+    U1 = AES_FSB_WORD(RK[1], V1, V2, V3, V0);       \
+    X2 = AES_FSB_WORD(RK[2], Y2, Y3, Y0, Y1);       \
+    U2 = AES_FSB_WORD(RK[2], V2, V3, V0, V1);       \
+    X3 = AES_FSB_WORD(RK[3], Y3, Y0, Y1, Y2);       \
+    U3 = AES_FSB_WORD(RK[3], V3, V0, V1, V2);       \
+}
+
+#define AES_ENCRYPT2(X0,X1,X2,X3,Y0,Y1,Y2,Y3,U0,U1,U2,U3,V0,V1,V2,V3) \
+{                                                   \
+    AES_FROUND2(Y0, Y1, Y2, Y3, X0, X1, X2, X3, V0, V1, V2, V3, U0, U1, U2, U3); \
+    AES_FROUND2(X0, X1, X2, X3, Y0, Y1, Y2, Y3, U0, U1, U2, U3, V0, V1, V2, V3); \
+    AES_FROUND2(Y0, Y1, Y2, Y3, X0, X1, X2, X3, V0, V1, V2, V3, U0, U1, U2, U3); \
+    AES_FROUND2(X0, X1, X2, X3, Y0, Y1, Y2, Y3, U0, U1, U2, U3, V0, V1, V2, V3); \
+    AES_FROUND2(Y0, Y1, Y2, Y3, X0, X1, X2, X3, V0, V1, V2, V3, U0, U1, U2, U3); \
+    AES_FROUND2(X0, X1, X2, X3, Y0, Y1, Y2, Y3, U0, U1, U2, U3, V0, V1, V2, V3); \
+    AES_FROUND2(Y0, Y1, Y2, Y3, X0, X1, X2, X3, V0, V1, V2, V3, U0, U1, U2, U3); \
+    AES_FROUND2(X0, X1, X2, X3, Y0, Y1, Y2, Y3, U0, U1, U2, U3, V0, V1, V2, V3); \
+    AES_FROUND2(Y0, Y1, Y2, Y3, X0, X1, X2, X3, V0, V1, V2, V3, U0, U1, U2, U3); \
+    AES_FLAST2(X0, X1, X2, X3, Y0, Y1, Y2, Y3, U0, U1, U2, U3, V0, V1, V2, V3); \
+}
+
+// AES-CCM payload, CTR keystream and CBC-MAC side by side
+// ctr and mac use the same layout as the counter in aes_crypt_ctr_128_be()
+// encrypt: the MAC of block i and its keystream are independent, computed together
+// decrypt: the MAC needs the plaintext, so it's paired with the keystream of block i + 1
+// in/out must be aligned to 32 bit, can work in place, ctr is advanced by count
+ITCM_CODE ARM_CODE void aes_ccm_crypt_128_be(const uint32_t rk[RK_LEN], uint32_t ctr[4], uint32_t mac[4],
+	uint32_t *out, const uint32_t *in, unsigned count, int decrypt)
+{
+	const uint32_t *RK;
+	// X/Y: CTR state, U/V: CBC-MAC state
+	// X only carries a keystream into the loop on decrypt, zeroed so that's visible to the compiler
+	uint32_t X0 = 0, X1 = 0, X2 = 0, X3 = 0, Y0, Y1, Y2, Y3;
+	uint32_t U0, U1, U2, U3, V0, V1, V2, V3;
+	uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+	// MAC kept in state order between blocks
+	uint32_t M0 = BSWAP32(mac[3]), M1 = BSWAP32(mac[2]), M2 = BSWAP32(mac[1]), M3 = BSWAP32(mac[0]);
+	uint32_t p0, p1, p2, p3;
+
+	if (count == 0) {
+		return;
+	}
+
+	if (decrypt) {
+		// keystream of the first block alone
+		RK = rk;
+		X0 = BSWAP32(c3) ^ *RK++;
+		X1 = BSWAP32(c2) ^ *RK++;
+		X2 = BSWAP32(c1) ^ *RK++;
+		X3 = BSWAP32(c0) ^ *RK++;
+		AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+		AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+		AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+		AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+		AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+		AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+		AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+		AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+		AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
+		AES_FLAST(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
+	}
+
+	do {
+		if (decrypt) {
+			// X holds the keystream of this block
+			p0 = in[0] ^ BSWAP32(X3);
+			p1 = in[1] ^ BSWAP32(X2);
+			p2 = in[2] ^ BSWAP32(X1);
+			p3 = in[3] ^ BSWAP32(X0);
+			out[0] = p0;
+			out[1] = p1;
+			out[2] = p2;
+			out[3] = p3;
+			// next counter, on the last block this keystream is computed for nothing
+			// which is cheaper than a separate single block tail
+			if (++c0 == 0 && ++c1 == 0 && ++c2 == 0) {
+				++c3;
+			}
+		} else {
+			p0 = in[0];
+			p1 = in[1];
+			p2 = in[2];
+			p3 = in[3];
+		}
+
+		RK = rk;
+		X0 = BSWAP32(c3) ^ RK[0];
+		X1 = BSWAP32(c2) ^ RK[1];
+		X2 = BSWAP32(c1) ^ RK[2];
+		X3 = BSWAP32(c0) ^ RK[3];
+		U0 = M0 ^ BSWAP32(p3) ^ RK[0];
+		U1 = M1 ^ BSWAP32(p2) ^ RK[1];
+		U2 = M2 ^ BSWAP32(p1) ^ RK[2];
+		U3 = M3 ^ BSWAP32(p0) ^ RK[3];
+		RK += 4;
+
+		AES_ENCRYPT2(X0, X1, X2, X3, Y0, Y1, Y2, Y3, U0, U1, U2, U3, V0, V1, V2, V3);
+
+		M0 = U0;
+		M1 = U1;
+		M2 = U2;
+		M3 = U3;
+
+		if (!decrypt) {
+			out[0] = p0 ^ BSWAP32(X3);
+			out[1] = p1 ^ BSWAP32(X2);
+			out[2] = p2 ^ BSWAP32(X1);
+			out[3] = p3 ^ BSWAP32(X0);
+			if (++c0 == 0 && ++c1 == 0 && ++c2 == 0) {
+				++c3;
+			}
+		}
+		out += 4;
+		in += 4;
+	} while (--count > 0);
+
+	ctr[0] = c0;
+	ctr[1] = c1;
+	ctr[2] = c2;
+	ctr[3] = c3;
+	mac[0] = BSWAP32(M3);
+	mac[1] = BSWAP32(M2);
+	mac[2] = BSWAP32(M1);
+	mac[3] = BSWAP32(M0);
+}
+
+#ifdef AES_ENCRYPT_REF
+// the original version, state in DTCM globals, kept to compare against in aes_test()
 DTCM_BSS uint32_t X0, X1, X2, X3, Y0, Y1, Y2, Y3;
 DTCM_BSS const uint32_t *RK;
 
-ITCM_CODE void aes_encrypt_128_be(const uint32_t rk[RK_LEN],
+ITCM_CODE void aes_encrypt_128_be_ref(const uint32_t rk[RK_LEN],
 	const unsigned char input[16], unsigned char output[16])
 {
 	RK = rk;
@@ -208,7 +561,6 @@ ITCM_CODE void aes_encrypt_128_be(const uint32_t rk[RK_LEN],
 	X2 ^= *RK++;
 	X3 ^= *RK++;
 
-	// loop unrolled
 	AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
 	AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
 	AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
@@ -219,34 +571,47 @@ ITCM_CODE void aes_encrypt_128_be(const uint32_t rk[RK_LEN],
 	AES_FROUND(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
 	AES_FROUND(Y0, Y1, Y2, Y3, X0, X1, X2, X3);
 
-	X0 = *RK++ ^ \
-		((uint32_t)FSb[(Y0) & 0xFF]) ^
-		((uint32_t)FSb[(Y1 >> 8) & 0xFF] << 8) ^
-		((uint32_t)FSb[(Y2 >> 16) & 0xFF] << 16) ^
-		((uint32_t)FSb[(Y3 >> 24) & 0xFF] << 24);
-
-	X1 = *RK++ ^ \
-		((uint32_t)FSb[(Y1) & 0xFF]) ^
-		((uint32_t)FSb[(Y2 >> 8) & 0xFF] << 8) ^
-		((uint32_t)FSb[(Y3 >> 16) & 0xFF] << 16) ^
-		((uint32_t)FSb[(Y0 >> 24) & 0xFF] << 24);
-
-	X2 = *RK++ ^ \
-		((uint32_t)FSb[(Y2) & 0xFF]) ^
-		((uint32_t)FSb[(Y3 >> 8) & 0xFF] << 8) ^
-		((uint32_t)FSb[(Y0 >> 16) & 0xFF] << 16) ^
-		((uint32_t)FSb[(Y1 >> 24) & 0xFF] << 24);
-
-	// removed a ++ here
-	X3 = *RK ^ \
-		((uint32_t)FSb[(Y3) & 0xFF]) ^
-		((uint32_t)FSb[(Y0 >> 8) & 0xFF] << 8) ^
-		((uint32_t)FSb[(Y1 >> 16) & 0xFF] << 16) ^
-		((uint32_t)FSb[(Y2 >> 24) & 0xFF] << 24);
+	AES_FLAST(X0, X1, X2, X3, Y0, Y1, Y2, Y3);
 
 	PUT_UINT32_BE(X0, output, 12);
 	PUT_UINT32_BE(X1, output, 8);
 	PUT_UINT32_BE(X2, output, 4);
 	PUT_UINT32_BE(X3, output, 0);
 }
+#endif
 
+/*
+ * FIPS-197 appendix C.1 test vector, byte reversed to match the _be functions
+ */
+static const unsigned char aes_test_key[16] = {
+	0x0f, 0x0e, 0x0d, 0x0c, 0x0b, 0x0a, 0x09, 0x08,
+	0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01, 0x00
+};
+
+static const unsigned char aes_test_pt[16] = {
+	0xff, 0xee, 0xdd, 0xcc, 0xbb, 0xaa, 0x99, 0x88,
+	0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11, 0x00
+};
+
+static const unsigned char aes_test_ct[16] = {
+	0x5a, 0xc5, 0xb4, 0x70, 0x80, 0xb7, 0xcd, 0xd8,
+	0x30, 0x04, 0x7b, 0x6a, 0xd8, 0xe0, 0xc4, 0x69
+};
+
+// returns 0 on success, like mbedtls_aes_self_test()
+int aes_self_test(void) {
+	uint32_t rk[RK_LEN];
+	unsigned char buf[16];
+	aes_set_key_enc_128_be(rk, aes_test_key);
+	aes_encrypt_128_be(rk, aes_test_pt, buf);
+	if (memcmp(buf, aes_test_ct, 16) != 0) {
+		return 1;
+	}
+#ifdef AES_ENCRYPT_REF
+	aes_encrypt_128_be_ref(rk, aes_test_pt, buf);
+	if (memcmp(buf, aes_test_ct, 16) != 0) {
+		return 2;
+	}
+#endif
+	return 0;
+}
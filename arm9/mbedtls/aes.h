@@ -5,6 +5,10 @@
 
 #define RK_LEN 44 //round key length
 
+// one 1KB T table instead of four, leaves 3KB more DTCM for nandio
+// comment it out to get the four table layout back
+#define AES_FEWER_TABLES
+
 // modified to work on reversed byte order input/output
 // it could work by wrapping it between byte reversed I/O, minmize modification to actual AES code
 // this is just my OCD to eliminate some copy
@@ -24,9 +28,20 @@
 	(b)[i + 2] = ((uint8_t*)&(n))[1]; \
 	(b)[i + 3] = ((uint8_t*)&(n))[0]
 
-void aes_gen_tables(void);
-
 void aes_set_key_enc_128_be(uint32_t rk[RK_LEN], const unsigned char *key);
 
 void aes_encrypt_128_be(const uint32_t rk[RK_LEN], const unsigned char input[16], unsigned char output[16]);
 
+void aes_crypt_ctr_128_be(const uint32_t rk[RK_LEN], uint32_t ctr[4], uint32_t *out, const uint32_t *in, unsigned count);
+
+void aes_ccm_crypt_128_be(const uint32_t rk[RK_LEN], uint32_t ctr[4], uint32_t mac[4],
+	uint32_t *out, const uint32_t *in, unsigned count, int decrypt);
+
+// build the old DTCM global state version too, to compare against in aes_test()
+// #define AES_ENCRYPT_REF
+#ifdef AES_ENCRYPT_REF
+void aes_encrypt_128_be_ref(const uint32_t rk[RK_LEN], const unsigned char input[16], unsigned char output[16]);
+#endif
+
+int aes_self_test(void);
+
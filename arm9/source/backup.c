@@ -0,0 +1,433 @@
+#include <nds.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <string.h>
+#include "../term256/term256ext.h"
+#include "blkutil.h"
+#include "backup.h"
+
+#define SECTOR_SIZE 512
+#define BLOCK_SIZE (BACKUP_BLOCK_LEN * SECTOR_SIZE)
+
+// the hashes of the last backup, if it was of a source this size
+static bool load_index(const char *index_name, sec_t sectors, backup_index_header_t *h, u8 *hashes) {
+	FILE *f = fopen(index_name, "rb");
+	if (f == 0) {
+		return false;
+	}
+	bool ok = fread(h, sizeof(*h), 1, f) == 1
+		&& h->magic == BACKUP_INDEX_MAGIC && h->version == BACKUP_INDEX_VERSION
+		&& h->block_len == BACKUP_BLOCK_LEN && h->sectors == sectors
+		&& h->blocks == (sectors + BACKUP_BLOCK_LEN - 1) / BACKUP_BLOCK_LEN
+		&& fread(hashes, SHA1_LEN, h->blocks, f) == h->blocks;
+	fclose(f);
+	return ok;
+}
+
+static bool save_index(const char *index_name, const backup_index_header_t *h, const u8 *hashes) {
+	FILE *f = fopen(index_name, "wb");
+	if (f == 0) {
+		return false;
+	}
+	bool ok = fwrite(h, sizeof(*h), 1, f) == 1
+		&& fwrite(hashes, SHA1_LEN, h->blocks, f) == h->blocks;
+	return fclose(f) == 0 && ok;
+}
+
+// the image from the last backup, if it's still the size it would be now
+static FILE *open_previous(const char *name, u32 size) {
+	FILE *f = fopen(name, "r+b");
+	if (f == 0) {
+		return 0;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || ftell(f) != (long)size) {
+		fclose(f);
+		return 0;
+	}
+	return f;
+}
+
+// the blocks staged in part_name, in order, into the image where they belong, then the footer
+static bool apply_staged(FILE *img, const char *part_name, const u8 *changed, u32 blocks, sec_t total,
+	u8 *buf, const void *footer, u32 footer_len)
+{
+	FILE *f = fopen(part_name, "rb");
+	if (f == 0) {
+		return false;
+	}
+	bool ok = true;
+	// where the image's file position is, in blocks
+	u32 pos = (u32)-1;
+	for (u32 b = 0; ok && b < blocks; ++b) {
+		if (!test_bit(changed, b)) {
+			continue;
+		}
+		sec_t start = b * BACKUP_BLOCK_LEN;
+		sec_t n = min_sec(BACKUP_BLOCK_LEN, total - start);
+		// libfat walks the cluster chain to seek, not when it's already there
+		ok = fread(buf, SECTOR_SIZE, n, f) == n
+			&& (pos == b || fseek(img, (long)start * SECTOR_SIZE, SEEK_SET) == 0)
+			&& fwrite(buf, SECTOR_SIZE, n, img) == n;
+		pos = b + 1;
+	}
+	if (ok && footer_len > 0) {
+		ok = (pos == blocks || fseek(img, (long)total * SECTOR_SIZE, SEEK_SET) == 0)
+			&& fwrite(footer, footer_len, 1, img) == 1;
+	}
+	fclose(f);
+	return ok;
+}
+
+int backup_image(raw_t *src, const char *name, const char *index_name, u8 *buf,
+	const void *footer, u32 footer_len, const u8 *image_sha1, size_t space,
+	swiSHA1context_t *sha1ctx, bool (*aborted)(), backup_stats_t *st)
+{
+	memset(st, 0, sizeof(*st));
+	sec_t total = src->sectors;
+	u32 image_size = total * SECTOR_SIZE + footer_len;
+	backup_index_header_t h;
+	st->blocks = (total + BACKUP_BLOCK_LEN - 1) / BACKUP_BLOCK_LEN;
+	u8 *hashes = (u8*)malloc(st->blocks * SHA1_LEN);
+	u8 *changed = (u8*)malloc((st->blocks + 7) / 8);
+	char *part_name = (char*)malloc(strlen(name) + 6);
+	if (hashes == 0 || changed == 0 || part_name == 0) {
+		prt("failed to alloc memory\n");
+		free(hashes);
+		free(changed);
+		free(part_name);
+		return -1;
+	}
+	memset(changed, 0, (st->blocks + 7) / 8);
+	sprintf(part_name, "%s.part", name);
+	// the index only counts with the image its SHA1 says it was made of
+	FILE *img = 0;
+	if (image_sha1 != 0 && load_index(index_name, total, &h, hashes)
+		&& memcmp(h.image_sha1, image_sha1, SHA1_LEN) == 0)
+	{
+		img = open_previous(name, image_size);
+	}
+	st->incremental = img != 0;
+	if (!st->incremental) {
+		memset(&h, 0, sizeof(h));
+		h.magic = BACKUP_INDEX_MAGIC;
+		h.version = BACKUP_INDEX_VERSION;
+		h.block_len = BACKUP_BLOCK_LEN;
+		h.sectors = total;
+		h.blocks = st->blocks;
+	}
+	FILE *f = 0;
+	// an update only needs room for the blocks that changed, that's found out on the way
+	if (!st->incremental && space < image_size) {
+		prt("insufficient SD space\n");
+	} else if ((f = fopen(part_name, "wb")) == 0) {
+		iprtf("failed to open %s to write\n", part_name);
+	}
+	if (f == 0) {
+		if (img != 0) {
+			fclose(img);
+		}
+		free(hashes);
+		free(changed);
+		free(part_name);
+		return -1;
+	}
+	iprtf("%s: %" PRIu32 " MB, %s\n", name, total / MB_SECTORS, st->incremental ? "changed blocks" : "full");
+
+	swiSHA1Init(sha1ctx);
+	u8 *bufs[2] = { buf, buf + BLOCK_SIZE };
+	// writing blocks alone, for write_ticks
+	u64 fwrite_ticks = 0;
+	u32 t_report = blk_clock();
+	sec_t done = 0, reported = 0;
+	unsigned cur = 0;
+	bool ok = src->start(src, BLK_READ, 0, min_sec(BACKUP_BLOCK_LEN, total), bufs[0]);
+	bool pending = ok, stopped = false;
+	for (u32 b = 0; ok && b < st->blocks; ++b) {
+		sec_t n = min_sec(BACKUP_BLOCK_LEN, total - done);
+		u32 t = blk_clock();
+		ok = src->wait(src);
+		pending = false;
+		st->read_ticks += blk_clock() - t;
+		if (!ok) {
+			iprtf("\nfailed to read sector %" PRIu32 "\n", done);
+			break;
+		}
+		sec_t next = done + n;
+		if (next < total) {
+			pending = ok = src->start(src, BLK_READ, next, min_sec(BACKUP_BLOCK_LEN, total - next), bufs[cur ^ 1]);
+			if (!ok) {
+				iprtf("\nfailed to read sector %" PRIu32 "\n", next);
+				break;
+			}
+		}
+		t = blk_clock();
+		swiSHA1Update(sha1ctx, bufs[cur], n * SECTOR_SIZE);
+		u8 digest[SHA1_LEN];
+		swiSHA1Calc(digest, bufs[cur], n * SECTOR_SIZE);
+		u8 *entry = hashes + b * SHA1_LEN;
+		if (!st->incremental || memcmp(digest, entry, SHA1_LEN) != 0) {
+			// staged in order, appended
+			u32 tw = blk_clock();
+			ok = fwrite(bufs[cur], SECTOR_SIZE, n, f) == n;
+			fwrite_ticks += blk_clock() - tw;
+			if (!ok) {
+				iprtf("\nerror writing %s\n", part_name);
+				break;
+			}
+			memcpy(entry, digest, SHA1_LEN);
+			set_bit(changed, b);
+			++st->changed;
+		}
+		st->write_ticks += blk_clock() - t;
+		done = next;
+		cur ^= 1;
+		u32 now = blk_clock();
+		if (now - t_report >= REPORT_TICKS || done == total) {
+			st->elapsed += now - t_report;
+			report_progress(done, total, done - reported, now - t_report);
+			t_report = now;
+			reported = done;
+		}
+		if (aborted != 0 && aborted()) {
+			prt("\naborted\n");
+			stopped = true;
+			ok = false;
+		}
+	}
+	// the source still has the buffer
+	if (pending) {
+		src->wait(src);
+	}
+	if (ok && footer_len > 0) {
+		swiSHA1Update(sha1ctx, footer, footer_len);
+		// an update puts it in place with the blocks
+		ok = st->incremental || fwrite(footer, footer_len, 1, f) == 1;
+	}
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		if (!stopped) {
+			iprtf("failed to write %s\n", part_name);
+		}
+		// the image, its index and its .sha1 are still those of the last backup
+		remove(part_name);
+		if (img != 0) {
+			fclose(img);
+		}
+		free(hashes);
+		free(changed);
+		free(part_name);
+		return -1;
+	}
+
+	// from here on the image doesn't match its index, nor its .sha1
+	remove(index_name);
+	st->touched = true;
+	u32 t = blk_clock();
+	if (st->incremental) {
+		ok = apply_staged(img, part_name, changed, st->blocks, total, bufs[0], footer, footer_len);
+		if (fclose(img) != 0) {
+			ok = false;
+		}
+		remove(part_name);
+	} else {
+		// there may be none yet
+		remove(name);
+		ok = rename(part_name, name) == 0;
+	}
+	st->apply_ticks = blk_clock() - t;
+	if (!ok) {
+		iprtf("failed to write %s, it's partly updated\n", name);
+		free(hashes);
+		free(changed);
+		free(part_name);
+		return -1;
+	}
+	// only a full backup measures what writing the whole image costs, an update writes its blocks twice
+	if (!st->incremental && st->changed > 0) {
+		h.write_ticks = (u32)(fwrite_ticks / st->changed);
+	}
+	// the caller finishes sha1ctx, a copy gives the same SHA1
+	swiSHA1context_t whole = *sha1ctx;
+	swiSHA1Final(h.image_sha1, &whole);
+	st->saved_ticks = (u64)(st->blocks - st->changed) * h.write_ticks;
+	st->sd_ticks = fwrite_ticks;
+	if (!save_index(index_name, &h, hashes)) {
+		iprtf("failed to write %s\n", index_name);
+	}
+	free(hashes);
+	free(changed);
+	free(part_name);
+	return 0;
+}
+
+// the next block is read while this one is compared with the image's, mismatches are written from the image
+// with the image's index, a block has to hash to its entry before it's written
+// the runs written are read back at the end, against the hashes of what was written
+int restore_image(raw_t *dst, const char *name, const char *index_name, u8 *buf,
+	u32 image_size, const u8 *image_sha1, bool (*aborted)(), restore_stats_t *st)
+{
+	memset(st, 0, sizeof(*st));
+	sec_t total = dst->sectors;
+	st->blocks = (total + BACKUP_BLOCK_LEN - 1) / BACKUP_BLOCK_LEN;
+	FILE *f = fopen(name, "rb");
+	if (f == 0) {
+		iprtf("failed to open %s\n", name);
+		return -1;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || ftell(f) != (long)image_size || image_size < total * SECTOR_SIZE
+		|| fseek(f, 0, SEEK_SET) != 0)
+	{
+		iprtf("%s doesn't fit the NAND\n", name);
+		fclose(f);
+		return -1;
+	}
+	u8 *hashes = (u8*)malloc(st->blocks * SHA1_LEN);
+	u8 *written = (u8*)malloc((st->blocks + 7) / 8);
+	u8 *img = (u8*)memalign(32, BLOCK_SIZE);
+	if (hashes == 0 || written == 0 || img == 0) {
+		prt("failed to alloc memory\n");
+		free(hashes);
+		free(written);
+		free(img);
+		fclose(f);
+		return -1;
+	}
+	memset(written, 0, (st->blocks + 7) / 8);
+	backup_index_header_t h;
+	bool have_index = load_index(index_name, total, &h, hashes);
+	// one of them isn't of this image, nothing says which blocks can be trusted
+	if (image_sha1 != 0 && have_index && memcmp(h.image_sha1, image_sha1, SHA1_LEN) != 0) {
+		iprtf("%s and %s's .sha1 don't match, not restoring\n", index_name, name);
+		free(hashes);
+		free(written);
+		free(img);
+		fclose(f);
+		return -1;
+	}
+	st->indexed = image_sha1 != 0 && have_index;
+	iprtf("%s: %" PRIu32 " MB, %s\n", name, total / MB_SECTORS, st->indexed ? "checked against its index" : "no index");
+
+	u8 *bufs[2] = { buf, buf + BLOCK_SIZE };
+	u32 t_report = blk_clock();
+	sec_t done = 0, reported = 0;
+	unsigned cur = 0;
+	bool ok = dst->start(dst, BLK_READ, 0, min_sec(BACKUP_BLOCK_LEN, total), bufs[0]);
+	bool pending = ok, stopped = false, run = false;
+	for (u32 b = 0; ok && b < st->blocks; ++b) {
+		sec_t n = min_sec(BACKUP_BLOCK_LEN, total - done);
+		u32 t = blk_clock();
+		ok = dst->wait(dst);
+		pending = false;
+		st->read_ticks += blk_clock() - t;
+		if (!ok) {
+			iprtf("\nfailed to read sector %" PRIu32 "\n", done);
+			break;
+		}
+		sec_t next = done + n;
+		if (next < total) {
+			pending = ok = dst->start(dst, BLK_READ, next, min_sec(BACKUP_BLOCK_LEN, total - next), bufs[cur ^ 1]);
+			if (!ok) {
+				iprtf("\nfailed to read sector %" PRIu32 "\n", next);
+				break;
+			}
+		}
+		// the image is read in order, alongside the NAND
+		if (fread(img, SECTOR_SIZE, n, f) != n) {
+			iprtf("\nerror reading %s\n", name);
+			ok = false;
+			break;
+		}
+		bool differs = memcmp(img, bufs[cur], n * SECTOR_SIZE) != 0;
+		if (differs) {
+			u8 *entry = hashes + b * SHA1_LEN;
+			u8 digest[SHA1_LEN];
+			swiSHA1Calc(digest, img, n * SECTOR_SIZE);
+			if (st->indexed && memcmp(digest, entry, SHA1_LEN) != 0) {
+				iprtf("\n%s doesn't match %s at sector %" PRIu32 "\n", name, index_name, done);
+				ok = false;
+				break;
+			}
+			// what the verify pass reads back against
+			memcpy(entry, digest, SHA1_LEN);
+			// the ring does them in order, but the read ahead's result has to be taken first
+			if (pending) {
+				t = blk_clock();
+				ok = dst->wait(dst);
+				pending = false;
+				st->read_ticks += blk_clock() - t;
+				if (!ok) {
+					iprtf("\nfailed to read sector %" PRIu32 "\n", next);
+					break;
+				}
+			}
+			t = blk_clock();
+			ok = dst->start(dst, BLK_WRITE, done, n, img) && dst->wait(dst);
+			st->write_ticks += blk_clock() - t;
+			if (!ok) {
+				iprtf("\nfailed to write sector %" PRIu32 "\n", done);
+				break;
+			}
+			set_bit(written, b);
+			++st->changed;
+			st->runs += !run;
+			if (next < total) {
+				// already waited for above
+				pending = ok = dst->start(dst, BLK_READ, next, min_sec(BACKUP_BLOCK_LEN, total - next), bufs[cur ^ 1]);
+				if (!ok) {
+					iprtf("\nfailed to read sector %" PRIu32 "\n", next);
+					break;
+				}
+			}
+		}
+		run = differs;
+		done = next;
+		cur ^= 1;
+		u32 now = blk_clock();
+		if (now - t_report >= REPORT_TICKS || done == total) {
+			st->elapsed += now - t_report;
+			report_progress(done, total, done - reported, now - t_report);
+			t_report = now;
+			reported = done;
+		}
+		if (aborted != 0 && aborted()) {
+			prt("\naborted\n");
+			stopped = true;
+			ok = false;
+		}
+	}
+	// the ring still has the buffer
+	if (pending) {
+		dst->wait(dst);
+	}
+	fclose(f);
+	free(img);
+	// what was written is checked even if it didn't get to the end
+	for (u32 b = 0; b < st->blocks; ++b) {
+		if (!test_bit(written, b)) {
+			continue;
+		}
+		sec_t start = b * BACKUP_BLOCK_LEN;
+		sec_t n = min_sec(BACKUP_BLOCK_LEN, total - start);
+		u8 digest[SHA1_LEN];
+		u32 t = blk_clock();
+		if (!(dst->start(dst, BLK_READ, start, n, bufs[0]) && dst->wait(dst))) {
+			memset(digest, 0, SHA1_LEN);
+		} else {
+			swiSHA1Calc(digest, bufs[0], n * SECTOR_SIZE);
+		}
+		st->verify_ticks += blk_clock() - t;
+		if (memcmp(digest, hashes + b * SHA1_LEN, SHA1_LEN) != 0) {
+			iprtf("verify failed at sector %" PRIu32 "\n", start);
+			++st->bad;
+		}
+	}
+	free(hashes);
+	free(written);
+	if (!ok && !stopped) {
+		prt("restore failed\n");
+	}
+	return ok && st->bad == 0 ? 0 : -1;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <nds.h>
+#include "blkdev.h"
+#include "crypto.h"
+
+// NAND to an image file, nand.bin, with an index of per block hashes next to it, nand.bin.idx
+// with an index matching the image, only the blocks whose hash changed are written again
+// they're staged in nand.bin.part first, the image is only touched once the source was read to the end
+// the source is read in full either way, the next block while this one is hashed
+// on the DS the eMMC read and the SD write both go through the ARM7, they take turns, not overlap
+// restore is the same the other way around, only what differs from the image goes to the NAND
+// the index is tied to the image by the SHA1 of the whole file, the same as its .sha1
+
+#define BACKUP_INDEX_MAGIC 0x5842494e // "NIBX"
+#define BACKUP_INDEX_VERSION 1
+// sectors, 32KB
+#define BACKUP_BLOCK_LEN 64
+
+typedef struct {
+	u32 magic;
+	u16 version;
+	u16 block_len;
+	u32 sectors;
+	u32 blocks;
+	// what writing a block took on average, the last time any was written
+	u32 write_ticks;
+	u32 reserved;
+	// of the whole image, footer and all, an index is only used with the image it was made with
+	u8 image_sha1[SHA1_LEN];
+} backup_index_header_t;
+
+typedef struct {
+	bool incremental;
+	u32 blocks;
+	u32 changed; // written
+	u64 read_ticks; // waiting for the source
+	u64 write_ticks; // hashing and writing
+	u64 sd_ticks; // the writing alone, part of write_ticks
+	u64 saved_ticks; // the unchanged blocks, at the last measured write speed
+	u64 apply_ticks; // the staged blocks into the image, or the full one renamed
+	u64 elapsed;
+	bool touched; // the image was written to, its .sha1 is no good any more, even if it failed
+} backup_stats_t;
+
+typedef struct {
+	bool indexed; // the blocks written were checked against the index first
+	u32 blocks;
+	u32 changed; // written
+	u32 runs; // of consecutive blocks written
+	u32 bad; // written blocks which didn't read back the same
+	u64 read_ticks; // waiting for the NAND
+	u64 write_ticks;
+	u64 verify_ticks;
+	u64 elapsed;
+} restore_stats_t;
+
+// buf is two blocks, whole cache lines in main RAM
+// the footer goes after the sectors, sha1ctx gets the SHA1 of the whole file
+// image_sha1 is the SHA1 of the image there is, from its .sha1, the index is only used if it has the same,
+// it may be 0, then it's a full backup, which needs space, what's free for it, for the whole image
+// beside the old one
+// aborted is polled between blocks, it may be 0
+// aborted or failed while the source is read, the image, its index and its .sha1 are left as they were
+int backup_image(raw_t *src, const char *name, const char *index_name, u8 *buf,
+	const void *footer, u32 footer_len, const u8 *image_sha1, size_t space,
+	swiSHA1context_t *sha1ctx, bool (*aborted)(), backup_stats_t *st);
+
+// the image's first dst->sectors sectors, whatever follows, the footer, is the caller's business
+// buf is two blocks, the same as for backup_image
+// image_sha1 is the SHA1 of the whole image from its .sha1, the index has to have the same,
+// if it doesn't, nothing is written, it may be 0, then the image is restored without its index
+// the written runs are read back and compared at the end
+int restore_image(raw_t *dst, const char *name, const char *index_name, u8 *buf,
+	u32 image_size, const u8 *image_sha1, bool (*aborted)(), restore_stats_t *st);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <nds.h>
+#include <nds/disc_io.h>
+
+// the NAND block devices are stacks of layers, each one works on the one below it
+//	raw (eMMC, image file or memory) <- crypto <- cache <- stats <- DISC_INTERFACE
+// nandio.c and imgio.c only differ in the raw layer
+
+typedef enum {
+	BLK_READ = 1,
+	BLK_WRITE = 2
+} blk_op_t;
+
+typedef struct blk_s blk_t;
+
+struct blk_s {
+	bool (*read)(blk_t *b, sec_t start, sec_t len, void *buffer);
+	bool (*write)(blk_t *b, sec_t start, sec_t len, const void *buffer);
+	// writes out what this layer and the ones below are holding back
+	bool (*sync)(blk_t *b);
+};
+
+typedef struct raw_s raw_t;
+
+// start may return before the transfer is done, wait returns when the oldest one started is
+// the crypto layer never has more than one started
+struct raw_s {
+	bool (*start)(raw_t *r, blk_op_t op, sec_t start, sec_t len, void *buffer);
+	bool (*wait)(raw_t *r);
+	// buffers start can transfer into directly, the rest bounce through the crypto layer's buffer
+	bool (*is_direct)(const void *p);
+	sec_t sectors;
+};
+
+typedef struct raw_sync_s raw_sync_t;
+
+// a raw device on stdio, which can't work in the background, start does the whole transfer
+// with rw and wait only hands back how it went, the device's struct starts with this
+struct raw_sync_s {
+	raw_t base;
+	bool (*rw)(raw_sync_t *r, blk_op_t op, sec_t start, sec_t len, void *buffer);
+	bool ok;
+};
+
+static inline bool raw_sync_start(raw_t *raw, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	raw_sync_t *r = (raw_sync_t*)raw;
+	r->ok = r->rw(r, op, start, len, buffer);
+	return true;
+}
+
+static inline bool raw_sync_wait(raw_t *raw) {
+	return ((raw_sync_t*)raw)->ok;
+}
+
+static inline void raw_sync_init(raw_sync_t *r,
+	bool (*rw)(raw_sync_t*, blk_op_t, sec_t, sec_t, void*), bool (*is_direct)(const void*))
+{
+	r->base.start = raw_sync_start;
+	r->base.wait = raw_sync_wait;
+	r->base.is_direct = is_direct;
+	r->base.sectors = 0;
+	r->rw = rw;
+	r->ok = false;
+}
+
+// the crypto layer decrypts in place, 32 bit words
+static inline bool blk_word_is_direct(const void *p) {
+	return ((u32)p & 3) == 0;
+}
+
+// the ARM7 writes the buffer, so it has to be in main RAM and whole cache lines
+// otherwise the cache maintenance around the transfer could clobber neighbouring data
+static inline bool blk_line_is_direct(const void *p) {
+	return ((u32)p & 31) == 0 && (u32)p >= 0x02000000 && (u32)p < 0x03000000;
+}
+
+// timers 2 and 3 cascaded, free running at BUS_CLOCK, cpuStartTiming users keep 0 and 1
+// wraps every 128 seconds, differences are fine for anything shorter
+void blk_clock_start();
+
+static inline u32 blk_clock() {
+	u32 hi, lo;
+	do {
+		hi = TIMER_DATA(3);
+		lo = TIMER_DATA(2);
+	} while (hi != TIMER_DATA(3));
+	return (hi << 16) | lo;
+}
@@ -0,0 +1,222 @@
+#include <nds.h>
+#include <malloc.h>
+#include <string.h>
+#include "../term256/term256ext.h"
+#include "blkstack.h"
+#include "trace.h"
+
+#define SECTOR_SIZE 512
+
+static bool cache_read(blk_t *b, sec_t start, sec_t len, void *buffer) {
+	cache_dev_t *c = (cache_dev_t*)b;
+	return sector_cache_read(&c->cache, start, len, buffer, c->lower);
+}
+
+static bool cache_write(blk_t *b, sec_t start, sec_t len, const void *buffer) {
+	cache_dev_t *c = (cache_dev_t*)b;
+	// FAT, directory entries and FSInfo, merged and written at the next flush
+	if (len <= SECTOR_CACHE_MAX_RUN) {
+		return sector_cache_write_back(&c->cache, start, len, buffer);
+	}
+	sector_cache_write(&c->cache, start, len, buffer);
+	if (!c->lower->write(c->lower, start, len, buffer)) {
+		// what's on the medium is unknown now
+		sector_cache_drop(&c->cache, start, len);
+		return false;
+	}
+	return true;
+}
+
+static bool cache_sync(blk_t *b) {
+	cache_dev_t *c = (cache_dev_t*)b;
+	return sector_cache_flush(&c->cache) && c->lower->sync(c->lower);
+}
+
+bool cache_dev_init(cache_dev_t *c, blk_t *lower) {
+	c->base.read = cache_read;
+	c->base.write = cache_write;
+	c->base.sync = cache_sync;
+	c->lower = lower;
+	if (c->cache.data == 0 && !sector_cache_init(&c->cache, SECTOR_CACHE_SETS, SECTOR_CACHE_WAYS)) {
+		return false;
+	}
+	if (c->run_buf == 0) {
+		c->run_buf = (u8*)memalign(32, SECTOR_SIZE * SECTOR_CACHE_DIRTY_MAX);
+		if (c->run_buf == 0) {
+			sector_cache_free(&c->cache);
+			return false;
+		}
+	}
+	sector_cache_set_writer(&c->cache, c->run_buf, SECTOR_CACHE_DIRTY_MAX, lower);
+	return true;
+}
+
+void cache_dev_free(cache_dev_t *c) {
+	sector_cache_free(&c->cache);
+	free(c->run_buf);
+	c->run_buf = 0;
+}
+
+void blk_clock_start() {
+	if (TIMER_CR(2) & TIMER_ENABLE) {
+		return;
+	}
+	TIMER_DATA(2) = 0;
+	TIMER_DATA(3) = 0;
+	TIMER_CR(3) = TIMER_CASCADE | TIMER_ENABLE;
+	TIMER_CR(2) = TIMER_DIV_1 | TIMER_ENABLE;
+}
+
+// 0 for x = 0, floor(log2(x)) + 1 otherwise, clamped to the last bucket
+static inline unsigned bucket(u32 x, unsigned len) {
+	unsigned i = x == 0 ? 0 : 32 - __builtin_clz(x);
+	return i < len - 1 ? i : len - 1;
+}
+
+static void account(blk_op_stats_t *st, sec_t len, u32 ticks, bool ok) {
+	++st->calls;
+	st->sectors += len;
+	st->ticks += ticks;
+	if (!ok) {
+		++st->errors;
+	}
+	// len is never 0, the first size bucket is single sectors
+	++st->size_hist[bucket(len, BLK_SIZE_HIST_LEN + 1) - 1];
+	++st->lat_hist[bucket(timerTicks2usec(ticks) >> BLK_LAT_HIST_SHIFT, BLK_LAT_HIST_LEN)];
+}
+
+static bool stats_read(blk_t *b, sec_t start, sec_t len, void *buffer) {
+	stats_dev_t *s = (stats_dev_t*)b;
+	if (s->traced) {
+		trace_record(NANDTRACE_READ, s->trace_dev, start, len);
+	}
+	u32 t = blk_clock();
+	bool ret = s->lower->read(s->lower, start, len, buffer);
+	account(&s->stats.read, len, blk_clock() - t, ret);
+	return ret;
+}
+
+static bool stats_write(blk_t *b, sec_t start, sec_t len, const void *buffer) {
+	stats_dev_t *s = (stats_dev_t*)b;
+	if (s->traced) {
+		trace_record(NANDTRACE_WRITE, s->trace_dev, start, len);
+	}
+	u32 t = blk_clock();
+	bool ret = s->lower->write(s->lower, start, len, buffer);
+	account(&s->stats.write, len, blk_clock() - t, ret);
+	return ret;
+}
+
+static bool stats_sync(blk_t *b) {
+	stats_dev_t *s = (stats_dev_t*)b;
+	if (s->traced) {
+		trace_record(NANDTRACE_SYNC, s->trace_dev, 0, 0);
+	}
+	return s->lower->sync(s->lower);
+}
+
+void stats_dev_init(stats_dev_t *s, blk_t *lower) {
+	s->base.read = stats_read;
+	s->base.write = stats_write;
+	s->base.sync = stats_sync;
+	s->lower = lower;
+	memset(&s->stats, 0, sizeof(s->stats));
+}
+
+static inline bool cached(const blkstack_t *s) {
+	return s->cache.cache.data != 0;
+}
+
+void blkstack_set_crypt_ctx(blkstack_t *s, const dsi_crypt_ctx_t *ctx) {
+	// different keys, different plain text, what's dirty goes out with the old keys first
+	if (cached(s) && s->crypt.ctx != 0) {
+		sector_cache_flush(&s->cache.cache);
+		sector_cache_invalidate(&s->cache.cache);
+	}
+	s->crypt.ctx = ctx;
+}
+
+void blkstack_set_fat_sig_fix(blkstack_t *s, u32 offset) {
+	s->crypt.fat_sig_fix_offset = offset;
+}
+
+// survives startup, set it before
+void blkstack_set_trace_dev(blkstack_t *s, nandtrace_dev_t dev) {
+	s->stats.traced = true;
+	s->stats.trace_dev = dev;
+}
+
+bool blkstack_startup(blkstack_t *s, raw_t *raw, const char *name) {
+	if (s->top != 0) {
+		return true;
+	}
+	if (s->crypt.ctx == 0) {
+		iprtf("%s: no crypt context\n", name);
+		return false;
+	}
+	blk_clock_start();
+	if (!crypt_dev_init(&s->crypt, raw, name)) {
+		return false;
+	}
+	blk_t *b = &s->crypt.base;
+	// not fatal, reads just go to the medium every time
+	if (cache_dev_init(&s->cache, b)) {
+		b = &s->cache.base;
+	} else {
+		iprtf("%s: failed to alloc cache\n", name);
+	}
+	stats_dev_init(&s->stats, b);
+	s->top = &s->stats.base;
+	return true;
+}
+
+// false until blkstack_startup
+bool blkstack_read(blkstack_t *s, sec_t start, sec_t len, void *buffer) {
+	if (s->top == 0) {
+		return false;
+	}
+	return s->top->read(s->top, start, len, buffer);
+}
+
+bool blkstack_write(blkstack_t *s, sec_t start, sec_t len, const void *buffer) {
+	if (s->top == 0) {
+		return false;
+	}
+	return s->top->write(s->top, start, len, buffer);
+}
+
+// writes out what the cache is holding back
+bool blkstack_sync(blkstack_t *s) {
+	if (s->top == 0) {
+		return true;
+	}
+	return s->top->sync(s->top);
+}
+
+// the medium was written past the stack, nothing it holds is any good
+// sync first, anything dirty is dropped here
+void blkstack_invalidate(blkstack_t *s) {
+	if (cached(s)) {
+		sector_cache_invalidate(&s->cache.cache);
+	}
+	readahead_drop(&s->crypt.ra);
+}
+
+// straight to the medium, past the cache
+bool blkstack_read_sha1(blkstack_t *s, sec_t start, sec_t len, void *buffer, swiSHA1context_t *sha1ctx) {
+	if (s->top == 0 || !blkstack_sync(s)) {
+		return false;
+	}
+	if (s->stats.traced) {
+		trace_record(NANDTRACE_READ_SHA1, s->stats.trace_dev, start, len);
+	}
+	return crypt_dev_read_sha1(&s->crypt, start, len, buffer, sha1ctx);
+}
+
+bool blkstack_shutdown(blkstack_t *s) {
+	bool ret = blkstack_sync(s);
+	cache_dev_free(&s->cache);
+	crypt_dev_free(&s->crypt);
+	s->top = 0;
+	return ret;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <nds.h>
+#include "blkdev.h"
+#include "cryptdev.h"
+#include "sector_cache.h"
+#include "nandtrace.h"
+
+// the cache layer, decrypted sectors above and below
+typedef struct {
+	blk_t base;
+	blk_t *lower;
+	sector_cache_t cache;
+	u8 *run_buf; // SECTOR_CACHE_DIRTY_MAX sectors, dirty runs are gathered here on flush
+} cache_dev_t;
+
+bool cache_dev_init(cache_dev_t *c, blk_t *lower);
+
+void cache_dev_free(cache_dev_t *c);
+
+// request sizes, 1, 2-3, 4-7 ... 256 sectors and more
+#define BLK_SIZE_HIST_LEN 9
+// latencies, under 64us, 64-127us ... 64ms and more
+#define BLK_LAT_HIST_LEN 12
+#define BLK_LAT_HIST_SHIFT 6
+
+typedef struct {
+	u32 calls;
+	u32 sectors;
+	u32 errors;
+	u64 ticks; // BUS_CLOCK
+	u32 size_hist[BLK_SIZE_HIST_LEN];
+	u32 lat_hist[BLK_LAT_HIST_LEN];
+} blk_op_stats_t;
+
+typedef struct {
+	blk_op_stats_t read;
+	blk_op_stats_t write;
+} blk_stats_t;
+
+// the statistics layer, counts and times what goes through
+typedef struct {
+	blk_t base;
+	blk_t *lower;
+	blk_stats_t stats;
+	bool traced;
+	nandtrace_dev_t trace_dev;
+} stats_dev_t;
+
+void stats_dev_init(stats_dev_t *s, blk_t *lower);
+
+// raw <- crypto <- cache (if it could be allocated) <- stats
+typedef struct {
+	crypt_dev_t crypt;
+	cache_dev_t cache;
+	stats_dev_t stats;
+	blk_t *top;
+} blkstack_t;
+
+void blkstack_set_crypt_ctx(blkstack_t *s, const dsi_crypt_ctx_t *ctx);
+
+void blkstack_set_fat_sig_fix(blkstack_t *s, u32 offset);
+
+void blkstack_set_trace_dev(blkstack_t *s, nandtrace_dev_t dev);
+
+bool blkstack_startup(blkstack_t *s, raw_t *raw, const char *name);
+
+bool blkstack_read(blkstack_t *s, sec_t start, sec_t len, void *buffer);
+
+bool blkstack_write(blkstack_t *s, sec_t start, sec_t len, const void *buffer);
+
+bool blkstack_sync(blkstack_t *s);
+
+void blkstack_invalidate(blkstack_t *s);
+
+bool blkstack_read_sha1(blkstack_t *s, sec_t start, sec_t len, void *buffer, swiSHA1context_t *sha1ctx);
+
+bool blkstack_shutdown(blkstack_t *s);
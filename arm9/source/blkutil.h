@@ -0,0 +1,44 @@
+#pragma once
+
+#include <nds.h>
+#include <inttypes.h>
+#include "../term256/term256ext.h"
+#include "blkdev.h"
+
+// bits of the image code, backup, partdump, fatmap and overlay have in common
+
+#define MB_SECTORS (1024 * 1024 / 512)
+// progress every this many ticks, well before blk_clock wraps
+#define REPORT_TICKS (BUS_CLOCK / 2)
+
+static inline sec_t min_sec(sec_t a, sec_t b) {
+	return a < b ? a : b;
+}
+
+// on disc structures, the MBR and FAT, are little endian and not always aligned
+static inline u16 le16(const u8 *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline u32 le32(const u8 *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static inline bool test_bit(const u8 *bits, u32 i) {
+	return bits[i >> 3] & (1 << (i & 7));
+}
+
+static inline void set_bit(u8 *bits, u32 i) {
+	bits[i >> 3] |= 1 << (i & 7);
+}
+
+static inline void clear_bit(u8 *bits, u32 i) {
+	bits[i >> 3] &= ~(1 << (i & 7));
+}
+
+// MB done of total, and the speed of the sectors since the last one in ticks
+static inline void report_progress(sec_t done, sec_t total, sec_t since, u32 ticks) {
+	iprtf("\r%" PRIu32 "/%" PRIu32 " MB, %" PRIu32 " KB/s   ",
+		done / MB_SECTORS, total / MB_SECTORS,
+		(u32)((u64)since * 512 * BUS_CLOCK / 1024 / ticks));
+}
@@ -0,0 +1,260 @@
+#include <nds.h>
+#include <malloc.h>
+#include <stddef.h>
+#include <string.h>
+#include "../term256/term256ext.h"
+#include "../mbedtls/aes.h"
+#include "crypto.h"
+#include "sector_cache.h"
+#include "cryptdev.h"
+
+#define SECTOR_SIZE 512
+#define CRYPT_BUF_LEN 64
+#define HALF_LEN (CRYPT_BUF_LEN / 2)
+#define STAGE_BUF_LEN 4
+// 4KB, half of the data cache
+#define SHA1_SLICE_LEN 8
+// straight into the caller's buffer, the raw layer transfers one chunk while the CPU decrypts the one before
+#define DIRECT_CHUNK_LEN 64
+
+// dsi_nand_crypt works on 32 bit words, callers' buffers which are not aligned bounce through this
+// ARM7 can't reach DTCM, so it's only ever touched by the CPU, never by the raw layer
+// with AES_FEWER_TABLES it takes DTCM freed by FT1..FT3
+#ifdef AES_FEWER_TABLES
+DTCM_BSS
+#endif
+static u32 stage_buf[SECTOR_SIZE * STAGE_BUF_LEN / sizeof(u32)];
+
+static inline bool is_aligned(const void *p) {
+	return ((u32)p & 3) == 0;
+}
+
+// crypt between crypt_buf and a caller's buffer which is not aligned
+// reading, out is the caller's, writing, in is, the other one is the stack's own
+static void crypt_staged(const dsi_crypt_ctx_t *ctx, blk_op_t op, u8 *out, const u8 *in, sec_t start, sec_t len) {
+	while (len > 0) {
+		sec_t n = len < STAGE_BUF_LEN ? len : STAGE_BUF_LEN;
+		if (op == BLK_READ) {
+			dsi_nand_crypt(ctx, (u8*)stage_buf, in, start * SECTOR_SIZE / AES_BLOCK_SIZE, n * SECTOR_SIZE / AES_BLOCK_SIZE);
+			memcpy(out, stage_buf, n * SECTOR_SIZE);
+		} else {
+			memcpy(stage_buf, in, n * SECTOR_SIZE);
+			dsi_nand_crypt(ctx, out, (u8*)stage_buf, start * SECTOR_SIZE / AES_BLOCK_SIZE, n * SECTOR_SIZE / AES_BLOCK_SIZE);
+		}
+		start += n;
+		len -= n;
+		out += n * SECTOR_SIZE;
+		in += n * SECTOR_SIZE;
+	}
+}
+
+static void crypt_sectors(crypt_dev_t *c, blk_op_t op, u8 *out, const u8 *in, sec_t start, sec_t len) {
+	u32 t = blk_clock();
+	if (is_aligned(out) && is_aligned(in)) {
+		dsi_nand_crypt(c->ctx, out, in, start * SECTOR_SIZE / AES_BLOCK_SIZE, len * SECTOR_SIZE / AES_BLOCK_SIZE);
+	} else {
+		crypt_staged(c->ctx, op, out, in, start, len);
+	}
+	c->time.aes += blk_clock() - t;
+}
+
+// the sector fat_sig_fix_offset might be anywhere in the run
+static void fat_sig_fix(crypt_dev_t *c, sec_t start, sec_t len, u8 *buffer) {
+	u32 t = blk_clock();
+	if (c->fat_sig_fix_offset != 0 && c->fat_sig_fix_offset >= start && c->fat_sig_fix_offset < start + len) {
+		buffer += (c->fat_sig_fix_offset - start) * SECTOR_SIZE;
+		if (buffer[0x36] == 0
+			&& buffer[0x37] == 0
+			&& buffer[0x38] == 0)
+		{
+			buffer[0x36] = 'F';
+			buffer[0x37] = 'A';
+			buffer[0x38] = 'T';
+		}
+	}
+	c->time.fat_fix += blk_clock() - t;
+}
+
+// with sha1ctx, decrypt and hash go slice by slice, so SHA1 reads what AES just wrote while it's still in cache
+static void decrypt_sectors(crypt_dev_t *c, u8 *out, const u8 *in, sec_t start, sec_t len, swiSHA1context_t *sha1ctx) {
+	sec_t slice = sha1ctx != 0 ? SHA1_SLICE_LEN : len;
+	for (sec_t i = 0; i < len; i += slice) {
+		sec_t n = len - i < slice ? len - i : slice;
+		u8 *o = out + i * SECTOR_SIZE;
+		crypt_sectors(c, BLK_READ, o, in + i * SECTOR_SIZE, start + i, n);
+		fat_sig_fix(c, start + i, n, o);
+		if (sha1ctx != 0) {
+			swiSHA1Update(sha1ctx, o, n * SECTOR_SIZE);
+		}
+	}
+}
+
+static inline u8 *half(const crypt_dev_t *c, unsigned k) {
+	return c->crypt_buf + (k & 1) * HALF_LEN * SECTOR_SIZE;
+}
+
+// chunk by chunk, the raw layer transfers the next one while the CPU decrypts this one
+// buffers the raw layer can take are read into directly and decrypted in place, no length limit
+// others bounce through the halves of crypt_buf
+static bool read_pipelined(crypt_dev_t *c, sec_t start, sec_t len, void *buffer, swiSHA1context_t *sha1ctx) {
+	if (len == 0) {
+		return true;
+	}
+	raw_t *raw = &c->timed;
+	u8 *out = (u8*)buffer;
+	bool direct = raw->is_direct(buffer);
+	sec_t chunk = direct ? DIRECT_CHUNK_LEN : HALF_LEN;
+	unsigned k = 0;
+	sec_t n = len < chunk ? len : chunk;
+	activity(COLOR_BRIGHT_GREEN);
+	bool ok = raw->start(raw, BLK_READ, start, n, direct ? out : half(c, k));
+	while (ok) {
+		ok = raw->wait(raw);
+		sec_t next = len - n < chunk ? len - n : chunk;
+		bool pending = ok && next > 0
+			&& raw->start(raw, BLK_READ, start + n, next, direct ? out + n * SECTOR_SIZE : half(c, k + 1));
+		if (!ok) {
+			break;
+		}
+		activity(COLOR_GREEN);
+		decrypt_sectors(c, out, direct ? out : half(c, k), start, n, sha1ctx);
+		start += n;
+		len -= n;
+		out += n * SECTOR_SIZE;
+		n = next;
+		++k;
+		if (len == 0) {
+			activity(-1);
+			return true;
+		}
+		ok = pending;
+	}
+	iprtf("%s: read error\n", c->name);
+	activity(-1);
+	return false;
+}
+
+static bool read_plain(void *ctx, sec_t start, sec_t len, void *buffer) {
+	return read_pipelined((crypt_dev_t*)ctx, start, len, buffer, 0);
+}
+
+static void read_ahead_decrypt(void *ctx, u8 *out, const u8 *in, sec_t start, sec_t len) {
+	activity(COLOR_GREEN);
+	decrypt_sectors((crypt_dev_t*)ctx, out, in, start, len, 0);
+	activity(-1);
+}
+
+// file data, streams are read ahead
+static bool crypt_read(blk_t *b, sec_t start, sec_t len, void *buffer) {
+	crypt_dev_t *c = (crypt_dev_t*)b;
+	if (c->ra.data != 0 && len > SECTOR_CACHE_MAX_RUN) {
+		if (!readahead_read(&c->ra, start, len, buffer, read_plain)) {
+			iprtf("%s: read error\n", c->name);
+			return false;
+		}
+		return true;
+	}
+	return read_pipelined(c, start, len, buffer, 0);
+}
+
+// the halves of crypt_buf take turns, the CPU encrypts into one while the raw layer writes the other
+static bool crypt_write(blk_t *b, sec_t start, sec_t len, const void *buffer) {
+	crypt_dev_t *c = (crypt_dev_t*)b;
+	raw_t *raw = &c->timed;
+	readahead_invalidate(&c->ra, start, len);
+	const u8 *in = (const u8*)buffer;
+	unsigned k = 0;
+	bool pending = false;
+	bool ok = true;
+	while (len > 0) {
+		sec_t n = len < HALF_LEN ? len : HALF_LEN;
+		u8 *p = half(c, k);
+		activity(COLOR_RED);
+		crypt_sectors(c, BLK_WRITE, p, in, start, n);
+		if (pending && !raw->wait(raw)) {
+			pending = false;
+			ok = false;
+			break;
+		}
+		activity(COLOR_BRIGHT_RED);
+		pending = raw->start(raw, BLK_WRITE, start, n, p);
+		if (!pending) {
+			ok = false;
+			break;
+		}
+		start += n;
+		len -= n;
+		in += n * SECTOR_SIZE;
+		++k;
+	}
+	if (pending && !raw->wait(raw)) {
+		ok = false;
+	}
+	if (!ok) {
+		iprtf("%s: write error\n", c->name);
+	}
+	activity(-1);
+	return ok;
+}
+
+// nothing is held back here
+static bool crypt_sync(blk_t *b) {
+	return true;
+}
+
+static inline crypt_dev_t *timed_owner(raw_t *r) {
+	return (crypt_dev_t*)((u8*)r - offsetof(crypt_dev_t, timed));
+}
+
+// only the time the CPU is held up counts, not what the transfer takes in the background
+static bool timed_start(raw_t *r, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	crypt_dev_t *c = timed_owner(r);
+	u32 t = blk_clock();
+	bool ret = c->raw->start(c->raw, op, start, len, buffer);
+	c->time.media += blk_clock() - t;
+	return ret;
+}
+
+static bool timed_wait(raw_t *r) {
+	crypt_dev_t *c = timed_owner(r);
+	u32 t = blk_clock();
+	bool ret = c->raw->wait(c->raw);
+	c->time.media += blk_clock() - t;
+	return ret;
+}
+
+bool crypt_dev_init(crypt_dev_t *c, raw_t *raw, const char *name) {
+	c->base.read = crypt_read;
+	c->base.write = crypt_write;
+	c->base.sync = crypt_sync;
+	c->raw = raw;
+	c->timed.start = timed_start;
+	c->timed.wait = timed_wait;
+	c->timed.is_direct = raw->is_direct;
+	c->timed.sectors = raw->sectors;
+	memset(&c->time, 0, sizeof(c->time));
+	c->name = name;
+	if (c->crypt_buf == 0) {
+		c->crypt_buf = (u8*)memalign(32, SECTOR_SIZE * CRYPT_BUF_LEN);
+		if (c->crypt_buf == 0) {
+			iprtf("%s: failed to alloc buffer\n", name);
+			return false;
+		}
+	}
+	// not fatal, streams are just read and decrypted one chunk after the other
+	if (c->ra.data == 0 && !readahead_init(&c->ra, &c->timed, read_ahead_decrypt, c)) {
+		iprtf("%s: failed to alloc read ahead\n", name);
+	}
+	return true;
+}
+
+void crypt_dev_free(crypt_dev_t *c) {
+	free(c->crypt_buf);
+	c->crypt_buf = 0;
+	readahead_free(&c->ra);
+}
+
+// same as reading through the layer, plus updating sha1ctx with the decrypted data
+bool crypt_dev_read_sha1(crypt_dev_t *c, sec_t start, sec_t len, void *buffer, swiSHA1context_t *sha1ctx) {
+	return read_pipelined(c, start, len, buffer, sha1ctx);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <nds.h>
+#include "blkdev.h"
+#include "crypto.h"
+#include "readahead.h"
+
+// where the crypto layer's time goes, in BUS_CLOCK ticks
+typedef struct {
+	u64 media; // waiting for the raw layer
+	u64 aes;
+	u64 fat_fix;
+} blk_time_t;
+
+// the crypto layer, plain text above, what the raw layer holds below
+// it also patches the FAT signature DSi leaves out of the first partition's boot sector
+typedef struct {
+	blk_t base;
+	raw_t *raw;
+	// raw, timed, the crypto layer and its read ahead only ever go through this one
+	raw_t timed;
+	blk_time_t time;
+	const char *name; // for error messages
+	// both can be set before init
+	const dsi_crypt_ctx_t *ctx;
+	u32 fat_sig_fix_offset;
+	// CRYPT_BUF_LEN sectors, the halves take turns while the raw layer works in the background
+	u8 *crypt_buf;
+	readahead_t ra;
+} crypt_dev_t;
+
+bool crypt_dev_init(crypt_dev_t *c, raw_t *raw, const char *name);
+
+void crypt_dev_free(crypt_dev_t *c);
+
+bool crypt_dev_read_sha1(crypt_dev_t *c, sec_t start, sec_t len, void *buffer, swiSHA1context_t *sha1ctx);
@@ -124,34 +124,24 @@ int dsi_sha1_verify(const void *digest_verify, const void *data, unsigned len) {
 	return ret;
 }
 
-static uint32_t nand_rk[RK_LEN];
-static uint32_t nand_ctr_iv[4];
-static uint32_t es_rk[RK_LEN];
-static uint32_t boot2_rk[RK_LEN];
-
-static int tables_generated = 0;
-
-void dsi_crypt_init(const uint8_t *console_id_be, const uint8_t *emmc_cid, int is3DS) {
-	if (tables_generated == 0) {
-		aes_gen_tables();
-		tables_generated = 1;
-	}
-	
+void dsi_crypt_init(dsi_crypt_ctx_t *ctx, const uint8_t *console_id_be, const uint8_t *emmc_cid, int is3DS) {
 	uint32_t console_id[2];
 	GET_UINT32_BE(console_id[0], console_id_be, 4);
 	GET_UINT32_BE(console_id[1], console_id_be, 0);
 
-	dsi_aes_set_key(nand_rk, console_id, is3DS ? NAND_3DS : NAND);
-	dsi_aes_set_key(es_rk, console_id, ES);
+	dsi_aes_set_key(ctx->nand_rk, console_id, is3DS ? NAND_3DS : NAND);
+	dsi_aes_set_key(ctx->es_rk, console_id, ES);
 
-	aes_set_key_enc_128_be(boot2_rk, (uint8_t*)DSi_BOOT2_KEY);
+	aes_set_key_enc_128_be(ctx->boot2_rk, (uint8_t*)DSi_BOOT2_KEY);
 
 	uint32_t digest[SHA1_LEN / sizeof(uint32_t)];
 	swiSHA1Calc(digest, emmc_cid, 16);
-	nand_ctr_iv[0] = digest[0];
-	nand_ctr_iv[1] = digest[1];
-	nand_ctr_iv[2] = digest[2];
-	nand_ctr_iv[3] = digest[3];
+	ctx->nand_ctr_iv[0] = digest[0];
+	ctx->nand_ctr_iv[1] = digest[1];
+	ctx->nand_ctr_iv[2] = digest[2];
+	ctx->nand_ctr_iv[3] = digest[3];
+
+	dsi_boot2_crypt_set_ctr(ctx, 0);
 }
 
 static inline void aes_ctr(const uint32_t *rk, const uint32_t *ctr, uint32_t *in, uint32_t *out) {
@@ -162,67 +152,125 @@ static inline void aes_ctr(const uint32_t *rk, const uint32_t *ctr, uint32_t *in
 
 // crypt one block, in/out must be aligned to 32 bit(restriction induced by xor_128)
 // offset as block offset, block as AES block
-void dsi_nand_crypt_1(uint8_t* out, const uint8_t* in, uint32_t offset) {
-	uint32_t ctr[4] = { nand_ctr_iv[0], nand_ctr_iv[1], nand_ctr_iv[2], nand_ctr_iv[3] };
+void dsi_nand_crypt_1(const dsi_crypt_ctx_t *ctx, uint8_t* out, const uint8_t* in, uint32_t offset) {
+	const uint32_t *iv = ctx->nand_ctr_iv;
+	uint32_t ctr[4] = { iv[0], iv[1], iv[2], iv[3] };
 	add_128_32(ctr, offset);
 	// iprintf("AES CTR:\n");
 	// print_bytes(buf, 16);
-	aes_ctr(nand_rk, ctr, (uint32_t*)in, (uint32_t*)out);
+	aes_ctr(ctx->nand_rk, ctr, (uint32_t*)in, (uint32_t*)out);
 }
 
-void dsi_nand_crypt(uint8_t* out, const uint8_t* in, uint32_t offset, unsigned count) {
-	uint32_t ctr[4] = { nand_ctr_iv[0], nand_ctr_iv[1], nand_ctr_iv[2], nand_ctr_iv[3] };
+void dsi_nand_crypt(const dsi_crypt_ctx_t *ctx, uint8_t* out, const uint8_t* in, uint32_t offset, unsigned count) {
+	const uint32_t *iv = ctx->nand_ctr_iv;
+	uint32_t ctr[4] = { iv[0], iv[1], iv[2], iv[3] };
 	add_128_32(ctr, offset);
-	for (unsigned i = 0; i < count; ++i) {
-		aes_ctr(nand_rk, ctr, (uint32_t*)in, (uint32_t*)out);
-		out += AES_BLOCK_SIZE;
-		in += AES_BLOCK_SIZE;
-		add_128_32(ctr, 1);
-	}
+	aes_crypt_ctr_128_be(ctx->nand_rk, ctr, (uint32_t*)out, (const uint32_t*)in, count);
 }
-	
-static uint32_t boot2_ctr[4];
-
-void dsi_boot2_crypt_set_ctr(uint32_t size_r) {
-	boot2_ctr[0] = size_r;
-	boot2_ctr[1] = -size_r;
-	boot2_ctr[2] = ~size_r;
-	boot2_ctr[3] = 0;
+
+// console ID search, for when the console ID we got doesn't decrypt sector 0
+// only NAND keys of DSi, the high word of the console ID stays, the low word varies
+// the low word only goes into key[0] and key[1], so words 2 and 3 of (Key_X XOR Key_Y) + MAGIC
+// are precomputed, for both possible carries out of word 1
+// each candidate is then tested on one block of known plain text, no full sector decryption
+void dsi_id_search_init(dsi_id_search_t *s, const uint8_t *console_id_be, const uint8_t *emmc_cid,
+	uint32_t offset, const uint8_t *cipher, const uint8_t *plain)
+{
+	uint32_t console_id_hi;
+	GET_UINT32_BE(console_id_hi, console_id_be, 0);
+	uint32_t k2 = (console_id_hi ^ 0xe65b601d) ^ DSi_NAND_KEY_Y[2];
+	uint32_t k3 = console_id_hi ^ DSi_NAND_KEY_Y[3];
+	for (unsigned c = 0; c < 2; ++c) {
+		uint32_t hi[4] = { 0, 0, k2, k3 };
+		uint32_t add[4] = { 0, 0, DSi_KEY_MAGIC[2] + c, DSi_KEY_MAGIC[3] };
+		// MAGIC[2] + 1 doesn't overflow, so the carry can be folded into it
+		add_128(hi, add);
+		s->hi_sum[c][0] = hi[2];
+		s->hi_sum[c][1] = hi[3];
+	}
+
+	uint32_t digest[SHA1_LEN / sizeof(uint32_t)];
+	swiSHA1Calc(digest, emmc_cid, 16);
+	s->ctr[0] = digest[0];
+	s->ctr[1] = digest[1];
+	s->ctr[2] = digest[2];
+	s->ctr[3] = digest[3];
+	add_128_32(s->ctr, offset);
+
+	// the right key encrypts ctr to cipher XOR plain
+	uint32_t c32[4], p32[4];
+	memcpy(c32, cipher, AES_BLOCK_SIZE);
+	memcpy(p32, plain, AES_BLOCK_SIZE);
+	xor_128(s->target, c32, p32);
 }
 
-void dsi_boot2_crypt(uint8_t* out, const uint8_t* in, unsigned count) {
-	for (unsigned i = 0; i < count; ++i) {
-		aes_ctr(boot2_rk, boot2_ctr, (uint32_t*)in, (uint32_t*)out);
-		out += AES_BLOCK_SIZE;
-		in += AES_BLOCK_SIZE;
-		add_128_32(boot2_ctr, 1);
+// test count candidates from *console_id_lo on
+// returns 1 with *console_id_lo set to the match, 0 with *console_id_lo advanced by count if none
+int dsi_id_search(const dsi_id_search_t *s, uint32_t *console_id_lo, unsigned count) {
+	uint32_t lo = *console_id_lo;
+	uint32_t rk[RK_LEN];
+	uint32_t key[4], out[4];
+	for (; count > 0; --count, ++lo) {
+		// same as dsi_aes_set_key(rk, { lo, hi }, NAND), minus what's precomputed
+		uint32_t k0 = lo ^ DSi_NAND_KEY_Y[0];
+		uint32_t k1 = (lo ^ 0x24ee6906) ^ DSi_NAND_KEY_Y[1];
+		key[0] = k0 + DSi_KEY_MAGIC[0];
+		uint32_t c = key[0] < k0;
+		key[1] = k1 + DSi_KEY_MAGIC[1] + c;
+		c = c ? key[1] <= k1 : key[1] < k1;
+		key[2] = s->hi_sum[c][0];
+		key[3] = s->hi_sum[c][1];
+		rol42_128(key);
+		aes_set_key_enc_128_be(rk, (uint8_t*)key);
+		aes_encrypt_128_be(rk, (const uint8_t*)s->ctr, (uint8_t*)out);
+		// first word rules out nearly all candidates
+		if (out[0] == s->target[0] && out[1] == s->target[1]
+			&& out[2] == s->target[2] && out[3] == s->target[3])
+		{
+			*console_id_lo = lo;
+			return 1;
+		}
 	}
+	*console_id_lo = lo;
+	return 0;
+}
+
+// boot2 counter lives in ctx and runs on across calls, unlike the NAND one which is derived from offset
+void dsi_boot2_crypt_set_ctr(dsi_crypt_ctx_t *ctx, uint32_t size_r) {
+	ctx->boot2_ctr[0] = size_r;
+	ctx->boot2_ctr[1] = -size_r;
+	ctx->boot2_ctr[2] = ~size_r;
+	ctx->boot2_ctr[3] = 0;
+}
+
+void dsi_boot2_crypt(dsi_crypt_ctx_t *ctx, uint8_t* out, const uint8_t* in, unsigned count) {
+	aes_crypt_ctr_128_be(ctx->boot2_rk, ctx->boot2_ctr, (uint32_t*)out, (const uint32_t*)in, count);
 }
 
-// http://problemkaputt.de/gbatek.htm#dsiesblockencryption
-// works in place, also must be aligned to 32 bit
-// why is it called ES?
-int dsi_es_block_crypt(uint8_t *buf, unsigned buf_len, crypt_mode_t mode) {
-	es_block_footer_t *footer;
-	footer = (es_block_footer_t*)(buf + buf_len - sizeof(es_block_footer_t));
-	// backup mac since it might be overwritten by padding
-	// and also nonce, it becomes garbage after decryption
-	uint8_t ccm_mac[AES_CCM_MAC_LEN];
-	uint8_t nonce[AES_CCM_NONCE_LEN];
-	memcpy(ccm_mac, footer->ccm_mac, AES_CCM_MAC_LEN);
-	memcpy(nonce, footer->nonce, AES_CCM_NONCE_LEN);
-
-	uint32_t ctr32[4], pad32[4], mac32[4];
 // I'm too paranoid to use more stack variables
 #define ctr ((uint8_t*)ctr32)
 #define pad ((uint8_t*)pad32)
 #define mac ((uint8_t*)mac32)
-#define zero(a) static_assert(sizeof(a[0]) == 4, "invalid operand"); \
-	a[0] = 0; a[1] = 0; a[2] = 0; a[3] = 0
+#define zero(a) a[0] = 0; a[1] = 0; a[2] = 0; a[3] = 0
+
+// http://problemkaputt.de/gbatek.htm#dsiesblockencryption
+// why is it called ES?
+// streaming version, the payload can go through in pieces so it doesn't have to fit in RAM
+// footer is decrypted in place on DECRYPT, it might not be 32 bit aligned
+// returns payload size, or -1 if the footer is invalid
+int dsi_es_block_crypt_init(const dsi_crypt_ctx_t *crypt, dsi_es_ctx_t *ctx, es_block_footer_t *footer, crypt_mode_t mode) {
+	const uint32_t *es_rk = crypt->es_rk;
+	ctx->es_rk = es_rk;
+	// backup mac and nonce, nonce becomes garbage after decryption
+	memcpy(ctx->ccm_mac, footer->ccm_mac, AES_CCM_MAC_LEN);
+	memcpy(ctx->nonce, footer->nonce, AES_CCM_NONCE_LEN);
+	ctx->mode = mode;
+
+	uint32_t *ctr32 = ctx->ctr32, *mac32 = ctx->mac32, *pad32 = ctx->s0_32;
 	if (mode == DECRYPT) {
 		// decrypt footer
 		zero(ctr32);
-		memcpy(ctr + 1, nonce, AES_CCM_NONCE_LEN);
+		memcpy(ctr + 1, ctx->nonce, AES_CCM_NONCE_LEN);
 		// footer might not be 32 bit aligned after all, so we copy it out to decrypt
 		memcpy(pad, footer->encrypted, AES_BLOCK_SIZE);
 		aes_ctr(es_rk, ctr32, pad32, pad32);
@@ -231,68 +279,72 @@ int dsi_es_block_crypt(uint8_t *buf, unsigned buf_len, crypt_mode_t mode) {
 	// check decrypted footer
 	if (footer->fixed_3a != 0x3a) {
 		iprtf("ES block footer offset 0x10 should be 0x3a, got 0x%02x\n", footer->fixed_3a);
-		return 1;
+		return -1;
 	}
 	uint32_t block_size;
 	GET_UINT32_BE(block_size, footer->len32be, 0);
 	block_size &= 0xffffff;
-	if (block_size + sizeof(es_block_footer_t) != buf_len) {
-		iprtf("block size in footer doesn't match, %06x != %06x\n",
-			(unsigned)block_size, (unsigned)(buf_len - sizeof(es_block_footer_t)));
-		return 1;
-	}
-	// padding to multiple of 16
-	uint32_t remainder = block_size & 0xf;
-	if (remainder != 0) {
-		zero(pad32);
-		if (mode == DECRYPT) {
-			ctr32[0] = (block_size >> 4) + 1;
-			memcpy(ctr + 3, nonce, AES_CCM_NONCE_LEN);
-			ctr[0xf] = 2;
-			aes_ctr(es_rk, ctr32, pad32, pad32);
-		}
-		memcpy(buf + block_size, pad + remainder, 16 - remainder);
-		block_size += 16 - remainder;
-	}
-	// AES-CCM MAC
-	mac32[0] = block_size;
-	memcpy(mac + 3, nonce, AES_CCM_NONCE_LEN);
+	ctx->remaining = block_size;
+	// AES-CCM MAC, Nintendo puts the size padded to multiple of 16 in it
+	mac32[0] = (block_size + 0xf) & ~0xf;
+	memcpy(mac + 3, ctx->nonce, AES_CCM_NONCE_LEN);
 	mac[0xf] = 0x3a;
 	aes_encrypt_128_be(es_rk, mac, mac);
 	// AES-CCM CTR
 	ctr32[0] = 0;
-	memcpy(ctr + 3, nonce, AES_CCM_NONCE_LEN);
+	memcpy(ctr + 3, ctx->nonce, AES_CCM_NONCE_LEN);
 	ctr[0xf] = 2;
 	// AES-CCM start
 	zero(pad32);
 	aes_ctr(es_rk, ctr32, pad32, pad32);
 	add_128_32(ctr32, 1);
-	// AES-CCM loop
-	if (mode == DECRYPT) {
-		for (unsigned i = 0; i < block_size; i += 16) {
-			aes_ctr(es_rk, ctr32, (uint32_t*)(buf + i), (uint32_t*)(buf + i));
-			add_128_32(ctr32, 1);
-			xor_128(mac32, mac32, (uint32_t*)(buf + i));
-			aes_encrypt_128_be(es_rk, mac, mac);
-		}
-	} else {
-		for (unsigned i = 0; i < block_size; i += 16) {
-			xor_128(mac32, mac32, (uint32_t*)(buf + i));
-			aes_encrypt_128_be(es_rk, mac, mac);
-			aes_ctr(es_rk, ctr32, (uint32_t*)(buf + i), (uint32_t*)(buf + i));
-			add_128_32(ctr32, 1);
+	return block_size;
+}
+
+// in/out must be aligned to 32 bit, can work in place
+// len must be a multiple of 16, except for the last piece
+void dsi_es_block_crypt_update(dsi_es_ctx_t *ctx, uint8_t *out, const uint8_t *in, unsigned len) {
+	const uint32_t *es_rk = ctx->es_rk;
+	if (len > ctx->remaining) {
+		len = ctx->remaining;
+	}
+	ctx->remaining -= len;
+	unsigned blocks = len / AES_BLOCK_SIZE;
+	aes_ccm_crypt_128_be(es_rk, ctx->ctr32, ctx->mac32, (uint32_t*)out, (const uint32_t*)in,
+		blocks, ctx->mode == DECRYPT);
+	unsigned remainder = len & 0xf;
+	if (remainder != 0) {
+		// padding to multiple of 16
+		// plain text is padded with zero, so on DECRYPT the cipher text is padded with the key stream
+		uint32_t pad32[4];
+		zero(pad32);
+		if (ctx->mode == DECRYPT) {
+			uint32_t ctr32[4] = { ctx->ctr32[0], ctx->ctr32[1], ctx->ctr32[2], ctx->ctr32[3] };
+			aes_ctr(es_rk, ctr32, pad32, pad32);
 		}
+		in += blocks * AES_BLOCK_SIZE;
+		out += blocks * AES_BLOCK_SIZE;
+		memcpy(pad, in, remainder);
+		aes_ccm_crypt_128_be(es_rk, ctx->ctr32, ctx->mac32, pad32, pad32, 1, ctx->mode == DECRYPT);
+		memcpy(out, pad, remainder);
+	}
+}
+
+// returns 0 on success, MAC verification happens here on DECRYPT
+// footer is the one given to init, on ENCRYPT the MAC is written to it and it's encrypted
+int dsi_es_block_crypt_final(dsi_es_ctx_t *ctx, es_block_footer_t *footer) {
+	const uint32_t *es_rk = ctx->es_rk;
+	uint32_t *ctr32 = ctx->ctr32, *mac32 = ctx->mac32, *pad32 = ctx->s0_32;
+	if (ctx->remaining != 0) {
+		iprtf("ES block: %u bytes missing\n", ctx->remaining);
+		return 1;
 	}
 	// AES-CCM MAC final
 	xor_128(mac32, mac32, pad32);
-	if (mode == DECRYPT) {
-		if (memcmp(mac, ccm_mac, 16) == 0) {
-			if (remainder != 0) {
-				// restore mac
-				memcpy(footer->ccm_mac, ccm_mac, AES_CCM_MAC_LEN);
-			}
+	if (ctx->mode == DECRYPT) {
+		if (memcmp(mac, ctx->ccm_mac, 16) == 0) {
 			// restore nonce
-			memcpy(footer->nonce, nonce, AES_CCM_NONCE_LEN);
+			memcpy(footer->nonce, ctx->nonce, AES_CCM_NONCE_LEN);
 			return 0;
 		} else {
 			prt("MAC verification failed\n");
@@ -302,16 +354,36 @@ int dsi_es_block_crypt(uint8_t *buf, unsigned buf_len, crypt_mode_t mode) {
 		memcpy(footer->ccm_mac, mac, AES_CCM_MAC_LEN);
 		// AES-CTR crypt later half of footer
 		zero(ctr32);
-		memcpy(ctr + 1, nonce, AES_CCM_NONCE_LEN);
+		memcpy(ctr + 1, ctx->nonce, AES_CCM_NONCE_LEN);
 		memcpy(pad, footer->encrypted, AES_BLOCK_SIZE);
 		aes_ctr(es_rk, ctr32, pad32, pad32);
 		memcpy(footer->encrypted, pad, AES_BLOCK_SIZE);
 		// restore nonce
-		memcpy(footer->nonce, nonce, AES_CCM_NONCE_LEN);
+		memcpy(footer->nonce, ctx->nonce, AES_CCM_NONCE_LEN);
 		return 0;
 	}
+}
+
 #undef ctr
 #undef pad
 #undef mac
 #undef zero
+
+// the whole block in one buffer, with the footer
+// works in place, also must be aligned to 32 bit
+int dsi_es_block_crypt(const dsi_crypt_ctx_t *crypt, uint8_t *buf, unsigned buf_len, crypt_mode_t mode) {
+	es_block_footer_t *footer;
+	footer = (es_block_footer_t*)(buf + buf_len - sizeof(es_block_footer_t));
+	dsi_es_ctx_t ctx;
+	int block_size = dsi_es_block_crypt_init(crypt, &ctx, footer, mode);
+	if (block_size < 0) {
+		return 1;
+	}
+	if (block_size + sizeof(es_block_footer_t) != buf_len) {
+		iprtf("block size in footer doesn't match, %06x != %06x\n",
+			(unsigned)block_size, (unsigned)(buf_len - sizeof(es_block_footer_t)));
+		return 1;
+	}
+	dsi_es_block_crypt_update(&ctx, buf, buf, block_size);
+	return dsi_es_block_crypt_final(&ctx, footer);
 }
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+#include "ticket0.h"
+#include "../mbedtls/aes.h"
+
 #define SHA1_LEN 20
 
 #define AES_BLOCK_SIZE 16
@@ -20,14 +25,52 @@ void swiSHA1Calc(void *digest, const void *buf, size_t len);
 
 int dsi_sha1_verify(const void *digest_verify, const void *data, unsigned len);
 
-void dsi_crypt_init(const uint8_t *console_id_be, const uint8_t *emmc_cid, int is3DS);
+// keys and counters derived from one console's IDs
+// nothing in here is global, so images from different consoles can be open at the same time
+typedef struct {
+	uint32_t nand_rk[RK_LEN];
+	uint32_t nand_ctr_iv[4];
+	uint32_t es_rk[RK_LEN];
+	uint32_t boot2_rk[RK_LEN];
+	uint32_t boot2_ctr[4];
+} dsi_crypt_ctx_t;
+
+void dsi_crypt_init(dsi_crypt_ctx_t *ctx, const uint8_t *console_id_be, const uint8_t *emmc_cid, int is3DS);
+
+void dsi_nand_crypt_1(const dsi_crypt_ctx_t *ctx, uint8_t *out, const uint8_t* in, uint32_t offset);
+
+void dsi_nand_crypt(const dsi_crypt_ctx_t *ctx, uint8_t *out, const uint8_t* in, uint32_t offset, unsigned count);
+
+int dsi_es_block_crypt(const dsi_crypt_ctx_t *ctx, uint8_t *buf, unsigned buf_len, crypt_mode_t mode);
+
+typedef struct {
+	uint32_t ctr32[4];
+	uint32_t mac32[4];
+	uint32_t s0_32[4]; // key stream of counter 0, masks the MAC
+	uint8_t ccm_mac[AES_CCM_MAC_LEN];
+	uint8_t nonce[AES_CCM_NONCE_LEN];
+	unsigned remaining;
+	crypt_mode_t mode;
+	const uint32_t *es_rk; // from the dsi_crypt_ctx_t given to init
+} dsi_es_ctx_t;
+
+int dsi_es_block_crypt_init(const dsi_crypt_ctx_t *crypt, dsi_es_ctx_t *ctx, es_block_footer_t *footer, crypt_mode_t mode);
+
+void dsi_es_block_crypt_update(dsi_es_ctx_t *ctx, uint8_t *out, const uint8_t *in, unsigned len);
+
+int dsi_es_block_crypt_final(dsi_es_ctx_t *ctx, es_block_footer_t *footer);
 
-void dsi_nand_crypt_1(uint8_t *out, const uint8_t* in, u32 offset);
+typedef struct {
+	uint32_t hi_sum[2][2]; // words 2 and 3 of the key before ROL 42, for carry 0 and 1
+	uint32_t ctr[4];
+	uint32_t target[4]; // key stream of the right key at ctr
+} dsi_id_search_t;
 
-void dsi_nand_crypt(uint8_t *out, const uint8_t* in, u32 offset, unsigned count);
+void dsi_id_search_init(dsi_id_search_t *s, const uint8_t *console_id_be, const uint8_t *emmc_cid,
+	uint32_t offset, const uint8_t *cipher, const uint8_t *plain);
 
-int dsi_es_block_crypt(uint8_t *buf, unsigned buf_len, crypt_mode_t mode);
+int dsi_id_search(const dsi_id_search_t *s, uint32_t *console_id_lo, unsigned count);
 
-void dsi_boot2_crypt_set_ctr(uint32_t size_r);
+void dsi_boot2_crypt_set_ctr(dsi_crypt_ctx_t *ctx, uint32_t size_r);
 
-void dsi_boot2_crypt(uint8_t* out, const uint8_t* in, unsigned count);
+void dsi_boot2_crypt(dsi_crypt_ctx_t *ctx, uint8_t* out, const uint8_t* in, unsigned count);
@@ -0,0 +1,151 @@
+#include <nds.h>
+#include <malloc.h>
+#include <string.h>
+#include "blkutil.h"
+#include "fatmap.h"
+
+#define SECTOR_SIZE 512
+#define FAT32_MIN_CLUSTERS 65525
+#define FAT16_MIN_CLUSTERS 4085
+
+// the disc driver transfers behind the cache, whole cache lines
+static u32 sec_buf[SECTOR_SIZE / sizeof(u32)] __attribute__((aligned(32)));
+
+// same test libfat uses
+static bool is_fat_vbr(const u8 *p) {
+	return p[0x1fe] == 0x55 && p[0x1ff] == 0xaa
+		&& (memcmp(p + 0x36, "FAT", 3) == 0 || memcmp(p + 0x52, "FAT", 3) == 0);
+}
+
+bool fatmap_geom(const DISC_INTERFACE *disc, fat_geom_t *g) {
+	const u8 *p = (const u8*)sec_buf;
+	sec_t part = 0;
+	if (!disc->readSectors(0, 1, sec_buf)) {
+		return false;
+	}
+	if (!is_fat_vbr(p)) {
+		// MBR, the first partition holding FAT
+		u32 lbas[4];
+		for (unsigned i = 0; i < 4; ++i) {
+			const u8 *e = p + 0x1be + i * 16;
+			lbas[i] = e[4] != 0 ? le32(e + 8) : 0;
+		}
+		unsigned i;
+		for (i = 0; i < 4; ++i) {
+			if (lbas[i] != 0 && disc->readSectors(lbas[i], 1, sec_buf) && is_fat_vbr(p)) {
+				break;
+			}
+		}
+		if (i == 4) {
+			return false;
+		}
+		part = lbas[i];
+	}
+	if (le16(p + 0x0b) != SECTOR_SIZE || p[0x0d] == 0 || p[0x10] == 0) {
+		return false;
+	}
+	u32 reserved = le16(p + 0x0e);
+	u32 root_sectors = (le16(p + 0x11) * 32 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	u32 fat_sectors = le16(p + 0x16) != 0 ? le16(p + 0x16) : le32(p + 0x24);
+	u32 total = le16(p + 0x13) != 0 ? le16(p + 0x13) : le32(p + 0x20);
+	u32 meta = reserved + p[0x10] * fat_sectors + root_sectors;
+	if (total <= meta) {
+		return false;
+	}
+	g->part = part;
+	g->sectors = total;
+	g->sectors_per_cluster = p[0x0d];
+	g->fat_sectors = fat_sectors;
+	g->fat = part + reserved;
+	g->data = part + meta;
+	g->clusters = (total - meta) / g->sectors_per_cluster;
+	g->fat32 = g->clusters >= FAT32_MIN_CLUSTERS;
+	// FAT12 can't hold a NAND image anyway
+	return g->clusters >= FAT16_MIN_CLUSTERS;
+}
+
+// FAT sectors come one at a time, a chain mostly stays in the same one
+static bool next_cluster(const DISC_INTERFACE *disc, const fat_geom_t *g, u32 cluster, sec_t *cached, u32 *next) {
+	u32 offset = cluster * (g->fat32 ? 4 : 2);
+	sec_t sector = g->fat + offset / SECTOR_SIZE;
+	if (sector != *cached) {
+		if (!disc->readSectors(sector, 1, sec_buf)) {
+			return false;
+		}
+		*cached = sector;
+	}
+	const u8 *p = (const u8*)sec_buf + offset % SECTOR_SIZE;
+	*next = g->fat32 ? le32(p) & 0x0fffffff : le16(p);
+	return true;
+}
+
+int fatmap_build(const DISC_INTERFACE *disc, u32 start_cluster, u32 size, fat_extent_t **map) {
+	*map = 0;
+	fat_geom_t g;
+	if (disc == 0 || !fatmap_geom(disc, &g)) {
+		return -1;
+	}
+	u32 cluster_size = g.sectors_per_cluster * SECTOR_SIZE;
+	u32 count = (size + cluster_size - 1) / cluster_size;
+	sec_t sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	fat_extent_t *m = 0;
+	unsigned len = 0, cap = 0;
+	sec_t cached = 0;
+	u32 cluster = start_cluster;
+	for (u32 i = 0; i < count; ++i) {
+		if (cluster < 2 || cluster >= g.clusters + 2) {
+			free(m);
+			return -1;
+		}
+		sec_t lba = g.data + (cluster - 2) * g.sectors_per_cluster;
+		if (len > 0 && m[len - 1].lba + m[len - 1].len == lba) {
+			m[len - 1].len += g.sectors_per_cluster;
+		} else {
+			if (len == cap) {
+				cap = cap == 0 ? 16 : cap * 2;
+				fat_extent_t *n = (fat_extent_t*)realloc(m, cap * sizeof(fat_extent_t));
+				if (n == 0) {
+					free(m);
+					return -1;
+				}
+				m = n;
+			}
+			m[len].start = i * g.sectors_per_cluster;
+			m[len].len = g.sectors_per_cluster;
+			m[len].lba = lba;
+			++len;
+		}
+		if (i + 1 < count && !next_cluster(disc, &g, cluster, &cached, &cluster)) {
+			free(m);
+			return -1;
+		}
+	}
+	if (len == 0) {
+		return -1;
+	}
+	// the last cluster is only partly the file's
+	m[len - 1].len = sectors - m[len - 1].start;
+	*map = m;
+	return len;
+}
+
+int fatmap_find(const fat_extent_t *map, unsigned len, sec_t start, unsigned hint) {
+	// sequential transfers stay in the same extent or move to the next one
+	for (unsigned i = hint; i < len && i < hint + 2; ++i) {
+		if (start >= map[i].start && start < map[i].start + map[i].len) {
+			return i;
+		}
+	}
+	unsigned lo = 0, hi = len;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (start < map[mid].start) {
+			hi = mid;
+		} else if (start >= map[mid].start + map[mid].len) {
+			lo = mid + 1;
+		} else {
+			return mid;
+		}
+	}
+	return -1;
+}
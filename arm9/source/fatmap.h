@@ -0,0 +1,32 @@
+#pragma once
+
+#include <nds.h>
+#include <nds/disc_io.h>
+
+// where a file's data is on the disc, runs of contiguous clusters
+typedef struct {
+	sec_t start; // in the file
+	sec_t len;
+	sec_t lba; // on the disc
+} fat_extent_t;
+
+typedef struct {
+	sec_t part; // the partition's first sector, its VBR
+	sec_t sectors; // of the partition
+	sec_t fat; // first sector of the first FAT
+	u32 fat_sectors; // of one FAT
+	sec_t data; // first sector of cluster 2
+	u32 sectors_per_cluster;
+	u32 clusters;
+	bool fat32;
+} fat_geom_t;
+
+// the layout of the first FAT16/32 partition, the one libfat mounts
+bool fatmap_geom(const DISC_INTERFACE *disc, fat_geom_t *g);
+
+// walks the cluster chain once, from the first FAT16/32 partition, the one libfat mounts
+// returns the number of extents, -1 if the chain doesn't cover size or the disc isn't understood
+int fatmap_build(const DISC_INTERFACE *disc, u32 start_cluster, u32 size, fat_extent_t **map);
+
+// the extent start is in, hint is where the last lookup ended up
+int fatmap_find(const fat_extent_t *map, unsigned len, sec_t start, unsigned hint);
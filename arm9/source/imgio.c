@@ -1,147 +1,296 @@
-
 #include <nds.h>
 #include <nds/disc_io.h>
-#include <malloc.h>
 #include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
 #include "crypto.h"
+#include "rawfile.h"
+#include "sparse.h"
+#include "overlay.h"
+#include "blkstack.h"
+#include "imgio.h"
 #include "utils.h"
 #include "../term256/term256ext.h"
 
-#define SECTOR_SIZE 512
-#define CRYPT_BUF_LEN 64
-
 extern const char nand_img_name[];
+extern const char nand_sparse_name[];
+extern const char nand_delta_name[];
+extern const char nand_idx_name[];
+extern const DISC_INTERFACE __io_dsisd;
 
-static u8* crypt_buf = 0;
-FILE *f = 0;
+// the image file at the bottom of the stack, or the container of a sparse image
+static raw_file_t raw;
+static raw_sparse_t sparse;
+static bool is_sparse = false;
+// nand.delta over either, while there's one
+static FILE *delta_f = 0;
+static raw_file_t delta;
+static raw_overlay_t overlay;
+// a backup may have written a new one while the image was closed
+static bool index_dropped = false;
+static blkstack_t stack;
 
-static u32 fat_sig_fix_offset = 0;
+FILE *f = 0;
 
 void imgio_set_fat_sig_fix(u32 offset) {
-	fat_sig_fix_offset = offset;
+	blkstack_set_fat_sig_fix(&stack, offset);
 }
 
-// provide a similar interface to nand_ReadSectors for imgio
-bool imgio_read_raw_sectors(sec_t sector, sec_t numSectors, void *buffer) {
-	if (fseek(f, sector * SECTOR_SIZE, SEEK_SET) != 0) {
-		prt("IMGIO: seek fail\n");
+void imgio_set_crypt_ctx(const dsi_crypt_ctx_t *ctx) {
+	blkstack_set_crypt_ctx(&stack, ctx);
+}
+
+// the cluster map needs the disc nand.bin is on, that's only known for the SD
+static const DISC_INTERFACE *image_disc() {
+	static char cwd[256];
+	if (getcwd(cwd, sizeof(cwd)) != 0 && strncmp(cwd, "sd:", 3) == 0) {
+		return &__io_dsisd;
+	}
+	return 0;
+}
+
+static bool open_file(const char *name, const DISC_INTERFACE *disc) {
+	f = fopen(name, "r+b");
+	if (f == 0) {
 		return false;
 	}
-	if (fread(buffer, SECTOR_SIZE, numSectors, f) != numSectors) {
-		prt("IMGIO: read fail\n");
+	if (!raw_file_init(&raw, f, disc)) {
+		prt("IMGIO: seek fail\n");
+		fclose(f);
+		f = 0;
+		raw_file_free(&raw);
 		return false;
 	}
 	return true;
 }
 
-bool imgio_startup() {
-	if (crypt_buf == 0) {
-		crypt_buf = (u8*)memalign(32, SECTOR_SIZE * CRYPT_BUF_LEN);
-		if (crypt_buf == 0) {
-			prt("imgio: failed to alloc buffer\n");
+static bool close_file() {
+	bool ret = fclose(f) == 0;
+	f = 0;
+	raw_file_free(&raw);
+	return ret;
+}
+
+static bool open_image() {
+	if (open_file(nand_sparse_name, 0)) {
+		raw.growable = true;
+		if (!raw_sparse_open(&sparse, &raw, stack.crypt.ctx)) {
+			iprtf("IMGIO: failed to open %s\n", nand_sparse_name);
+			close_file();
+			return false;
 		}
+		is_sparse = true;
+		return true;
+	}
+	if (!open_file(nand_img_name, image_disc())) {
+		iprtf("IMGIO: failed to open %s\n", nand_img_name);
+		return false;
 	}
-	return crypt_buf != 0;
+	if (raw.sync.base.sectors == 0) {
+		iprtf("IMGIO: %s is empty\n", nand_img_name);
+		close_file();
+		return false;
+	}
+	is_sparse = false;
+	return true;
 }
 
-bool imgio_is_inserted() {
+static bool close_image() {
+	bool ret = true;
+	index_dropped = false;
+	if (is_sparse) {
+		ret = raw_sparse_flush(&sparse);
+		raw_sparse_free(&sparse);
+		is_sparse = false;
+	}
+	return close_file() && ret;
+}
+
+static bool open_overlay() {
+	delta_f = fopen(nand_delta_name, "r+b");
+	if (delta_f == 0) {
+		return true;
+	}
+	// the SHA1 of the whole image, from the .sha1 beside it
+	u8 base_sha1[SHA1_LEN];
+	if (load_sha1_file(base_sha1, is_sparse ? nand_sparse_name : nand_img_name) != 0) {
+		iprtf("IMGIO: %s can't be tied to the image without its .sha1\n", nand_delta_name);
+		fclose(delta_f);
+		delta_f = 0;
+		return false;
+	}
+	if (!raw_file_init(&delta, delta_f, 0)) {
+		iprtf("IMGIO: failed to open %s\n", nand_delta_name);
+		fclose(delta_f);
+		delta_f = 0;
+		raw_file_free(&delta);
+		return false;
+	}
+	delta.growable = true;
+	raw_t *lower = is_sparse ? &sparse.sync.base : &raw.sync.base;
+	if (!raw_overlay_open(&overlay, lower, &delta, base_sha1)) {
+		iprtf("IMGIO: failed to open %s\n", nand_delta_name);
+		fclose(delta_f);
+		delta_f = 0;
+		raw_file_free(&delta);
+		return false;
+	}
 	return true;
 }
 
-bool dumped = false;
+static bool close_overlay() {
+	if (delta_f == 0) {
+		return true;
+	}
+	bool ret = raw_overlay_flush(&overlay);
+	raw_overlay_free(&overlay);
+	if (fclose(delta_f) != 0) {
+		ret = false;
+	}
+	delta_f = 0;
+	raw_file_free(&delta);
+	return ret;
+}
 
-// len is guaranteed <= CRYPT_BUF_LEN
-static bool read_sectors(sec_t start, sec_t len, void *buffer) {
-	if (fseek(f, start * SECTOR_SIZE, SEEK_SET) != 0) {
-		prt("IMGIO: seek fail\n");
+// nand.sparse if there's one, the slots are appended so it's never cluster mapped
+static bool imgio_open() {
+	if (f != 0) {
+		return true;
+	}
+	if (!open_image()) {
 		return false;
 	}
-	activity(COLOR_BRIGHT_GREEN);
-	if (fread(crypt_buf, SECTOR_SIZE, len, f) == len) {
-		activity(COLOR_GREEN);
-		dsi_nand_crypt(buffer, crypt_buf, start * SECTOR_SIZE / AES_BLOCK_SIZE, len * SECTOR_SIZE / AES_BLOCK_SIZE);
-		if (fat_sig_fix_offset &&
-			start == fat_sig_fix_offset
-			&& ((u8*)buffer)[0x36] == 0
-			&& ((u8*)buffer)[0x37] == 0
-			&& ((u8*)buffer)[0x38] == 0)
-		{
-			((u8*)buffer)[0x36] = 'F';
-			((u8*)buffer)[0x37] = 'A';
-			((u8*)buffer)[0x38] = 'T';
-		}
-		activity(-1);
-		return true;
-	} else {
-		prt("IMGIO: read fail\n");
-		activity(-1);
+	if (!open_overlay()) {
+		close_image();
 		return false;
 	}
+	return true;
 }
 
-bool imgio_read_sectors(sec_t offset, sec_t len, void *buffer) {
-	// iprintf("R: %u(0x%08x), %u\n", (unsigned)offset, (unsigned)offset, (unsigned)len);
-	while (len >= CRYPT_BUF_LEN) {
-		if (!read_sectors(offset, CRYPT_BUF_LEN, buffer)) {
-			return false;
-		}
-		offset += CRYPT_BUF_LEN;
-		len -= CRYPT_BUF_LEN;
-		buffer = ((u8*)buffer) + SECTOR_SIZE * CRYPT_BUF_LEN;
+static raw_t *image_raw() {
+	if (delta_f != 0) {
+		return &overlay.sync.base;
 	}
-	if (len > 0) {
-		return read_sectors(offset, len, buffer);
-	} else {
+	return is_sparse ? &sparse.sync.base : &raw.sync.base;
+}
+
+// provide a similar interface to nand_ReadSectors for imgio
+bool imgio_read_raw_sectors(sec_t sector, sec_t numSectors, void *buffer) {
+	if (!imgio_open()) {
+		prt("IMGIO: read fail\n");
+		return false;
+	}
+	raw_t *r = image_raw();
+	if (!r->start(r, BLK_READ, sector, numSectors, buffer) || !r->wait(r)) {
+		prt("IMGIO: read fail\n");
+		return false;
+	}
+	return true;
+}
+
+bool imgio_startup() {
+	if (stack.top != 0) {
 		return true;
 	}
+	if (!imgio_open()) {
+		return false;
+	}
+	blkstack_set_trace_dev(&stack, NANDTRACE_IMGIO);
+	return blkstack_startup(&stack, image_raw(), "IMGIO");
 }
 
-static bool write_sectors(sec_t start, sec_t len, const void *buffer) {
-	activity(COLOR_RED);
-	dsi_nand_crypt(crypt_buf, buffer, start * SECTOR_SIZE / AES_BLOCK_SIZE, len * SECTOR_SIZE / AES_BLOCK_SIZE);
-	if (fseek(f, start * SECTOR_SIZE, SEEK_SET) != 0) {
-		prt("IMGIO: seek fail\n");
-		activity(-1);
+bool imgio_is_inserted() {
+	return true;
+}
+
+bool dumped = false;
+
+// libfat starts the disc itself, the other users don't
+bool imgio_read_sectors(sec_t offset, sec_t len, void *buffer) {
+	// iprintf("R: %u(0x%08x), %u\n", (unsigned)offset, (unsigned)offset, (unsigned)len);
+	if (!imgio_startup()) {
 		return false;
 	}
-	activity(COLOR_BRIGHT_RED);
-	if (fwrite(crypt_buf, SECTOR_SIZE, len, f) == len) {
-		activity(-1);
-		return true;
-	} else {
-		prt("IMGIO: write fail\n");
-		activity(-1);
+	return blkstack_read(&stack, offset, len, buffer);
+}
+
+// same as imgio_read_sectors, plus updating sha1ctx with the decrypted data
+bool imgio_read_sectors_sha1(sec_t offset, sec_t len, void *buffer, swiSHA1context_t *sha1ctx) {
+	if (!imgio_startup()) {
 		return false;
 	}
+	return blkstack_read_sha1(&stack, offset, len, buffer, sha1ctx);
+}
+
+// the backup index stops describing nand.bin with the first write to it
+static void drop_backup_index() {
+	if (!index_dropped && delta_f == 0 && !is_sparse) {
+		remove(nand_idx_name);
+		index_dropped = true;
+	}
 }
 
 bool imgio_write_sectors(sec_t offset, sec_t len, const void *buffer) {
+	drop_backup_index();
 	// iprintf("W: %u(0x%08x), %u\n", (unsigned)offset, (unsigned)offset, (unsigned)len);
-	while (len >= CRYPT_BUF_LEN) {
-		if (!write_sectors(offset, CRYPT_BUF_LEN, buffer)) {
-			return false;
-		}
-		offset += CRYPT_BUF_LEN;
-		len -= CRYPT_BUF_LEN;
-		buffer = ((u8*)buffer) + SECTOR_SIZE * CRYPT_BUF_LEN;
+	return blkstack_write(&stack, offset, len, buffer);
+}
+
+// writes out what the cache and stdio are holding back, and the sparse map
+bool imgio_sync() {
+	if (!blkstack_sync(&stack)) {
+		return false;
 	}
-	if (len > 0) {
-		return write_sectors(offset, len, buffer);
-	} else {
+	if (delta_f != 0 && !raw_overlay_flush(&overlay)) {
+		return false;
+	}
+	if (f == 0) {
 		return true;
 	}
+	return is_sparse ? raw_sparse_flush(&sparse) : raw_file_flush(&raw);
 }
 
 bool imgio_clear_status() {
-	return true;
+	return imgio_sync();
+}
+
+void imgio_cache_stats(sector_cache_stats_t *stats) {
+	*stats = stack.cache.cache.stats;
+}
+
+void imgio_readahead_stats(readahead_stats_t *stats) {
+	*stats = stack.crypt.ra.stats;
+}
+
+void imgio_io_stats(blk_stats_t *stats, blk_time_t *time) {
+	*stats = stack.stats.stats;
+	*time = stack.crypt.time;
+}
+
+void imgio_file_stats(raw_file_stats_t *stats) {
+	*stats = raw.stats;
 }
 
 bool imgio_shutdown() {
-	free(crypt_buf);
-	crypt_buf = 0;
-	fclose(f);
-	f = 0;
-	return true;
+	bool ret = blkstack_shutdown(&stack);
+	ret = close_overlay() && ret;
+	if (f != 0) {
+		ret = close_image() && ret;
+	}
+	return ret;
+}
+
+bool imgio_overlay_active() {
+	return delta_f != 0;
+}
+
+void imgio_overlay_stats(overlay_stats_t *stats) {
+	if (delta_f != 0) {
+		*stats = overlay.stats;
+	} else {
+		memset(stats, 0, sizeof(*stats));
+	}
 }
 
 const DISC_INTERFACE io_nand_img = {
@@ -2,9 +2,34 @@
 
 #include <nds.h>
 #include <nds/disc_io.h>
+#include "crypto.h"
+#include "sector_cache.h"
+#include "readahead.h"
+#include "blkstack.h"
+#include "rawfile.h"
+#include "overlay.h"
 
 void imgio_set_fat_sig_fix(u32 offset);
 
+void imgio_set_crypt_ctx(const dsi_crypt_ctx_t *ctx);
+
 bool imgio_read_raw_sectors(sec_t sector, sec_t numSectors, void *buffer);
 
+void imgio_cache_stats(sector_cache_stats_t *stats);
+
+void imgio_readahead_stats(readahead_stats_t *stats);
+
+void imgio_io_stats(blk_stats_t *stats, blk_time_t *time);
+
+void imgio_file_stats(raw_file_stats_t *stats);
+
+bool imgio_sync();
+
+// nand.delta, copy-on-write over the image, applied while it's there, see overlay.h
+bool imgio_overlay_active();
+
+void imgio_overlay_stats(overlay_stats_t *stats);
+
+bool imgio_read_sectors_sha1(sec_t offset, sec_t len, void *buffer, swiSHA1context_t *sha1ctx);
+
 extern const DISC_INTERFACE io_nand_img;
@@ -11,6 +11,7 @@
 #include "utils.h"
 #include "walk.h"
 #include "nand.h"
+#include "trace.h"
 #include "scripting.h"
 #include "ticket0.h"
 #include "crypto.h"
@@ -31,6 +32,9 @@ const char nand_root[] = "sd:/";
 
 const char dump_dir[] = "dump";
 
+#define IO_STATS_NAME "io_stats.csv"
+#define TRACE_NAME "nand_trace.bin"
+
 int cert_ready, ticket_ready, region_ready;
 
 #define Cls "\x1b[2J"
@@ -50,7 +54,7 @@ typedef struct {
 }file_list_item_t;
 
 char *browse_path;
-const char footer[] = "(A)select (B)up (SELECT)quit";
+const char footer[] = "(A)sel (B)up (X)trc (Y)stat (ST)bak (SE)q";
 static_assert(sizeof(footer) - 1 <= TERM_COLS, "footer too long");
 file_list_item_t *file_list;
 int file_list_len;
@@ -312,6 +316,7 @@ void menu_action_script(const char *name, const char *full_path) {
 	// dry run
 	int ret = scripting(full_path, 1, &size);
 	iprtf("dry run returned %d\n", ret);
+	print_cache_stats();
 	if (ret != 0) {
 		return;
 	}
@@ -321,6 +326,10 @@ void menu_action_script(const char *name, const char *full_path) {
 	}
 	if(wait_yes_no("execute?")){
 		ret = scripting(full_path, 0, 0);
+		if (sync_nand() != 0) {
+			prt("failed to write back NAND cache\n");
+		}
+		print_cache_stats();
 		// TODO: some scripts might not induce writes
 		++executions;
 		iprtf("execution returned %d\n", ret);
@@ -347,6 +356,9 @@ void menu_action(const char *name) {
 		menu_action_script(name, fullname);
 	}else if(cert_ready && ticket_ready && region_ready && name_is_tmd(name, len_name)){
 		install_tmd(fullname, browse_path, df(nand_root, 0) - RESERVE_FREE);
+		if (sync_nand() != 0) {
+			prt("failed to write back NAND cache\n");
+		}
 	}else{
 		prt("don't know how to handle this file\n");
 	}
@@ -386,6 +398,28 @@ void menu() {
 			needs_redraw = 1;
 		} else if (keys & KEY_B) {
 			menu_cd(0);
+		} else if (keys & KEY_X) {
+			if (trace_active()) {
+				trace_stop();
+			} else if (wait_yes_no("record sector trace to " TRACE_NAME "?")) {
+				trace_start(TRACE_NAME);
+			}
+		} else if (keys & KEY_Y) {
+			print_cache_stats();
+			if (wait_yes_no("save to " IO_STATS_NAME "?")) {
+				save_io_stats(IO_STATS_NAME);
+			}
+		} else if (keys & KEY_START) {
+			if (wait_yes_no("backup NAND to nand.bin?")) {
+				backup();
+			} else if (wait_yes_no("dump used twl_main to twl_main.sparse?")) {
+				dump_main();
+			}
+		} else if (keys & KEY_R) {
+			// a key of its own, not in a chain of prompts B gets through, restore() asks again
+			if (wait_yes_no("restore NAND from nand.bin?")) {
+				restore();
+			}
 		} else if (keys & KEY_A) {
 			file_list_item_t *fli = file_list + view_pos + cur_pos;
 			if (fli->size == INVALID_SIZE) {
@@ -399,6 +433,7 @@ void menu() {
 			draw_file_list();
 		}
 	}
+	trace_stop();
 	free(file_list);
 	free_buf(browse_path);
 }
@@ -462,7 +497,14 @@ int main(int argc, const char * const argv[]) {
 	}
 	if (ret != 0) {
 		prt("most likely Console ID is wrong\n");
-		exit_with_prompt(ret);
+		// the search can take hours, it's not started without asking
+		prt("press A to search for it, B to exit\n");
+		if (wait_keys(KEY_A | KEY_B) != KEY_A) {
+			exit(ret);
+		}
+		if ((ret = search_console_id()) != 0) {
+			exit_with_prompt(ret);
+		}
 	}
 
 	if((ret = mount(0)) != 0) {
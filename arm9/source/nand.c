@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <malloc.h>
+#include <string.h>
 #include <nds.h>
 #include <fat.h>
 #include "../mbedtls/aes.h"
@@ -10,17 +11,29 @@
 #include "utils.h"
 #include "crypto.h"
 #include "sector0.h"
+#include "blkdev.h"
+#include "backup.h"
+#include "partdump.h"
 #include "nandio.h"
 #include "imgio.h"
 
 extern const char nand_vol_name[];
+extern const char nand_root[];
 extern swiSHA1context_t sha1ctx;
 
 const char nand_img_name[] = "nand.bin";
+const char nand_sparse_name[] = "nand.sparse";
+const char nand_delta_name[] = "nand.delta";
+const char nand_idx_name[] = "nand.bin.idx";
+const char nand_main_name[] = "twl_main.sparse";
 
 int is3DS;
 
+// keys of the console whose NAND is mounted, nandio/imgio and the ES/boot2 users all use this one
+dsi_crypt_ctx_t crypt_ctx;
+
 bool (*read_raw_sectors)(sec_t, sec_t, void*) = 0;
+bool (*read_sectors_sha1)(sec_t, sec_t, void*, swiSHA1context_t*) = 0;
 
 static u32 sector_buf32[SECTOR_SIZE/sizeof(u32)];
 static u8 *sector_buf = (u8*)sector_buf32;
@@ -104,8 +117,8 @@ int get_ids() {
 int test_sector0(int *p_is3DS) {
 	int is3DS = parse_ncsd(sector_buf, 0) == 0;
 	// iprintf("sector 0 is %s\n", is3DS ? "3DS" : "DSi");
-	dsi_crypt_init(console_id, emmc_cid, is3DS);
-	dsi_nand_crypt(sector_buf, sector_buf, 0, SECTOR_SIZE / AES_BLOCK_SIZE);
+	dsi_crypt_init(&crypt_ctx, console_id, emmc_cid, is3DS);
+	dsi_nand_crypt(&crypt_ctx, sector_buf, sector_buf, 0, SECTOR_SIZE / AES_BLOCK_SIZE);
 	if (p_is3DS) {
 		*p_is3DS = is3DS;
 	}
@@ -117,31 +130,459 @@ int test_ids_against_nand(int *p_is3DS) {
 	return test_sector0(p_is3DS);
 }
 
+#define ID_SEARCH_STEP 0x1000
+// progress and rate every this many candidates, well before the CPU timer wraps
+#define ID_SEARCH_REPORT 0x40000
+
+// search the low word of the console ID, the high word is kept from get_ids()
+// tested on the last block of sector 0, which is the empty 4th partition entry and 55 AA on DSi
+// B aborts, the console ID is saved to console_id.txt when found
+int search_console_id() {
+	if (!nand_ReadSectors(0, 1, sector_buf)) {
+		prt("failed to read sector 0\n");
+		return -1;
+	}
+	u32 plain32[AES_BLOCK_SIZE / sizeof(u32)] = { 0 };
+	u8 *plain = (u8*)plain32;
+	plain[14] = 0x55;
+	plain[15] = 0xaa;
+	u32 offset = SECTOR_SIZE / AES_BLOCK_SIZE - 1;
+	dsi_id_search_t s;
+	dsi_id_search_init(&s, console_id, emmc_cid, offset, sector_buf + offset * AES_BLOCK_SIZE, plain);
+
+	uint32_t lo;
+	GET_UINT32_BE(lo, console_id, 4);
+	prt("searching Console ID, hold B to abort\n");
+	u64 tested = 0;
+	u64 next_report = ID_SEARCH_REPORT;
+	u32 ms = 0;
+	int found = 0;
+	cpuStartTiming(0);
+	while (tested < 0x100000000ull) {
+		uint32_t start = lo;
+		if (dsi_id_search(&s, &lo, ID_SEARCH_STEP)) {
+			tested += lo - start + 1;
+			PUT_UINT32_BE(lo, console_id, 4);
+			// one block matching is no proof, check the whole sector
+			if (test_ids_against_nand(0) == 0) {
+				found = 1;
+				break;
+			}
+			++lo;
+		} else {
+			tested += ID_SEARCH_STEP;
+		}
+		if (tested >= next_report) {
+			u32 td = timerTicks2usec(cpuEndTiming());
+			ms += td / 1000;
+			iprtf("\r%08" PRIx32 " %" PRIu32 "/s   ", lo,
+				(u32)((tested - next_report + ID_SEARCH_REPORT) * 1000000ull / td));
+			next_report = tested + ID_SEARCH_REPORT;
+			cpuStartTiming(0);
+		}
+		scanKeys();
+		if (keysHeld() & KEY_B) {
+			break;
+		}
+	}
+	ms += timerTicks2usec(cpuEndTiming()) / 1000;
+	if (!found) {
+		prt(tested < 0x100000000ull ? "\naborted\n" : "\nConsole ID not found\n");
+		return -1;
+	}
+	iprtf("\n%" PRIu32 " tested in %" PRIu32 " ms\n", (u32)tested, ms);
+	prt("Console ID: ");
+	print_bytes(console_id, 8);
+	prt("\n");
+
+	char s_console_id[17];
+	for (int i = 0; i < 8; ++i) {
+		siprintf(s_console_id + i * 2, "%02X", console_id[i]);
+	}
+	save_file("console_id.txt", s_console_id, 16, 0);
+	return 0;
+}
+
 int mount(int direct) {
 	mbr_t *mbr = (mbr_t*)sector_buf;
 	imgio_set_fat_sig_fix(is3DS ? 0 : mbr->partitions[0].offset);
+	nandio_set_fat_sig_fix(is3DS ? 0 : mbr->partitions[0].offset);
+	imgio_set_crypt_ctx(&crypt_ctx);
+	nandio_set_crypt_ctx(&crypt_ctx);
 	read_raw_sectors = imgio_read_raw_sectors;
+	read_sectors_sha1 = imgio_read_sectors_sha1;
 	return 0;
 }
 
+static void print_io_stats(const char *name, const sector_cache_stats_t *st) {
+	if (st->hits + st->misses > 0) {
+		iprtf("%s cache: %" PRIu32 " hits, %" PRIu32 " misses, %" PRIu32 "%%\n",
+			name, st->hits, st->misses, (u32)(100ull * st->hits / (st->hits + st->misses)));
+	}
+	if (st->writes > 0) {
+		iprtf("%s: %" PRIu32 " sectors written as %" PRIu32 " sectors in %" PRIu32 " runs\n",
+			name, st->writes, st->run_sectors, st->runs);
+	}
+}
+
+static void print_readahead_stats(const char *name, const readahead_stats_t *st) {
+	if (st->hits + st->misses > 0) {
+		iprtf("%s read ahead: %" PRIu32 " streams, %" PRIu32 " hits, %" PRIu32 " misses, %" PRIu32 "%%\n",
+			name, st->streams, st->hits, st->misses, (u32)(100ull * st->hits / (st->hits + st->misses)));
+	}
+	if (st->dropped > 0) {
+		iprtf("%s: %" PRIu32 " of %" PRIu32 " sectors read ahead unused\n",
+			name, st->dropped, st->prefetched);
+	}
+}
+
+static inline u32 ticks_to_ms(u64 ticks) {
+	return (u32)(ticks * 1000 / BUS_CLOCK);
+}
+
+static inline u32 ticks_to_us(u64 ticks) {
+	return (u32)(ticks * 1000000 / BUS_CLOCK);
+}
+
+static void print_blk_op_stats(const char *name, const char *op, const blk_op_stats_t *st) {
+	if (st->calls == 0) {
+		return;
+	}
+	iprtf("%s %s: %" PRIu32 " calls, %" PRIu32 " sectors, %" PRIu32 "ms, avg %" PRIu32 "us\n",
+		name, op, st->calls, st->sectors, ticks_to_ms(st->ticks), ticks_to_us(st->ticks / st->calls));
+	if (st->errors > 0) {
+		iprtf("%s %s: %" PRIu32 " errors\n", name, op, st->errors);
+	}
+}
+
+static void print_blk_stats(const char *name, const blk_stats_t *st, const blk_time_t *t) {
+	print_blk_op_stats(name, "read", &st->read);
+	print_blk_op_stats(name, "write", &st->write);
+	if (t->media + t->aes + t->fat_fix > 0) {
+		iprtf("%s: media %" PRIu32 "ms, AES %" PRIu32 "ms, FAT fix %" PRIu32 "ms\n",
+			name, ticks_to_ms(t->media), ticks_to_ms(t->aes), ticks_to_ms(t->fat_fix));
+	}
+}
+
+void print_cache_stats() {
+	sector_cache_stats_t st;
+	readahead_stats_t rst;
+	blk_stats_t bst;
+	blk_time_t bt;
+	nandio_io_stats(&bst, &bt);
+	print_blk_stats("nandio", &bst, &bt);
+	nandio_cache_stats(&st);
+	print_io_stats("nandio", &st);
+	nandio_readahead_stats(&rst);
+	print_readahead_stats("nandio", &rst);
+	imgio_io_stats(&bst, &bt);
+	print_blk_stats("imgio", &bst, &bt);
+	imgio_cache_stats(&st);
+	print_io_stats("imgio", &st);
+	imgio_readahead_stats(&rst);
+	print_readahead_stats("imgio", &rst);
+	raw_file_stats_t fst;
+	imgio_file_stats(&fst);
+	if (fst.extents > 0) {
+		iprtf("imgio: cluster map, %" PRIu32 " extents, %" PRIu32 " crossed\n", fst.extents, fst.splits);
+	} else if (fst.seeks + fst.seeks_skipped > 0) {
+		iprtf("imgio: %" PRIu32 " seeks, %" PRIu32 " skipped\n", fst.seeks, fst.seeks_skipped);
+	}
+	if (imgio_overlay_active()) {
+		overlay_stats_t ost;
+		imgio_overlay_stats(&ost);
+		iprtf("imgio: overlay, %" PRIu32 " sectors changed in %" PRIu32 " chunks\n", ost.changed, ost.chunks);
+	}
+}
+
+static void save_blk_op_stats(FILE *f, const char *name, const char *op, const blk_op_stats_t *st) {
+	fiprintf(f, "%s,%s,%" PRIu32 ",%" PRIu32 ",%" PRIu64 ",%" PRIu32 ",%" PRIu32,
+		name, op, st->calls, st->sectors, (u64)st->sectors * SECTOR_SIZE, st->errors, ticks_to_us(st->ticks));
+	for (unsigned i = 0; i < BLK_SIZE_HIST_LEN; ++i) {
+		fiprintf(f, ",%" PRIu32, st->size_hist[i]);
+	}
+	for (unsigned i = 0; i < BLK_LAT_HIST_LEN; ++i) {
+		fiprintf(f, ",%" PRIu32, st->lat_hist[i]);
+	}
+	fiprintf(f, "\n");
+}
+
+// one row per device and op, request size and latency histograms as the last columns
+// then the time split of each device, both tables separated by an empty line
+int save_io_stats(const char *filename) {
+	FILE *f = fopen(filename, "w");
+	if (f == 0) {
+		iprtf("failed to open %s\n", filename);
+		return -1;
+	}
+	fiprintf(f, "device,op,calls,sectors,bytes,errors,us");
+	for (unsigned i = 0; i < BLK_SIZE_HIST_LEN; ++i) {
+		fiprintf(f, i < BLK_SIZE_HIST_LEN - 1 ? ",size_%u" : ",size_%u+", 1u << i);
+	}
+	for (unsigned i = 0; i < BLK_LAT_HIST_LEN; ++i) {
+		if (i == 0) {
+			fiprintf(f, ",lat_%uus-", 1u << BLK_LAT_HIST_SHIFT);
+		} else {
+			fiprintf(f, i < BLK_LAT_HIST_LEN - 1 ? ",lat_%uus" : ",lat_%uus+", 1u << (BLK_LAT_HIST_SHIFT + i - 1));
+		}
+	}
+	fiprintf(f, "\n");
+	blk_stats_t nst, ist;
+	blk_time_t nt, it;
+	nandio_io_stats(&nst, &nt);
+	imgio_io_stats(&ist, &it);
+	save_blk_op_stats(f, "nandio", "read", &nst.read);
+	save_blk_op_stats(f, "nandio", "write", &nst.write);
+	save_blk_op_stats(f, "imgio", "read", &ist.read);
+	save_blk_op_stats(f, "imgio", "write", &ist.write);
+	fiprintf(f, "\ndevice,media_us,aes_us,fat_fix_us\n");
+	fiprintf(f, "nandio,%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n",
+		ticks_to_us(nt.media), ticks_to_us(nt.aes), ticks_to_us(nt.fat_fix));
+	fiprintf(f, "imgio,%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n",
+		ticks_to_us(it.media), ticks_to_us(it.aes), ticks_to_us(it.fat_fix));
+	int ret = ferror(f) ? -1 : 0;
+	if (fclose(f) != 0) {
+		ret = -1;
+	}
+	if (ret != 0) {
+		iprtf("failed to write %s\n", filename);
+	}
+	return ret;
+}
+
+// writes out what nandio/imgio are holding back, libfat only flushes its own cache
+int sync_nand() {
+	return nandio_sync() && imgio_sync() ? 0 : -1;
+}
+
 // to prevent possible alloc failure for critical restore
 #define SECTORS_PER_LOOP 128
 #define DUMP_BUF_SIZE (SECTOR_SIZE * SECTORS_PER_LOOP)
-u32 dump_buf[DUMP_BUF_SIZE / sizeof(u32)];
+// aligned to cache lines, so nandio can read into it directly
+u32 dump_buf[DUMP_BUF_SIZE / sizeof(u32)] __attribute__((aligned(32)));
+
+// SHA1 of decrypted sectors of nand.bin through imgio, each byte is touched once while it's in cache
+// the decrypted data lands in dump_buf, in case the caller wants to keep it
+int sha1_sectors(void *digest, sec_t start, sec_t count) {
+	swiSHA1context_t ctx;
+	ctx.sha_block = 0;
+	swiSHA1Init(&ctx);
+	u32 bytes = count * SECTOR_SIZE;
+	cpuStartTiming(0);
+	while (count > 0) {
+		sec_t n = count < SECTORS_PER_LOOP ? count : SECTORS_PER_LOOP;
+		if (!read_sectors_sha1(start, n, dump_buf, &ctx)) {
+			cpuEndTiming();
+			iprtf("failed to read sector %" PRIu32 "\n", start);
+			return -1;
+		}
+		start += n;
+		count -= n;
+	}
+	u32 td = timerTicks2usec(cpuEndTiming());
+	swiSHA1Final(digest, &ctx);
+	iprtf("%s MB in %" PRIu32 " us, %.2f KB/s\n", to_mebi(bytes), td, 1000.0f * bytes / td);
+	return 0;
+}
+
+static_assert(DUMP_BUF_SIZE >= 2 * BACKUP_BLOCK_LEN * SECTOR_SIZE, "backup reads into both halves of dump_buf");
+
+static bool backup_aborted() {
+	scanKeys();
+	return keysHeld() & KEY_B;
+}
+
+// eMMC to nand.bin, with the no$gba footer and nand.bin.sha1
+// with nand.bin.idx of the nand.bin that nand.bin.sha1 has, only the blocks that changed are written
+// B aborts, until the eMMC was read to the end nand.bin stays as it was
+int backup() {
+	raw_t *raw = nandio_raw();
+	if (raw == 0) {
+		prt("can't access eMMC\n");
+		return -1;
+	}
+	// imgio would keep reading the old one
+	io_nand_img.shutdown();
+	nocash_footer_t footer;
+	memcpy(footer.footer_id, "DSi eMMC CID/CPU", sizeof(footer.footer_id));
+	memcpy(footer.emmc_cid, emmc_cid, sizeof(footer.emmc_cid));
+	reverse8(footer.console_id, console_id);
+	memset(footer.reserved, 0, sizeof(footer.reserved));
+	u8 image_sha1[SHA1_LEN];
+	bool have_sha1 = load_sha1_file(image_sha1, nand_img_name) == 0;
+	prt("(B) to abort\n");
+	backup_stats_t st;
+	sha1ctx.sha_block = 0;
+	if (backup_image(raw, nand_img_name, nand_idx_name, (u8*)dump_buf, &footer, sizeof(footer),
+		have_sha1 ? image_sha1 : 0, df(nand_root, 0), &sha1ctx, backup_aborted, &st) != 0)
+	{
+		if (st.touched) {
+			char sha1_name[sizeof(nand_img_name) + 5];
+			siprintf(sha1_name, "%s.sha1", nand_img_name);
+			remove(sha1_name);
+		}
+		return -1;
+	}
+	// only the SHA1 runs while the next block is read, the ARM7 does the eMMC read and the SD write in turn
+	iprtf("\n%" PRIu32 " ms: eMMC wait %" PRIu32 " ms, SHA1 %" PRIu32 " ms during the eMMC read, "
+		"SD write %" PRIu32 " ms after it\n",
+		ticks_to_ms(st.elapsed), ticks_to_ms(st.read_ticks),
+		ticks_to_ms(st.write_ticks - st.sd_ticks), ticks_to_ms(st.sd_ticks));
+	if (st.incremental) {
+		iprtf("%" PRIu32 " of %" PRIu32 " blocks changed, about %" PRIu32 " ms saved, "
+			"%" PRIu32 " ms to put them in place\n",
+			st.changed, st.blocks, ticks_to_ms(st.saved_ticks), ticks_to_ms(st.apply_ticks));
+	}
+	return save_sha1_file(nand_img_name);
+}
+
+// the no$gba footer has the eMMC CID and console ID, an image of another console is no good here
+static int check_footer(const char *name, sec_t sectors) {
+	FILE *f = fopen(name, "rb");
+	if (f == 0) {
+		iprtf("failed to open %s\n", name);
+		return -1;
+	}
+	nocash_footer_t footer;
+	u8 console_id_le[8];
+	bool ok = fseek(f, (long)sectors * SECTOR_SIZE, SEEK_SET) == 0
+		&& fread(&footer, sizeof(footer), 1, f) == 1;
+	fclose(f);
+	if (!ok) {
+		iprtf("%s has no footer\n", name);
+		return -1;
+	}
+	reverse8(console_id_le, console_id);
+	if (memcmp(footer.emmc_cid, emmc_cid, sizeof(footer.emmc_cid)) != 0
+		|| memcmp(footer.console_id, console_id_le, sizeof(footer.console_id)) != 0)
+	{
+		iprtf("%s is from another console\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+int wait_yes_no(const char *);
+
+// nand.bin to eMMC, only the blocks that differ are written, then read back
+// with nand.bin.idx of the nand.bin nand.bin.sha1 describes, the blocks are checked against it before they're written
+// asks again, with the image's SHA1, the eMMC is rewritten from here on
+// not abortable, half of it restored is worse than either
+int restore() {
+	raw_t *raw = nandio_raw();
+	if (raw == 0) {
+		prt("can't access eMMC\n");
+		return -1;
+	}
+	if (check_footer(nand_img_name, raw->sectors) != 0) {
+		return -1;
+	}
+	io_nand_img.shutdown();
+	u8 image_sha1[SHA1_LEN];
+	bool have_sha1 = load_sha1_file(image_sha1, nand_img_name) == 0;
+	if (have_sha1) {
+		iprtf("%s, SHA1 ", nand_img_name);
+		print_bytes(image_sha1, SHA1_LEN);
+		prt("\n");
+	} else {
+		iprtf("%s has no .sha1, its blocks can't be checked\n", nand_img_name);
+	}
+	if (!wait_yes_no("overwrite the eMMC with nand.bin?")) {
+		return -1;
+	}
+	restore_stats_t st;
+	int ret = restore_image(raw, nand_img_name, nand_idx_name, (u8*)dump_buf,
+		raw->sectors * SECTOR_SIZE + sizeof(nocash_footer_t), have_sha1 ? image_sha1 : 0, 0, &st);
+	// what nandio had cached is from before
+	nandio_invalidate();
+	iprtf("\n%" PRIu32 " of %" PRIu32 " blocks written in %" PRIu32 " runs, %" PRIu32 " bad\n",
+		st.changed, st.blocks, st.runs, st.bad);
+	iprtf("%" PRIu32 " ms, eMMC read %" PRIu32 " ms, write %" PRIu32 " ms, verify %" PRIu32 " ms\n",
+		ticks_to_ms(st.elapsed), ticks_to_ms(st.read_ticks), ticks_to_ms(st.write_ticks), ticks_to_ms(st.verify_ticks));
+	return ret;
+}
+
+static_assert(DUMP_BUF_SIZE >= SPARSE_BLOCK_LEN * SECTOR_SIZE, "the partition dump reads a block into dump_buf");
+
+// twl_main, decrypted, to twl_main.sparse, only the clusters its FAT has in use are read
+// B aborts, what was written is removed
+int dump_main() {
+	if (!io_dsi_nand.startup()) {
+		prt("can't access eMMC\n");
+		return -1;
+	}
+	prt("(B) to abort\n");
+	partdump_stats_t st;
+	if (dump_partition(&io_dsi_nand, nand_main_name, (u8*)dump_buf, backup_aborted, &st) != 0) {
+		return -1;
+	}
+	u32 skipped = st.sectors - st.read;
+	u32 permille = (u32)((u64)skipped * 1000 / st.sectors);
+	iprtf("\n%" PRIu32 " of %" PRIu32 " MB read, %" PRIu32 ".%" PRIu32 "%% free and skipped\n",
+		st.read / (1024 * 1024 / SECTOR_SIZE), st.sectors / (1024 * 1024 / SECTOR_SIZE), permille / 10, permille % 10);
+	iprtf("%" PRIu32 " of %" PRIu32 " blocks are holes\n", st.holes, st.blocks);
+	iprtf("%" PRIu32 " ms, eMMC %" PRIu32 " ms, SD %" PRIu32 " ms\n",
+		ticks_to_ms(st.elapsed), ticks_to_ms(st.read_ticks), ticks_to_ms(st.write_ticks));
+	return 0;
+}
+
+#define AES_BENCH_BLOCKS 0x1000
+
+// bus clock ticks per block, for aes_encrypt_128_be or its reference version
+static u32 aes_bench(void (*encrypt)(const uint32_t*, const unsigned char*, unsigned char*)) {
+	uint32_t rk[RK_LEN];
+	aes_set_key_enc_128_be(rk, (u8*)dump_buf);
+	u8 *block = (u8*)dump_buf;
+	cpuStartTiming(0);
+	for (int i = 0; i < AES_BENCH_BLOCKS; ++i) {
+		encrypt(rk, block, block);
+	}
+	return cpuEndTiming() / AES_BENCH_BLOCKS;
+}
 
 void aes_test(int loops, const char * s_console_id, const char * s_emmc_cid) {
+	if (aes_self_test() != 0) {
+		prt("AES self test failed\n");
+		return;
+	}
+#ifdef AES_FEWER_TABLES
+	prt("AES layout: 1 T table\n");
+#else
+	prt("AES layout: 4 T tables\n");
+#endif
+	prtf("AES: %" PRIu32 " ticks/block\n", aes_bench(aes_encrypt_128_be));
+#ifdef AES_ENCRYPT_REF
+	prtf("AES ref: %" PRIu32 " ticks/block\n", aes_bench(aes_encrypt_128_be_ref));
+#endif
+
 	hex2bytes(console_id, 8, s_console_id);
 	hex2bytes(emmc_cid, 16, s_emmc_cid);
-	dsi_crypt_init(console_id, emmc_cid, 0);
+	// a context of its own, doesn't disturb the mounted one
+	static dsi_crypt_ctx_t test_ctx;
+	dsi_crypt_init(&test_ctx, console_id, emmc_cid, 0);
 
+	// one block per call, how dsi_nand_crypt used to work
 	cpuStartTiming(0);
 	for (int i = 0; i < loops; ++i) {
-		dsi_nand_crypt((u8*)dump_buf, (u8*)dump_buf,
-			i * (DUMP_BUF_SIZE / AES_BLOCK_SIZE), DUMP_BUF_SIZE / AES_BLOCK_SIZE);
+		u32 offset = i * (DUMP_BUF_SIZE / AES_BLOCK_SIZE);
+		for (int j = 0; j < DUMP_BUF_SIZE / AES_BLOCK_SIZE; ++j) {
+			u8 *p = (u8*)dump_buf + j * AES_BLOCK_SIZE;
+			dsi_nand_crypt_1(&test_ctx, p, p, offset + j);
+		}
 	}
 	u32 td = timerTicks2usec(cpuEndTiming());
 
-	prtf("%" PRIu32 " us %u KB\n%.2f KB/s\n", td, (DUMP_BUF_SIZE * loops) >> 10,
+	prtf("per block: %" PRIu32 " us %u KB\n%.2f KB/s\n", td, (DUMP_BUF_SIZE * loops) >> 10,
+		1000.0f * DUMP_BUF_SIZE * loops / td);
+
+	cpuStartTiming(0);
+	for (int i = 0; i < loops; ++i) {
+		dsi_nand_crypt(&test_ctx, (u8*)dump_buf, (u8*)dump_buf,
+			i * (DUMP_BUF_SIZE / AES_BLOCK_SIZE), DUMP_BUF_SIZE / AES_BLOCK_SIZE);
+	}
+	td = timerTicks2usec(cpuEndTiming());
+
+	prtf("bulk: %" PRIu32 " us %u KB\n%.2f KB/s\n", td, (DUMP_BUF_SIZE * loops) >> 10,
 		1000.0f * DUMP_BUF_SIZE * loops / td);
 }
 
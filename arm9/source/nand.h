@@ -1,11 +1,30 @@
 #pragma once
 
+#include <nds.h>
+#include <nds/disc_io.h>
+
 int get_ids();
 
 int test_sector0(int *p_is3DS);
 
 int test_ids_against_nand();
 
+int search_console_id();
+
 int mount(int direct);
 
+void print_cache_stats();
+
+int save_io_stats(const char *filename);
+
+int sync_nand();
+
+int sha1_sectors(void *digest, sec_t start, sec_t count);
+
+int backup();
+
+int restore();
+
+int dump_main();
+
 void aes_test(int loops, const char * s_console_id, const char * s_emmc_cid);
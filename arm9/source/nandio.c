@@ -1,118 +1,94 @@
-
 #include <nds.h>
 #include <nds/disc_io.h>
-#include <malloc.h>
-#include "../term256/term256ext.h"
 #include "crypto.h"
+#include "rawdev.h"
+#include "blkstack.h"
+#include "nandio.h"
 
-#define SECTOR_SIZE 512
-#define CRYPT_BUF_LEN 64
-
-static u8* crypt_buf = 0;
-
-static u32 fat_sig_fix_offset = 0;
+// eMMC at the bottom of the stack
+static raw_nand_t raw;
+static blkstack_t stack;
 
 void nandio_set_fat_sig_fix(u32 offset) {
-	fat_sig_fix_offset = offset;
+	blkstack_set_fat_sig_fix(&stack, offset);
 }
 
-bool nandio_startup() {
-	if (crypt_buf == 0) {
-		crypt_buf = (u8*)memalign(32, SECTOR_SIZE * CRYPT_BUF_LEN);
-		if (crypt_buf == 0) {
-			prt("nandio: failed to alloc buffer\n");
-		}
-	}
-	return crypt_buf != 0;
+void nandio_set_crypt_ctx(const dsi_crypt_ctx_t *ctx) {
+	blkstack_set_crypt_ctx(&stack, ctx);
 }
 
-bool nandio_is_inserted() {
+bool nandio_startup() {
+	if (stack.top != 0) {
+		return true;
+	}
+	raw_nand_init(&raw);
+	blkstack_set_trace_dev(&stack, NANDTRACE_NANDIO);
+	if (!blkstack_startup(&stack, &raw.base, "NANDIO")) {
+		raw_nand_free(&raw);
+		return false;
+	}
 	return true;
 }
 
-// len is guaranteed <= CRYPT_BUF_LEN
-static bool read_sectors(sec_t start, sec_t len, void *buffer) {
-	activity(COLOR_BRIGHT_GREEN);
-	if (nand_ReadSectors(start, len, crypt_buf)) {
-		activity(COLOR_GREEN);
-		dsi_nand_crypt(buffer, crypt_buf, start * SECTOR_SIZE / AES_BLOCK_SIZE, len * SECTOR_SIZE / AES_BLOCK_SIZE);
-		if (fat_sig_fix_offset &&
-			start == fat_sig_fix_offset
-			&& ((u8*)buffer)[0x36] == 0
-			&& ((u8*)buffer)[0x37] == 0
-			&& ((u8*)buffer)[0x38] == 0)
-		{
-			((u8*)buffer)[0x36] = 'F';
-			((u8*)buffer)[0x37] = 'A';
-			((u8*)buffer)[0x38] = 'T';
-		}
-		activity(-1);
-		return true;
-	} else {
-		prt("NANDIO: read error\n");
-		activity(-1);
-		return false;
+// the eMMC itself, for bulk transfers past the stack, after what the cache holds back is written
+// nothing of the stack is in flight between its calls, the raw device is free until the next one
+raw_t *nandio_raw() {
+	if (!nandio_startup() || !nandio_sync()) {
+		return 0;
 	}
+	return &raw.base;
+}
+
+// after writes through nandio_raw
+void nandio_invalidate() {
+	blkstack_invalidate(&stack);
+}
+
+bool nandio_is_inserted() {
+	return true;
 }
 
 bool nandio_read_sectors(sec_t offset, sec_t len, void *buffer) {
 	// iprintf("R: %u(0x%08x), %u\n", (unsigned)offset, (unsigned)offset, (unsigned)len);
-	while (len >= CRYPT_BUF_LEN) {
-		if (!read_sectors(offset, CRYPT_BUF_LEN, buffer)) {
-			return false;
-		}
-		offset += CRYPT_BUF_LEN;
-		len -= CRYPT_BUF_LEN;
-		buffer = ((u8*)buffer) + SECTOR_SIZE * CRYPT_BUF_LEN;
-	}
-	if (len > 0) {
-		return read_sectors(offset, len, buffer);
-	} else {
-		return true;
-	}
+	return blkstack_read(&stack, offset, len, buffer);
 }
 
-static bool write_sectors(sec_t start, sec_t len, const void *buffer) {
-	activity(COLOR_RED);
-	dsi_nand_crypt(crypt_buf, buffer, start * SECTOR_SIZE / AES_BLOCK_SIZE, len * SECTOR_SIZE / AES_BLOCK_SIZE);
-	// if (fseek(f, start * SECTOR_SIZE, SEEK_SET) != 0) {
-	// if (fwrite(crypt_buf, SECTOR_SIZE, len, f) == len) {
-	activity(COLOR_BRIGHT_RED);
-	if(nand_WriteSectors(start, len, crypt_buf)){
-		activity(-1);
-		return true;
-	} else {
-		prt("NANDIO: write error\n");
-		activity(-1);
-		return false;
-	}
+// same as nandio_read_sectors, plus updating sha1ctx with the decrypted data
+bool nandio_read_sectors_sha1(sec_t offset, sec_t len, void *buffer, swiSHA1context_t *sha1ctx) {
+	return blkstack_read_sha1(&stack, offset, len, buffer, sha1ctx);
 }
 
 bool nandio_write_sectors(sec_t offset, sec_t len, const void *buffer) {
 	// iprintf("W: %u(0x%08x), %u\n", (unsigned)offset, (unsigned)offset, (unsigned)len);
-	while (len >= CRYPT_BUF_LEN) {
-		if (!write_sectors(offset, CRYPT_BUF_LEN, buffer)) {
-			return false;
-		}
-		offset += CRYPT_BUF_LEN;
-		len -= CRYPT_BUF_LEN;
-		buffer = ((u8*)buffer) + SECTOR_SIZE * CRYPT_BUF_LEN;
-	}
-	if (len > 0) {
-		return write_sectors(offset, len, buffer);
-	} else {
-		return true;
-	}
+	return blkstack_write(&stack, offset, len, buffer);
+}
+
+// writes out what the cache is holding back
+bool nandio_sync() {
+	return blkstack_sync(&stack);
 }
 
 bool nandio_clear_status() {
-	return true;
+	return nandio_sync();
+}
+
+void nandio_cache_stats(sector_cache_stats_t *stats) {
+	*stats = stack.cache.cache.stats;
+}
+
+void nandio_readahead_stats(readahead_stats_t *stats) {
+	*stats = stack.crypt.ra.stats;
+}
+
+void nandio_io_stats(blk_stats_t *stats, blk_time_t *time) {
+	*stats = stack.stats.stats;
+	*time = stack.crypt.time;
 }
 
 bool nandio_shutdown() {
-	free(crypt_buf);
-	crypt_buf = 0;
-	return true;
+	bool ret = blkstack_shutdown(&stack);
+	raw_nand_free(&raw);
+	return ret;
 }
 
 const DISC_INTERFACE io_dsi_nand = {
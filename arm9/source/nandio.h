@@ -2,7 +2,27 @@
 
 #include <nds.h>
 #include <nds/disc_io.h>
+#include "crypto.h"
+#include "sector_cache.h"
+#include "readahead.h"
+#include "blkstack.h"
 
 void nandio_set_fat_sig_fix(u32 offset);
 
+void nandio_set_crypt_ctx(const dsi_crypt_ctx_t *ctx);
+
+void nandio_cache_stats(sector_cache_stats_t *stats);
+
+void nandio_readahead_stats(readahead_stats_t *stats);
+
+void nandio_io_stats(blk_stats_t *stats, blk_time_t *time);
+
+bool nandio_sync();
+
+raw_t *nandio_raw();
+
+void nandio_invalidate();
+
+bool nandio_read_sectors_sha1(sec_t offset, sec_t len, void *buffer, swiSHA1context_t *sha1ctx);
+
 extern const DISC_INTERFACE io_dsi_nand;
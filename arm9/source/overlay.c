@@ -0,0 +1,287 @@
+#include <nds.h>
+#include <malloc.h>
+#include <string.h>
+#include "../term256/term256ext.h"
+#include "blkutil.h"
+#include "overlay.h"
+
+#define SECTOR_SIZE 512
+// bitmap bits, index entries in a sector
+#define BITS_PER_SECTOR (SECTOR_SIZE * 8)
+#define INDEX_PER_SECTOR (SECTOR_SIZE / sizeof(u32))
+
+static inline sec_t slot_sector(const raw_overlay_t *o, u32 slot) {
+	return o->h.data_sector + slot * OVERLAY_CHUNK_LEN;
+}
+
+static inline sec_t meta_sectors(const raw_overlay_t *o) {
+	return o->bitmap_sectors + o->index_sectors;
+}
+
+static bool lower_read(raw_overlay_t *o, sec_t start, sec_t len, void *buffer) {
+	return o->lower->start(o->lower, BLK_READ, start, len, buffer) && o->lower->wait(o->lower);
+}
+
+// the run of sectors from start, up to end, all in the delta or all not
+static sec_t run_len(const raw_overlay_t *o, sec_t start, sec_t end, bool *in_delta) {
+	*in_delta = test_bit(o->bitmap, start);
+	sec_t i = start + 1;
+	while (i < end && test_bit(o->bitmap, i) == *in_delta) {
+		++i;
+	}
+	return i - start;
+}
+
+static bool read_piece(raw_overlay_t *o, u32 c, sec_t start, sec_t n, u8 *data) {
+	u32 slot = o->index[c];
+	if (slot == OVERLAY_NONE) {
+		return lower_read(o, start, n, data);
+	}
+	sec_t end = start + n;
+	while (start < end) {
+		bool in_delta;
+		sec_t len = run_len(o, start, end, &in_delta);
+		bool ok = in_delta
+			? raw_file_rw(o->delta, BLK_READ, slot_sector(o, slot) + start % OVERLAY_CHUNK_LEN, len, data)
+			: lower_read(o, start, len, data);
+		if (!ok) {
+			return false;
+		}
+		start += len;
+		data += len * SECTOR_SIZE;
+	}
+	return true;
+}
+
+static bool write_piece(raw_overlay_t *o, u32 c, sec_t start, sec_t n, const u8 *data) {
+	u32 slot = o->index[c];
+	sec_t off = start % OVERLAY_CHUNK_LEN;
+	if (slot == OVERLAY_NONE) {
+		// appended whole, what's not written yet is never read from here
+		slot = o->h.slots;
+		memset(o->chunk_buf, 0, OVERLAY_CHUNK_LEN * SECTOR_SIZE);
+		memcpy(o->chunk_buf + off * SECTOR_SIZE, data, n * SECTOR_SIZE);
+		if (!raw_file_rw(o->delta, BLK_WRITE, slot_sector(o, slot), OVERLAY_CHUNK_LEN, o->chunk_buf)) {
+			return false;
+		}
+		++o->h.slots;
+		o->header_dirty = true;
+		o->index[c] = slot;
+		set_bit(o->meta_dirty, o->bitmap_sectors + c / INDEX_PER_SECTOR);
+		++o->stats.chunks;
+	} else if (!raw_file_rw(o->delta, BLK_WRITE, slot_sector(o, slot) + off, n, (void*)data)) {
+		return false;
+	}
+	for (sec_t i = start; i < start + n; ++i) {
+		if (!test_bit(o->bitmap, i)) {
+			set_bit(o->bitmap, i);
+			set_bit(o->meta_dirty, i / BITS_PER_SECTOR);
+			++o->stats.changed;
+		}
+	}
+	return true;
+}
+
+bool raw_overlay_rw(raw_overlay_t *o, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	if (start + len > o->h.sectors || start + len < start) {
+		return false;
+	}
+	u8 *p = (u8*)buffer;
+	while (len > 0) {
+		u32 c = start / OVERLAY_CHUNK_LEN;
+		sec_t n = OVERLAY_CHUNK_LEN - start % OVERLAY_CHUNK_LEN;
+		if (n > len) {
+			n = len;
+		}
+		bool ok = op == BLK_READ
+			? read_piece(o, c, start, n, p)
+			: write_piece(o, c, start, n, p);
+		if (!ok) {
+			return false;
+		}
+		start += n;
+		len -= n;
+		p += n * SECTOR_SIZE;
+	}
+	return true;
+}
+
+// bitmap and index are one run of sectors in the delta, and in memory
+static u8 *meta_ptr(raw_overlay_t *o, u32 i) {
+	return i < o->bitmap_sectors
+		? o->bitmap + i * SECTOR_SIZE
+		: (u8*)o->index + (i - o->bitmap_sectors) * SECTOR_SIZE;
+}
+
+static bool write_header(raw_overlay_t *o) {
+	memset(o->chunk_buf, 0, SECTOR_SIZE);
+	memcpy(o->chunk_buf, &o->h, sizeof(o->h));
+	return raw_file_rw(o->delta, BLK_WRITE, 0, 1, o->chunk_buf);
+}
+
+// chunks before the bitmap and index pointing at them
+bool raw_overlay_flush(raw_overlay_t *o) {
+	if (!raw_file_flush(o->delta)) {
+		return false;
+	}
+	bool any = o->header_dirty;
+	for (u32 i = 0; i < meta_sectors(o); ++i) {
+		if (!test_bit(o->meta_dirty, i)) {
+			continue;
+		}
+		sec_t sector = i < o->bitmap_sectors ? o->h.bitmap_sector + i : o->h.index_sector + i - o->bitmap_sectors;
+		if (!raw_file_rw(o->delta, BLK_WRITE, sector, 1, meta_ptr(o, i))) {
+			return false;
+		}
+		clear_bit(o->meta_dirty, i);
+		any = true;
+	}
+	if (o->header_dirty) {
+		if (!write_header(o)) {
+			return false;
+		}
+		o->header_dirty = false;
+	}
+	return !any || raw_file_flush(o->delta);
+}
+
+static bool overlay_rw(raw_sync_t *r, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	return raw_overlay_rw((raw_overlay_t*)r, op, start, len, buffer);
+}
+
+static bool overlay_alloc(raw_overlay_t *o) {
+	o->bitmap_sectors = (o->h.sectors + BITS_PER_SECTOR - 1) / BITS_PER_SECTOR;
+	o->index_sectors = (o->h.chunks + INDEX_PER_SECTOR - 1) / INDEX_PER_SECTOR;
+	o->bitmap = (u8*)memalign(32, o->bitmap_sectors * SECTOR_SIZE);
+	o->index = (u32*)memalign(32, o->index_sectors * SECTOR_SIZE);
+	o->meta_dirty = (u8*)malloc((meta_sectors(o) + 7) / 8);
+	o->chunk_buf = (u8*)memalign(32, OVERLAY_CHUNK_LEN * SECTOR_SIZE);
+	if (o->bitmap == 0 || o->index == 0 || o->meta_dirty == 0 || o->chunk_buf == 0) {
+		raw_overlay_free(o);
+		return false;
+	}
+	memset(o->meta_dirty, 0, (meta_sectors(o) + 7) / 8);
+	return true;
+}
+
+static bool create(raw_overlay_t *o, const u8 *base_sha1) {
+	memset(&o->h, 0, sizeof(o->h));
+	o->h.magic = OVERLAY_MAGIC;
+	o->h.version = OVERLAY_VERSION;
+	o->h.chunk_len = OVERLAY_CHUNK_LEN;
+	o->h.sectors = o->lower->sectors;
+	o->h.chunks = (o->h.sectors + OVERLAY_CHUNK_LEN - 1) / OVERLAY_CHUNK_LEN;
+	memcpy(o->h.base_sha1, base_sha1, SHA1_LEN);
+	if (!overlay_alloc(o)) {
+		prt("failed to alloc overlay\n");
+		return false;
+	}
+	o->h.bitmap_sector = 1;
+	o->h.index_sector = 1 + o->bitmap_sectors;
+	o->h.data_sector = o->h.index_sector + o->index_sectors;
+	memset(o->bitmap, 0, o->bitmap_sectors * SECTOR_SIZE);
+	memset(o->index, 0xff, o->index_sectors * SECTOR_SIZE);
+	// the delta only grows at the end, in order
+	if (!write_header(o)) {
+		return false;
+	}
+	for (u32 i = 0; i < meta_sectors(o); ++i) {
+		if (!raw_file_rw(o->delta, BLK_WRITE, 1 + i, 1, meta_ptr(o, i))) {
+			return false;
+		}
+	}
+	return raw_file_flush(o->delta);
+}
+
+static bool load(raw_overlay_t *o, const u8 *base_sha1) {
+	u32 sector[SECTOR_SIZE / sizeof(u32)];
+	if (!raw_file_rw(o->delta, BLK_READ, 0, 1, sector)) {
+		return false;
+	}
+	memcpy(&o->h, sector, sizeof(o->h));
+	if (o->h.magic != OVERLAY_MAGIC || o->h.version != OVERLAY_VERSION || o->h.chunk_len != OVERLAY_CHUNK_LEN
+		|| o->h.chunks != (o->h.sectors + OVERLAY_CHUNK_LEN - 1) / OVERLAY_CHUNK_LEN)
+	{
+		prt("not an overlay delta\n");
+		return false;
+	}
+	if (o->h.sectors != o->lower->sectors || memcmp(o->h.base_sha1, base_sha1, SHA1_LEN) != 0) {
+		prt("overlay delta is for another image\n");
+		return false;
+	}
+	if (!overlay_alloc(o)) {
+		prt("failed to alloc overlay\n");
+		return false;
+	}
+	for (u32 i = 0; i < meta_sectors(o); ++i) {
+		if (!raw_file_rw(o->delta, BLK_READ, o->h.bitmap_sector + i, 1, meta_ptr(o, i))) {
+			raw_overlay_free(o);
+			return false;
+		}
+	}
+	for (u32 c = 0; c < o->h.chunks; ++c) {
+		if (o->index[c] != OVERLAY_NONE && o->index[c] >= o->h.slots) {
+			prt("overlay delta corrupted\n");
+			raw_overlay_free(o);
+			return false;
+		}
+		o->stats.chunks += o->index[c] != OVERLAY_NONE;
+	}
+	for (u32 i = 0; i < o->h.sectors; ++i) {
+		o->stats.changed += test_bit(o->bitmap, i);
+	}
+	// chunks appended after the last flush aren't in the index and their sectors aren't in the bitmap,
+	// which chunk a slot holds is only in the index, so what was written to them is lost, the delta
+	// reads as it was at that flush, like a cache a crash caught dirty, new chunks go past them
+	sec_t end = o->delta->sync.base.sectors;
+	if (end < slot_sector(o, o->h.slots)) {
+		prt("overlay delta truncated\n");
+		raw_overlay_free(o);
+		return false;
+	}
+	if (end > slot_sector(o, o->h.slots)) {
+		o->h.slots = (end - o->h.data_sector + OVERLAY_CHUNK_LEN - 1) / OVERLAY_CHUNK_LEN;
+		o->header_dirty = true;
+		memset(o->chunk_buf, 0, SECTOR_SIZE);
+		while (end < slot_sector(o, o->h.slots)) {
+			if (!raw_file_rw(o->delta, BLK_WRITE, end++, 1, o->chunk_buf)) {
+				raw_overlay_free(o);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool raw_overlay_open(raw_overlay_t *o, raw_t *lower, raw_file_t *delta, const u8 *base_sha1) {
+	// the delta takes any buffer the image can
+	raw_sync_init(&o->sync, overlay_rw, lower->is_direct);
+	o->lower = lower;
+	o->delta = delta;
+	o->bitmap = 0;
+	o->index = 0;
+	o->meta_dirty = 0;
+	o->chunk_buf = 0;
+	o->header_dirty = false;
+	memset(&o->stats, 0, sizeof(o->stats));
+	if (lower->sectors == 0) {
+		return false;
+	}
+	if (!(delta->sync.base.sectors == 0 ? create(o, base_sha1) : load(o, base_sha1))) {
+		raw_overlay_free(o);
+		return false;
+	}
+	o->sync.base.sectors = o->h.sectors;
+	return true;
+}
+
+void raw_overlay_free(raw_overlay_t *o) {
+	free(o->bitmap);
+	o->bitmap = 0;
+	free(o->index);
+	o->index = 0;
+	free(o->meta_dirty);
+	o->meta_dirty = 0;
+	free(o->chunk_buf);
+	o->chunk_buf = 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <nds.h>
+#include "blkdev.h"
+#include "crypto.h"
+#include "rawfile.h"
+
+// copy-on-write overlay over a NAND image, nand.delta
+// the base is only read, writes go to the delta, in chunks appended as they're first written
+// a bitmap has the sectors written, the rest of a chunk still reads from the base
+// nothing merges it into the base, removing it throws the changes away
+// the delta: a header sector, the bitmap, the chunk index, then the chunks
+
+#define OVERLAY_MAGIC 0x4c564f4e // "NOVL"
+#define OVERLAY_VERSION 1
+// sectors, 4KB, a cluster of the DSi's FAT
+#define OVERLAY_CHUNK_LEN 8
+
+#define OVERLAY_NONE 0xffffffff
+
+typedef struct {
+	u32 magic;
+	u16 version;
+	u16 chunk_len;
+	u32 sectors; // of the base
+	u32 chunks;
+	u32 bitmap_sector; // in the delta
+	u32 index_sector;
+	u32 data_sector; // chunk slot 0
+	u32 slots;
+	// of the whole base, from its .sha1, a delta is only applied to the image it was made against
+	u8 base_sha1[SHA1_LEN];
+} overlay_header_t;
+
+typedef struct {
+	u32 changed; // sectors
+	u32 chunks;
+} overlay_stats_t;
+
+typedef struct {
+	raw_sync_t sync;
+	raw_t *lower; // the image, never written to
+	raw_file_t *delta; // growable
+	overlay_header_t h;
+	u8 *bitmap; // padded to whole sectors
+	u32 bitmap_sectors;
+	u32 *index; // slot of each chunk, or OVERLAY_NONE, padded to whole sectors
+	u32 index_sectors;
+	u8 *meta_dirty; // one bit per bitmap and index sector, in that order
+	bool header_dirty;
+	u8 *chunk_buf;
+	overlay_stats_t stats;
+} raw_overlay_t;
+
+// an empty delta is set up against lower, an existing one has to match it
+// base_sha1 is the SHA1 of all of lower, hashing it here would read the whole image on every open
+bool raw_overlay_open(raw_overlay_t *o, raw_t *lower, raw_file_t *delta, const u8 *base_sha1);
+
+bool raw_overlay_rw(raw_overlay_t *o, blk_op_t op, sec_t start, sec_t len, void *buffer);
+
+// the chunks written so far, then bitmap, index and header
+bool raw_overlay_flush(raw_overlay_t *o);
+
+void raw_overlay_free(raw_overlay_t *o);
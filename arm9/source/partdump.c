@@ -0,0 +1,188 @@
+#include <nds.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <string.h>
+#include "../term256/term256ext.h"
+#include "blkutil.h"
+#include "fatmap.h"
+#include "rawfile.h"
+#include "sparse.h"
+#include "partdump.h"
+
+#define SECTOR_SIZE 512
+
+// the image and its container, raw_file_init expects the buffers it allocates to start out 0
+static raw_file_t file;
+static raw_sparse_t s;
+
+// one bit per cluster from cluster 2, set where the first FAT has anything but free
+// clusters the FAT is too short for are taken as in use, they're read rather than lost
+static u8 *build_bitmap(const DISC_INTERFACE *disc, const fat_geom_t *g, u8 *buf, partdump_stats_t *st) {
+	u32 bytes = (g->clusters + 7) / 8;
+	u8 *bits = (u8*)malloc(bytes);
+	if (bits == 0) {
+		prt("failed to alloc memory\n");
+		return 0;
+	}
+	memset(bits, 0xff, bytes);
+	u32 entry_size = g->fat32 ? 4 : 2;
+	u32 per_sector = SECTOR_SIZE / entry_size;
+	sec_t fat_len = min_sec(g->fat_sectors, ((g->clusters + 2) * entry_size + SECTOR_SIZE - 1) / SECTOR_SIZE);
+	u32 covered = min_sec(g->clusters + 2, fat_len * per_sector);
+	for (sec_t i = 0; i < fat_len; i += SPARSE_BLOCK_LEN) {
+		sec_t n = min_sec(SPARSE_BLOCK_LEN, fat_len - i);
+		u32 t = blk_clock();
+		bool ok = disc->readSectors(g->fat + i, n, buf);
+		st->read_ticks += blk_clock() - t;
+		if (!ok) {
+			iprtf("failed to read FAT sector %" PRIu32 "\n", g->fat + i);
+			free(bits);
+			return 0;
+		}
+		u32 first = i * per_sector;
+		for (u32 c = first < 2 ? 2 : first; c < first + n * per_sector && c < covered; ++c) {
+			const u8 *e = buf + (c - first) * entry_size;
+			if ((g->fat32 ? le32(e) & 0x0fffffff : le16(e)) == 0) {
+				clear_bit(bits, c - 2);
+			}
+		}
+	}
+	for (u32 c = 0; c < g->clusters; ++c) {
+		st->used += test_bit(bits, c);
+	}
+	return bits;
+}
+
+// the boot sector, FATs and root directory always, a cluster when it's in use
+// past the last whole cluster is nothing a file can have
+static inline bool in_use(const fat_geom_t *g, const u8 *bits, sec_t sector) {
+	sec_t lba = g->part + sector;
+	if (lba < g->data) {
+		return true;
+	}
+	u32 c = (lba - g->data) / g->sectors_per_cluster;
+	return c < g->clusters && test_bit(bits, c);
+}
+
+int dump_partition(const DISC_INTERFACE *disc, const char *name, u8 *buf,
+	bool (*aborted)(), partdump_stats_t *st)
+{
+	memset(st, 0, sizeof(*st));
+	fat_geom_t g;
+	if (!fatmap_geom(disc, &g)) {
+		prt("no FAT partition found\n");
+		return -1;
+	}
+	sec_t total = g.sectors;
+	st->sectors = total;
+	st->clusters = g.clusters;
+	st->blocks = (total + SPARSE_BLOCK_LEN - 1) / SPARSE_BLOCK_LEN;
+	u32 t_start = blk_clock();
+	u8 *bits = build_bitmap(disc, &g, buf, st);
+	if (bits == 0) {
+		return -1;
+	}
+	st->elapsed += blk_clock() - t_start;
+	iprtf("%s: %" PRIu32 " MB, %" PRIu32 " of %" PRIu32 " clusters in use\n",
+		name, total / MB_SECTORS, st->used, st->clusters);
+
+	FILE *f = fopen(name, "w+b");
+	if (f == 0) {
+		iprtf("failed to open %s to write\n", name);
+		free(bits);
+		return -1;
+	}
+	bool ok = raw_file_init(&file, f, 0);
+	if (ok) {
+		file.growable = true;
+		// decrypted, the keys have nothing to rebuild
+		ok = raw_sparse_create(&s, &file, total, 0);
+	}
+	if (!ok) {
+		iprtf("failed to create %s\n", name);
+		raw_sparse_free(&s);
+		fclose(f);
+		raw_file_free(&file);
+		remove(name);
+		free(bits);
+		return -1;
+	}
+
+	u32 t_report = blk_clock();
+	sec_t done = 0, reported = 0;
+	bool stopped = false;
+	for (u32 b = 0; ok && b < st->blocks; ++b) {
+		sec_t n = min_sec(SPARSE_BLOCK_LEN, total - done);
+		// runs of sectors in use are read, the free ones between them zeroed
+		bool any = false;
+		for (sec_t i = 0; ok && i < n;) {
+			bool use = in_use(&g, bits, done + i);
+			sec_t j = i + 1;
+			while (j < n && in_use(&g, bits, done + j) == use) {
+				++j;
+			}
+			if (use) {
+				u32 t = blk_clock();
+				ok = disc->readSectors(g.part + done + i, j - i, buf + i * SECTOR_SIZE);
+				st->read_ticks += blk_clock() - t;
+				if (!ok) {
+					iprtf("\nfailed to read sector %" PRIu32 "\n", g.part + done + i);
+				}
+				st->read += j - i;
+				any = true;
+			} else {
+				memset(buf + i * SECTOR_SIZE, 0, (j - i) * SECTOR_SIZE);
+			}
+			i = j;
+		}
+		if (!ok) {
+			break;
+		}
+		if (any) {
+			u32 t = blk_clock();
+			ok = raw_sparse_rw(&s, BLK_WRITE, done, n, buf);
+			st->write_ticks += blk_clock() - t;
+			if (!ok) {
+				iprtf("\nerror writing %s\n", name);
+				break;
+			}
+		} else {
+			// left as the implicit zero block it was created as
+			++st->holes;
+		}
+		done += n;
+		u32 now = blk_clock();
+		if (now - t_report >= REPORT_TICKS || done == total) {
+			st->elapsed += now - t_report;
+			report_progress(done, total, done - reported, now - t_report);
+			t_report = now;
+			reported = done;
+		}
+		if (aborted != 0 && aborted()) {
+			prt("\naborted\n");
+			stopped = true;
+			ok = false;
+		}
+	}
+	if (ok) {
+		u32 t = blk_clock();
+		ok = raw_sparse_flush(&s);
+		st->write_ticks += blk_clock() - t;
+		st->elapsed += blk_clock() - t;
+	}
+	raw_sparse_free(&s);
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	raw_file_free(&file);
+	free(bits);
+	if (!ok) {
+		if (!stopped) {
+			iprtf("failed to write %s\n", name);
+		}
+		remove(name);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <nds.h>
+#include <nds/disc_io.h>
+#include "sparse.h"
+
+// the FAT partition of a disc, decrypted, to a sparse image of it, twl_main.sparse
+// only what the file system uses is read: the boot sector, the FATs, the root directory
+// and the clusters the FAT has in use, free clusters read as zero from the image
+// blocks with nothing in use are holes, never stored, host/nandsparse unpack fills them in
+
+typedef struct {
+	u32 sectors; // of the partition
+	u32 clusters;
+	u32 used; // clusters in use
+	u32 read; // sectors
+	u32 blocks;
+	u32 holes; // blocks
+	u64 read_ticks; // FAT and clusters
+	u64 write_ticks;
+	u64 elapsed;
+} partdump_stats_t;
+
+// disc reads decrypted sectors, buf is a sparse block, whole cache lines in main RAM
+// aborted is polled between blocks, it may be 0, an image that didn't finish is removed
+int dump_partition(const DISC_INTERFACE *disc, const char *name, u8 *buf,
+	bool (*aborted)(), partdump_stats_t *st);
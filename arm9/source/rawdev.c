@@ -0,0 +1,107 @@
+#include <nds.h>
+#include <malloc.h>
+#include <string.h>
+#include "rawdev.h"
+
+#define SECTOR_SIZE 512
+
+// buffer must be whole cache lines in main RAM, the ARM7 works on it behind the cache
+static bool ring_start(raw_nand_t *r, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	ioring_t *ring = r->ring;
+	int i = ioring_queue(ring, r->done, op == BLK_READ ? IORING_READ : IORING_WRITE, start, len, buffer);
+	if (i < 0) {
+		return false;
+	}
+	DC_FlushRange(buffer, len * SECTOR_SIZE);
+	DC_FlushRange(&ring->desc[i], sizeof(ioring_desc_t));
+	++ring->head;
+	DC_FlushRange((void*)&ring->head, 32);
+	fifoSendValue32(IORING_FIFO, 0);
+	return true;
+}
+
+// the oldest one queued
+static bool ring_wait(raw_nand_t *r) {
+	fifoWaitValue32(IORING_FIFO);
+	ioring_desc_t *d = &r->ring->desc[fifoGetValue32(IORING_FIFO) % IORING_LEN];
+	++r->done;
+	DC_InvalidateRange(d, sizeof(ioring_desc_t));
+	if (d->op == IORING_READ) {
+		DC_InvalidateRange(d->buffer, d->count * SECTOR_SIZE);
+	}
+	return d->result == 0;
+}
+
+// without the ring, the transfer is already done when this returns
+static bool nand_start(raw_t *raw, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	raw_nand_t *r = (raw_nand_t*)raw;
+	if (r->ring != 0) {
+		return ring_start(r, op, start, len, buffer);
+	}
+	r->sync_ok = op == BLK_READ
+		? nand_ReadSectors(start, len, buffer)
+		: nand_WriteSectors(start, len, buffer);
+	return true;
+}
+
+static bool nand_wait(raw_t *raw) {
+	raw_nand_t *r = (raw_nand_t*)raw;
+	return r->ring != 0 ? ring_wait(r) : r->sync_ok;
+}
+
+// the ARM7 end is in arm7/source/main.c
+// not fatal if the ring can't be allocated, transfers are just done one at a time
+void raw_nand_init(raw_nand_t *r) {
+	r->base.start = nand_start;
+	r->base.wait = nand_wait;
+	r->base.is_direct = blk_line_is_direct;
+	r->base.sectors = nand_GetSize();
+	r->done = 0;
+	r->sync_ok = false;
+	r->ring = (ioring_t*)memalign(32, sizeof(ioring_t));
+	if (r->ring == 0) {
+		return;
+	}
+	memset(r->ring, 0, sizeof(ioring_t));
+	DC_FlushRange(r->ring, sizeof(ioring_t));
+	fifoSendValue32(FIFO_USER_01, IORING_CMD_SETUP);
+	fifoSendAddress(FIFO_USER_01, r->ring);
+	while (!fifoCheckValue32(FIFO_USER_01)) swiIntrWait(1, IRQ_FIFO_NOT_EMPTY);
+	fifoGetValue32(FIFO_USER_01);
+}
+
+void raw_nand_free(raw_nand_t *r) {
+	if (r->ring == 0) {
+		return;
+	}
+	fifoSendValue32(FIFO_USER_01, IORING_CMD_TEARDOWN);
+	while (!fifoCheckValue32(FIFO_USER_01)) swiIntrWait(1, IRQ_FIFO_NOT_EMPTY);
+	fifoGetValue32(FIFO_USER_01);
+	free(r->ring);
+	r->ring = 0;
+}
+
+static bool mem_start(raw_t *raw, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	raw_mem_t *r = (raw_mem_t*)raw;
+	if (start + len > raw->sectors) {
+		return false;
+	}
+	if (op == BLK_READ) {
+		memcpy(buffer, r->data + start * SECTOR_SIZE, len * SECTOR_SIZE);
+	} else {
+		memcpy(r->data + start * SECTOR_SIZE, buffer, len * SECTOR_SIZE);
+	}
+	return true;
+}
+
+static bool mem_wait(raw_t *raw) {
+	return true;
+}
+
+void raw_mem_init(raw_mem_t *r, void *data, sec_t sectors) {
+	r->base.start = mem_start;
+	r->base.wait = mem_wait;
+	r->base.is_direct = blk_word_is_direct;
+	r->base.sectors = sectors;
+	r->data = (u8*)data;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "blkdev.h"
+#include "ioring.h"
+
+// eMMC, through the ARM7 descriptor ring, or nand_Read/WriteSectors if that can't be set up
+typedef struct {
+	raw_t base;
+	ioring_t *ring;
+	// completions taken, the ARM7 finishes descriptors in order
+	u32 done;
+	bool sync_ok;
+} raw_nand_t;
+
+void raw_nand_init(raw_nand_t *r);
+
+void raw_nand_free(raw_nand_t *r);
+
+// an image in memory
+typedef struct {
+	raw_t base;
+	u8 *data;
+} raw_mem_t;
+
+void raw_mem_init(raw_mem_t *r, void *data, sec_t sectors);
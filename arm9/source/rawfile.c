@@ -0,0 +1,192 @@
+#include <nds.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "../term256/term256ext.h"
+#include "rawfile.h"
+
+#define SECTOR_SIZE 512
+// newlib's default is BUFSIZ, a 32 sector chunk would go to libfat as 1KB refills
+#define STDIO_BUF_LEN 64
+#define BOUNCE_LEN 8
+#define POS_UNKNOWN ((sec_t)-1)
+
+// libfat walks the cluster chain on every seek, from the start of the file when it goes back
+// stdio also needs one between a write and a read
+static bool stdio_rw(raw_file_t *r, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	if (r->pos != start || r->last_op != op) {
+		++r->stats.seeks;
+		if (fseek(r->f, start * SECTOR_SIZE, SEEK_SET) != 0) {
+			r->pos = POS_UNKNOWN;
+			return false;
+		}
+	} else {
+		++r->stats.seeks_skipped;
+	}
+	r->last_op = op;
+	bool ok = op == BLK_READ
+		? fread(buffer, SECTOR_SIZE, len, r->f) == len
+		: fwrite(buffer, SECTOR_SIZE, len, r->f) == len;
+	r->pos = ok ? start + len : POS_UNKNOWN;
+	return ok;
+}
+
+static bool disc_rw(raw_file_t *r, blk_op_t op, sec_t lba, sec_t len, u8 *buffer) {
+	if (blk_line_is_direct(buffer)) {
+		return op == BLK_READ
+			? r->disc->readSectors(lba, len, buffer)
+			: r->disc->writeSectors(lba, len, buffer);
+	}
+	while (len > 0) {
+		sec_t n = len < BOUNCE_LEN ? len : BOUNCE_LEN;
+		if (op == BLK_READ) {
+			if (!r->disc->readSectors(lba, n, r->bounce)) {
+				return false;
+			}
+			memcpy(buffer, r->bounce, n * SECTOR_SIZE);
+		} else {
+			memcpy(r->bounce, buffer, n * SECTOR_SIZE);
+			if (!r->disc->writeSectors(lba, n, r->bounce)) {
+				return false;
+			}
+		}
+		lba += n;
+		len -= n;
+		buffer += n * SECTOR_SIZE;
+	}
+	return true;
+}
+
+static bool map_rw(raw_file_t *r, blk_op_t op, sec_t start, sec_t len, u8 *buffer) {
+	while (len > 0) {
+		int i = fatmap_find(r->map, r->map_len, start, r->hint);
+		if (i < 0) {
+			return false;
+		}
+		if ((unsigned)i != r->hint) {
+			++r->stats.splits;
+			r->hint = i;
+		}
+		const fat_extent_t *e = &r->map[i];
+		sec_t n = e->start + e->len - start;
+		if (n > len) {
+			n = len;
+		}
+		if (!disc_rw(r, op, e->lba + start - e->start, n, buffer)) {
+			return false;
+		}
+		start += n;
+		len -= n;
+		buffer += n * SECTOR_SIZE;
+	}
+	return true;
+}
+
+bool raw_file_rw(raw_file_t *r, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	if (start + len < start) {
+		return false;
+	}
+	if (start + len > r->sync.base.sectors) {
+		if (op != BLK_WRITE || !r->growable || r->map != 0 || start > r->sync.base.sectors) {
+			return false;
+		}
+		if (!stdio_rw(r, op, start, len, buffer)) {
+			return false;
+		}
+		r->sync.base.sectors = start + len;
+		return true;
+	}
+	return r->map != 0
+		? map_rw(r, op, start, len, (u8*)buffer)
+		: stdio_rw(r, op, start, len, buffer);
+}
+
+// stdio holds back up to STDIO_BUF_LEN sectors of writes, the cluster map path nothing
+bool raw_file_flush(raw_file_t *r) {
+	return r->f == 0 || r->map != 0 || fflush(r->f) == 0;
+}
+
+static bool file_rw(raw_sync_t *r, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	return raw_file_rw((raw_file_t*)r, op, start, len, buffer);
+}
+
+// libfat's stat gives the first cluster as st_ino
+// the map is only trusted if it reads the same first and last sector stdio does
+static void map_init(raw_file_t *r, u32 size) {
+	struct stat st;
+	if (r->disc == 0 || fstat(fileno(r->f), &st) != 0 || st.st_ino == 0) {
+		return;
+	}
+	int len = fatmap_build(r->disc, (u32)st.st_ino, size, &r->map);
+	if (len < 0) {
+		return;
+	}
+	r->map_len = len;
+	if (r->bounce == 0) {
+		r->bounce = (u8*)memalign(32, SECTOR_SIZE * BOUNCE_LEN);
+	}
+	u8 *check = (u8*)memalign(32, SECTOR_SIZE * 2);
+	bool ok = r->bounce != 0 && check != 0;
+	sec_t probe[2] = { 0, r->sync.base.sectors - 1 };
+	for (unsigned i = 0; ok && i < 2; ++i) {
+		ok = stdio_rw(r, BLK_READ, probe[i], 1, check)
+			&& map_rw(r, BLK_READ, probe[i], 1, check + SECTOR_SIZE)
+			&& memcmp(check, check + SECTOR_SIZE, SECTOR_SIZE) == 0;
+	}
+	free(check);
+	if (!ok) {
+		prt("cluster map mismatch, using stdio\n");
+		free(r->map);
+		r->map = 0;
+		r->map_len = 0;
+		return;
+	}
+	r->stats.extents = len;
+	// the disc driver works behind the cache, same as nandio's
+	r->sync.base.is_direct = blk_line_is_direct;
+}
+
+bool raw_file_init(raw_file_t *r, FILE *f, const DISC_INTERFACE *disc) {
+	raw_sync_init(&r->sync, file_rw, blk_word_is_direct);
+	r->f = f;
+	r->pos = POS_UNKNOWN;
+	r->last_op = BLK_READ;
+	r->disc = disc;
+	r->map = 0;
+	r->map_len = 0;
+	r->hint = 0;
+	r->growable = false;
+	memset(&r->stats, 0, sizeof(r->stats));
+	if (f == 0) {
+		return false;
+	}
+	// not fatal, stdio just goes with its own
+	if (r->stdio_buf == 0) {
+		r->stdio_buf = (u8*)memalign(32, SECTOR_SIZE * STDIO_BUF_LEN);
+	}
+	if (r->stdio_buf != 0) {
+		setvbuf(f, (char*)r->stdio_buf, _IOFBF, SECTOR_SIZE * STDIO_BUF_LEN);
+	}
+	if (fseek(f, 0, SEEK_END) != 0) {
+		return false;
+	}
+	long size = ftell(f);
+	r->sync.base.sectors = size / SECTOR_SIZE;
+	// an empty one is only good to be grown
+	if (r->sync.base.sectors > 0) {
+		map_init(r, size);
+	}
+	return true;
+}
+
+// after fclose, stdio might still use stdio_buf until then
+void raw_file_free(raw_file_t *r) {
+	free(r->map);
+	r->map = 0;
+	r->map_len = 0;
+	free(r->bounce);
+	r->bounce = 0;
+	free(r->stdio_buf);
+	r->stdio_buf = 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdio.h>
+#include "blkdev.h"
+#include "fatmap.h"
+
+typedef struct {
+	u32 seeks;
+	u32 seeks_skipped;
+	u32 extents; // 0 without a cluster map
+	u32 splits; // transfers crossing into another extent
+} raw_file_stats_t;
+
+// an image file, nand.bin
+// with a cluster map, transfers go straight to the disc, libfat only walked the chain once
+// otherwise through stdio, seeking only when the position isn't where the last transfer left it
+typedef struct {
+	raw_sync_t sync;
+	FILE *f;
+	u8 *stdio_buf;
+	sec_t pos;
+	blk_op_t last_op;
+	const DISC_INTERFACE *disc;
+	fat_extent_t *map;
+	unsigned map_len;
+	unsigned hint;
+	u8 *bounce; // for buffers the disc can't take
+	// writes right at the end extend the file, never with a cluster map
+	bool growable;
+	raw_file_stats_t stats;
+} raw_file_t;
+
+// before any other I/O on f, the stdio buffer is set up here
+// disc is what the file is on, 0 if that's not known, no cluster map then
+bool raw_file_init(raw_file_t *r, FILE *f, const DISC_INTERFACE *disc);
+
+void raw_file_free(raw_file_t *r);
+
+bool raw_file_rw(raw_file_t *r, blk_op_t op, sec_t start, sec_t len, void *buffer);
+
+bool raw_file_flush(raw_file_t *r);
@@ -0,0 +1,147 @@
+#include <nds.h>
+#include <malloc.h>
+#include <string.h>
+#include "readahead.h"
+
+#define SECTOR_SIZE 512
+#define SLOT_SIZE (SECTOR_SIZE * READAHEAD_SLOT_LEN)
+
+bool readahead_init(readahead_t *ra, raw_t *raw,
+	void (*decrypt)(void*, u8*, const u8*, sec_t, sec_t), void *ctx)
+{
+	// the medium writes the slots behind the CPU's back, so they're whole cache lines
+	ra->data = (u8*)memalign(32, SLOT_SIZE * READAHEAD_SLOTS);
+	if (ra->data == 0) {
+		return false;
+	}
+	ra->first = 0;
+	ra->head = 0;
+	ra->count = 0;
+	ra->window = 0;
+	ra->next = 0;
+	ra->raw = raw;
+	ra->decrypt = decrypt;
+	ra->ctx = ctx;
+	memset(&ra->stats, 0, sizeof(ra->stats));
+	return true;
+}
+
+void readahead_free(readahead_t *ra) {
+	free(ra->data);
+	ra->data = 0;
+}
+
+static inline u8 *slot(const readahead_t *ra, unsigned i) {
+	return ra->data + ((ra->head + i) % READAHEAD_SLOTS) * SLOT_SIZE;
+}
+
+// first sector past what the ring holds
+static inline sec_t tail(const readahead_t *ra) {
+	return ra->first + ra->count * READAHEAD_SLOT_LEN;
+}
+
+// the ring is emptied and the stream ends, the next read has to start a new one
+void readahead_drop(readahead_t *ra) {
+	if (ra->count > 0) {
+		// the head slot is consumed up to next
+		ra->stats.dropped += tail(ra) - (ra->next > ra->first ? ra->next : ra->first);
+	}
+	ra->head = 0;
+	ra->count = 0;
+	ra->window = 0;
+}
+
+// the medium changed under the ring
+void readahead_invalidate(readahead_t *ra, sec_t start, sec_t len) {
+	if (ra->count > 0 && start < tail(ra) && start + len > ra->first) {
+		readahead_drop(ra);
+	}
+}
+
+// one slot past the tail, if there's room, it's wanted and the medium has it
+static bool fill_start(readahead_t *ra, sec_t target) {
+	return ra->count < READAHEAD_SLOTS
+		&& tail(ra) < target
+		&& tail(ra) + READAHEAD_SLOT_LEN <= ra->raw->sectors
+		&& ra->raw->start(ra->raw, BLK_READ, tail(ra), READAHEAD_SLOT_LEN, slot(ra, ra->count));
+}
+
+// reads which don't continue the last one go to read, decrypted, as they used to
+// from the second one in a row, they go through the ring
+bool readahead_read(readahead_t *ra, sec_t start, sec_t len, void *buffer,
+	bool (*read)(void*, sec_t, sec_t, void*))
+{
+	if (start != ra->next) {
+		readahead_drop(ra);
+		ra->next = start + len;
+		return read(ra->ctx, start, len, buffer);
+	}
+	if (ra->window == 0) {
+		// as much ahead as the caller asks for at a time
+		ra->window = (len + READAHEAD_SLOT_LEN - 1) / READAHEAD_SLOT_LEN;
+		if (ra->window > READAHEAD_SLOTS - 1) {
+			ra->window = READAHEAD_SLOTS - 1;
+		}
+		++ra->stats.streams;
+	}
+	ra->next = start + len;
+	if (ra->count == 0) {
+		ra->first = start;
+	}
+	sec_t target = start + len + ra->window * READAHEAD_SLOT_LEN;
+	bool missed = false;
+	u8 *out = (u8*)buffer;
+	while (len > 0) {
+		bool waited = false;
+		if (ra->count == 0) {
+			// ran dry, the medium has to be waited for
+			if (!fill_start(ra, target)) {
+				break;
+			}
+			if (!ra->raw->wait(ra->raw)) {
+				readahead_drop(ra);
+				return false;
+			}
+			ra->count = 1;
+			ra->stats.prefetched += READAHEAD_SLOT_LEN;
+			waited = true;
+			missed = true;
+		}
+		sec_t off = start - ra->first;
+		sec_t n = len < READAHEAD_SLOT_LEN - off ? len : READAHEAD_SLOT_LEN - off;
+		// the medium works on the next slot while AES works on this one
+		bool pending = fill_start(ra, target);
+		ra->decrypt(ra->ctx, out, slot(ra, 0) + off * SECTOR_SIZE, start, n);
+		// a failed read ahead is not the caller's problem, the slot just stays empty
+		if (pending && ra->raw->wait(ra->raw)) {
+			++ra->count;
+			ra->stats.prefetched += READAHEAD_SLOT_LEN;
+		}
+		if (waited) {
+			ra->stats.misses += n;
+		} else {
+			ra->stats.hits += n;
+		}
+		start += n;
+		len -= n;
+		out += n * SECTOR_SIZE;
+		if (off + n == READAHEAD_SLOT_LEN) {
+			ra->head = (ra->head + 1) % READAHEAD_SLOTS;
+			--ra->count;
+			ra->first += READAHEAD_SLOT_LEN;
+		}
+	}
+	if (len > 0) {
+		// the end of the medium, not worth a slot
+		readahead_drop(ra);
+		return read(ra->ctx, start, len, out);
+	}
+	// the caller caught up with the ring, keep further ahead
+	if (missed && ra->window < READAHEAD_SLOTS - 1) {
+		ra->window *= 2;
+		if (ra->window > READAHEAD_SLOTS - 1) {
+			ra->window = READAHEAD_SLOTS - 1;
+		}
+	}
+	return true;
+}
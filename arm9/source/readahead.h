@@ -0,0 +1,46 @@
+#pragma once
+
+#include <nds.h>
+#include <nds/disc_io.h>
+#include "blkdev.h"
+
+// sequential read-ahead, part of the crypto layer
+// libfat reads a file run by run, once that turns out to be a stream, the next window is read
+// into a ring of raw slots, the medium fills one slot while AES decrypts the one before it
+// 4 slots * 64 sectors = 128KB
+#define READAHEAD_SLOTS 4
+#define READAHEAD_SLOT_LEN 64
+
+typedef struct {
+	u32 streams;
+	u32 hits; // sectors a stream found in the ring
+	u32 misses; // sectors a stream had to wait for
+	u32 prefetched; // sectors read into the ring
+	u32 dropped; // sectors in the ring nobody asked for
+} readahead_stats_t;
+
+typedef struct {
+	u8 *data;
+	sec_t first; // sector at the start of the head slot
+	unsigned head;
+	unsigned count; // filled slots, contiguous from first
+	unsigned window; // slots kept ahead of the caller, 0 while there's no stream
+	sec_t next; // where a stream would continue
+	raw_t *raw;
+	// raw to plain, ctx, out, in, start, len
+	void (*decrypt)(void*, u8*, const u8*, sec_t, sec_t);
+	void *ctx;
+	readahead_stats_t stats;
+} readahead_t;
+
+bool readahead_init(readahead_t *ra, raw_t *raw,
+	void (*decrypt)(void*, u8*, const u8*, sec_t, sec_t), void *ctx);
+
+void readahead_free(readahead_t *ra);
+
+void readahead_drop(readahead_t *ra);
+
+void readahead_invalidate(readahead_t *ra, sec_t start, sec_t len);
+
+bool readahead_read(readahead_t *ra, sec_t start, sec_t len, void *buffer,
+	bool (*read)(void*, sec_t, sec_t, void*));
@@ -2,17 +2,22 @@
 #include <nds.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include "heap.h"
 #include "../term256/term256ext.h"
 #include "utils.h"
+#include "crypto.h"
 #include "stage2.h"
+#include "nand.h"
 #include "scripting.h"
 
 extern const char nand_root[];
 
+extern dsi_crypt_ctx_t crypt_ctx;
+
 #define FILE_BUF_LEN (128 << 10)
 static u8* file_buf = 0;
 
@@ -82,7 +87,10 @@ static const char * const cmd_strs[] = {
 	"dir_exist",
 	"rm",
 	"dump_stage2_arm9",
-	"dump_stage2_arm7"
+	"dump_stage2_arm7",
+	"sha1_sectors",
+	"es_decrypt",
+	"es_encrypt"
 };
 
 enum {
@@ -90,7 +98,10 @@ enum {
 	CMD_DIR_EXIST,
 	CMD_RM,
 	CMD_DUMP_STAGE2_ARM9,
-	CMD_DUMP_STAGE2_ARM7
+	CMD_DUMP_STAGE2_ARM7,
+	CMD_SHA1_SECTORS,
+	CMD_ES_DECRYPT,
+	CMD_ES_ENCRYPT
 };
 
 // check commands runs in dry run
@@ -99,6 +110,9 @@ int cmd_is_chk[] = {
 	1,
 	0,
 	0,
+	0,
+	0,
+	0,
 	0
 };
 
@@ -210,6 +224,63 @@ static void cmd_rm(const char * arg) {
 	return;
 }
 
+// sha1_sectors <start> <count>, SHA1 of decrypted sectors of nand.bin, not the eMMC,
+// hashed as they're decrypted
+static int cmd_sha1_sectors(const char *arg) {
+	char *end;
+	unsigned long start = strtoul(arg, &end, 0);
+	unsigned long count = strtoul(end, &end, 0);
+	if (count == 0) {
+		prt("sha1_sectors: <start> <count>, sectors of nand.bin\n");
+		return ERR_CMD_FAIL;
+	}
+	iprtf("SHA1 of nand.bin sectors %lu+%lu\n", start, count);
+	unsigned char digest[SHA1_LEN];
+	if (sha1_sectors(digest, start, count) != 0) {
+		return ERR_CMD_FAIL;
+	}
+	print_bytes(digest, SHA1_LEN);
+	prt("\n");
+	return NO_ERR;
+}
+
+// es_decrypt/es_encrypt <from> <to>, an ES block with its footer, file to file through file_buf
+// for blocks too large to load as a whole, the names can't have spaces in them
+static int cmd_es_crypt(const char *arg, crypt_mode_t mode) {
+	const char *to = arg;
+	while (*to && !is_whitespace(*to)) {
+		++to;
+	}
+	unsigned len_from = to - arg;
+	to = ltrim(to);
+	int len_root = strlen(nand_root);
+	if (len_from == 0 || *to == 0) {
+		prt("es crypt: <from> <to>\n");
+		return ERR_CMD_FAIL;
+	}
+	if (len_root + len_from + 1 > BUF_SIZE || len_root + strlen(to) + 1 > BUF_SIZE) {
+		iprtf("es crypt: name too long: %s\n", arg);
+		return ERR_CMD_FAIL;
+	}
+	char *from_buf = alloc_buf();
+	char *to_buf = alloc_buf();
+	strcpy(from_buf, nand_root);
+	strncpy(from_buf + len_root, arg, len_from);
+	from_buf[len_root + len_from] = 0;
+	strcpy(to_buf, nand_root);
+	strcpy(to_buf + len_root, to);
+	convert_backslash(from_buf);
+	convert_backslash(to_buf);
+	iprtf("%s %s\n", mode == DECRYPT ? "ES decrypt" : "ES encrypt", from_buf + len_root);
+	int r = es_crypt_file(from_buf, to_buf, mode);
+	if (r != 0) {
+		iprtf("failed(%d): %s\n", r, to_buf + len_root);
+	}
+	free_buf(from_buf);
+	free_buf(to_buf);
+	return r == 0 ? NO_ERR : ERR_CMD_FAIL;
+}
+
 /*
 rmdir() returns errno 88(ENOSYS, function not implemented)
 then I found out unlink works on directory, and remove works too
@@ -259,6 +330,12 @@ static int execute_cmd(const char * line, unsigned len, int dry_run) {
 		case CMD_DUMP_STAGE2_ARM7:
 			dump_stage2(STAGE2_ARM7, arg);
 			return NO_ERR;
+		case CMD_SHA1_SECTORS:
+			return cmd_sha1_sectors(arg);
+		case CMD_ES_DECRYPT:
+			return cmd_es_crypt(arg, DECRYPT);
+		case CMD_ES_ENCRYPT:
+			return cmd_es_crypt(arg, ENCRYPT);
 		}
 	}
 	return NO_ERR;
@@ -383,6 +460,66 @@ int cp(const char *from, const char *to) {
 	return ret;
 }
 
+// ES block crypt file to file through file_buf, for blocks too large to load as a whole
+// the input is the block with its footer, so is the output
+// MAC is verified at the end on DECRYPT, the output is removed if that fails
+int es_crypt_file(const char *from, const char *to, crypt_mode_t mode) {
+	FILE *f = fopen(from, "rb");
+	if (f == 0) {
+		return -1;
+	}
+	es_block_footer_t footer;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	if (size < (long)sizeof(footer)
+		|| fseek(f, size - sizeof(footer), SEEK_SET) != 0
+		|| fread(&footer, 1, sizeof(footer), f) != sizeof(footer))
+	{
+		fclose(f);
+		return -1;
+	}
+	dsi_es_ctx_t ctx;
+	int block_size = dsi_es_block_crypt_init(&crypt_ctx, &ctx, &footer, mode);
+	if (block_size < 0 || block_size + sizeof(footer) != size) {
+		fclose(f);
+		return -1;
+	}
+	FILE *t = fopen(to, "wb");
+	if (t == 0) {
+		fclose(f);
+		return -2;
+	}
+	fseek(f, 0, SEEK_SET);
+	int ret = 0;
+	unsigned remaining = block_size;
+	while (remaining > 0) {
+		size_t len = remaining < FILE_BUF_LEN ? remaining : FILE_BUF_LEN;
+		if (fread(file_buf, 1, len, f) != len) {
+			ret = -1;
+			break;
+		}
+		dsi_es_block_crypt_update(&ctx, file_buf, file_buf, len);
+		if (fwrite(file_buf, 1, len, t) != len) {
+			ret = -3;
+			break;
+		}
+		remaining -= len;
+	}
+	if (ret == 0) {
+		if (dsi_es_block_crypt_final(&ctx, &footer) != 0) {
+			ret = -4;
+		} else if (fwrite(&footer, 1, sizeof(footer), t) != sizeof(footer)) {
+			ret = -3;
+		}
+	}
+	fclose(f);
+	fclose(t);
+	if (ret != 0) {
+		remove(to);
+	}
+	return ret;
+}
+
 // this is evolved from parse_sha1sum so the structure is a bit strange
 int scripting(const char *scriptname, int dry_run, unsigned *p_size){
 	FILE *f = fopen(scriptname, "r");
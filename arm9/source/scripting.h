@@ -1,11 +1,15 @@
 #pragma once
 
+#include "crypto.h"
+
 #define SHA1_LEN 20
 
 int sha1_file(void *digest, const char *name);
 
 int cp(const char *from, const char *to);
 
+int es_crypt_file(const char *from, const char *to, crypt_mode_t mode);
+
 int scripting_init();
 
 int scripting(const char *filename, int dry_run, unsigned *p_size);
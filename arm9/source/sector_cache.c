@@ -0,0 +1,255 @@
+
+#include <nds.h>
+#include <malloc.h>
+#include <string.h>
+#include "sector_cache.h"
+
+#define SECTOR_SIZE 512
+#define INVALID_SECTOR ((sec_t)-1)
+
+bool sector_cache_init(sector_cache_t *c, unsigned sets, unsigned ways) {
+	// sets must be a power of 2
+	if (sets == 0 || (sets & (sets - 1)) != 0 || ways == 0) {
+		return false;
+	}
+	c->sets = sets;
+	c->ways = ways;
+	c->tags = (sec_t*)malloc(sizeof(sec_t) * sets * ways);
+	c->stamps = (u32*)malloc(sizeof(u32) * sets * ways);
+	c->dirty = (u8*)malloc(sets * ways);
+	c->data = (u8*)memalign(32, SECTOR_SIZE * sets * ways);
+	c->run_buf = 0;
+	c->run_max = 0;
+	c->lower = 0;
+	if (c->tags == 0 || c->stamps == 0 || c->dirty == 0 || c->data == 0) {
+		sector_cache_free(c);
+		return false;
+	}
+	sector_cache_invalidate(c);
+	memset(&c->stats, 0, sizeof(c->stats));
+	return true;
+}
+
+// without a writer, everything is write through
+void sector_cache_set_writer(sector_cache_t *c, void *run_buf, sec_t run_max, blk_t *lower) {
+	c->run_buf = (u8*)run_buf;
+	c->run_max = run_max;
+	c->lower = lower;
+}
+
+void sector_cache_free(sector_cache_t *c) {
+	free(c->tags);
+	free(c->stamps);
+	free(c->dirty);
+	free(c->data);
+	c->tags = 0;
+	c->stamps = 0;
+	c->dirty = 0;
+	c->data = 0;
+}
+
+// dirty lines are lost, flush first if they matter
+// the stats run on, they count for the whole session, not since the last invalidate
+void sector_cache_invalidate(sector_cache_t *c) {
+	for (unsigned i = 0; i < c->sets * c->ways; ++i) {
+		c->tags[i] = INVALID_SECTOR;
+		c->stamps[i] = 0;
+		c->dirty[i] = 0;
+	}
+	c->clock = 0;
+	c->dirty_count = 0;
+}
+
+// returns line index or -1
+static int find(const sector_cache_t *c, sec_t sector) {
+	unsigned base = (sector & (c->sets - 1)) * c->ways;
+	for (unsigned i = base; i < base + c->ways; ++i) {
+		if (c->tags[i] == sector) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// least recently used of the set, empty lines have stamp 0 so they go first
+static int victim(const sector_cache_t *c, sec_t sector) {
+	unsigned base = (sector & (c->sets - 1)) * c->ways;
+	unsigned i = base;
+	for (unsigned j = base + 1; j < base + c->ways; ++j) {
+		if (c->stamps[j] < c->stamps[i]) {
+			i = j;
+		}
+	}
+	return i;
+}
+
+static void clean(sector_cache_t *c, int i) {
+	if (c->dirty[i]) {
+		c->dirty[i] = 0;
+		--c->dirty_count;
+	}
+}
+
+// forget sectors whose state on the medium is unknown, after a failed write
+void sector_cache_drop(sector_cache_t *c, sec_t start, sec_t len) {
+	for (sec_t s = 0; s < len; ++s) {
+		int i = find(c, start + s);
+		if (i >= 0) {
+			clean(c, i);
+			c->tags[i] = INVALID_SECTOR;
+			c->stamps[i] = 0;
+		}
+	}
+}
+
+bool sector_cache_lookup(sector_cache_t *c, sec_t sector, void *buffer) {
+	int i = find(c, sector);
+	if (i < 0) {
+		++c->stats.misses;
+		return false;
+	}
+	++c->stats.hits;
+	c->stamps[i] = ++c->clock;
+	memcpy(buffer, c->data + i * SECTOR_SIZE, SECTOR_SIZE);
+	return true;
+}
+
+// returns a line for sector, a dirty victim makes everything flush first
+static int alloc_line(sector_cache_t *c, sec_t sector) {
+	int i = find(c, sector);
+	if (i < 0) {
+		i = victim(c, sector);
+		if (c->dirty[i] && !sector_cache_flush(c)) {
+			return -1;
+		}
+		c->tags[i] = sector;
+	}
+	c->stamps[i] = ++c->clock;
+	return i;
+}
+
+bool sector_cache_fill(sector_cache_t *c, sec_t sector, const void *buffer) {
+	int i = alloc_line(c, sector);
+	if (i < 0) {
+		return false;
+	}
+	memcpy(c->data + i * SECTOR_SIZE, buffer, SECTOR_SIZE);
+	return true;
+}
+
+// write through, lines already in the cache get the new data, nothing new is allocated
+// the caller writes the medium, so they are clean after this
+void sector_cache_write(sector_cache_t *c, sec_t start, sec_t len, const void *buffer) {
+	for (sec_t s = 0; s < len; ++s) {
+		int i = find(c, start + s);
+		if (i >= 0) {
+			memcpy(c->data + i * SECTOR_SIZE, (const u8*)buffer + s * SECTOR_SIZE, SECTOR_SIZE);
+			clean(c, i);
+		}
+	}
+}
+
+// write back, the medium only sees it at the next flush
+// repeated writes to the same FAT or directory sector cost nothing until then
+bool sector_cache_write_back(sector_cache_t *c, sec_t start, sec_t len, const void *buffer) {
+	for (sec_t s = 0; s < len; ++s) {
+		int i = alloc_line(c, start + s);
+		if (i < 0) {
+			return false;
+		}
+		memcpy(c->data + i * SECTOR_SIZE, (const u8*)buffer + s * SECTOR_SIZE, SECTOR_SIZE);
+		if (!c->dirty[i]) {
+			// order only has room for SECTOR_CACHE_DIRTY_MAX
+			if (c->dirty_count >= SECTOR_CACHE_DIRTY_MAX && !sector_cache_flush(c)) {
+				return false;
+			}
+			c->dirty[i] = 1;
+			++c->dirty_count;
+		}
+	}
+	c->stats.writes += len;
+	if (c->dirty_count >= SECTOR_CACHE_DIRTY_MAX) {
+		return sector_cache_flush(c);
+	}
+	return true;
+}
+
+// dirty lines go out sorted by sector, adjacent ones merged into one write
+bool sector_cache_flush(sector_cache_t *c) {
+	if (c->dirty_count == 0) {
+		return true;
+	}
+	unsigned n = 0;
+	for (unsigned i = 0; i < c->sets * c->ways; ++i) {
+		if (!c->dirty[i]) {
+			continue;
+		}
+		// insertion sort, there are at most SECTOR_CACHE_DIRTY_MAX of them
+		unsigned j = n++;
+		for (; j > 0 && c->tags[c->order[j - 1]] > c->tags[i]; --j) {
+			c->order[j] = c->order[j - 1];
+		}
+		c->order[j] = i;
+	}
+	unsigned k = 0;
+	while (k < n) {
+		unsigned first = k;
+		sec_t start = c->tags[c->order[k]];
+		sec_t len = 0;
+		while (k < n && len < c->run_max && c->tags[c->order[k]] == start + len) {
+			memcpy(c->run_buf + len * SECTOR_SIZE, c->data + c->order[k] * SECTOR_SIZE, SECTOR_SIZE);
+			++len;
+			++k;
+		}
+		if (!c->lower->write(c->lower, start, len, c->run_buf)) {
+			return false;
+		}
+		for (; first < k; ++first) {
+			clean(c, c->order[first]);
+		}
+		++c->stats.runs;
+		c->stats.run_sectors += len;
+	}
+	return true;
+}
+
+// misses are read in runs from lower, which delivers decrypted sectors
+bool sector_cache_read(sector_cache_t *c, sec_t start, sec_t len, void *buffer, blk_t *lower) {
+	u8 *out = (u8*)buffer;
+	if (len > SECTOR_CACHE_MAX_RUN) {
+		if (!lower->read(lower, start, len, buffer)) {
+			return false;
+		}
+		// the medium is only stale for dirty lines
+		if (c->dirty_count != 0) {
+			for (sec_t s = 0; s < len; ++s) {
+				int i = find(c, start + s);
+				if (i >= 0 && c->dirty[i]) {
+					memcpy(out + s * SECTOR_SIZE, c->data + i * SECTOR_SIZE, SECTOR_SIZE);
+				}
+			}
+		}
+		return true;
+	}
+	sec_t i = 0;
+	while (i < len) {
+		if (sector_cache_lookup(c, start + i, out + i * SECTOR_SIZE)) {
+			++i;
+			continue;
+		}
+		sec_t j = i + 1;
+		while (j < len && find(c, start + j) < 0) {
+			++j;
+		}
+		c->stats.misses += j - i - 1;
+		if (!lower->read(lower, start + i, j - i, out + i * SECTOR_SIZE)) {
+			return false;
+		}
+		for (; i < j; ++i) {
+			if (!sector_cache_fill(c, start + i, out + i * SECTOR_SIZE)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
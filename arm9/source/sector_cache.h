@@ -0,0 +1,62 @@
+#pragma once
+
+#include <nds.h>
+#include <nds/disc_io.h>
+#include "blkdev.h"
+
+// set associative cache of decrypted sectors, the cache layer of the block device stack
+// libfat keeps coming back to the same FAT and directory sectors, this saves the medium access and AES for them
+// 64 sets * 4 ways = 256 sectors, 128KB, sets must be a power of 2
+#define SECTOR_CACHE_SETS 64
+#define SECTOR_CACHE_WAYS 4
+// reads/writes longer than this are file data, they bypass the cache so they don't push metadata out
+#define SECTOR_CACHE_MAX_RUN 8
+// small writes are held back until this many sectors are dirty, or a flush
+#define SECTOR_CACHE_DIRTY_MAX 64
+
+typedef struct {
+	u32 hits;
+	u32 misses;
+	u32 writes; // sectors written by the caller in small writes
+	u32 runs; // write commands those turned into
+	u32 run_sectors;
+} sector_cache_stats_t;
+
+typedef struct {
+	sec_t *tags;
+	u32 *stamps; // LRU, last access
+	u8 *dirty;
+	u8 *data;
+	unsigned sets;
+	unsigned ways;
+	u32 clock;
+	unsigned dirty_count;
+	// dirty runs are gathered in run_buf and written to lower
+	u8 *run_buf;
+	sec_t run_max;
+	blk_t *lower;
+	u16 order[SECTOR_CACHE_DIRTY_MAX];
+	sector_cache_stats_t stats;
+} sector_cache_t;
+
+bool sector_cache_init(sector_cache_t *c, unsigned sets, unsigned ways);
+
+void sector_cache_set_writer(sector_cache_t *c, void *run_buf, sec_t run_max, blk_t *lower);
+
+void sector_cache_free(sector_cache_t *c);
+
+void sector_cache_invalidate(sector_cache_t *c);
+
+void sector_cache_drop(sector_cache_t *c, sec_t start, sec_t len);
+
+bool sector_cache_lookup(sector_cache_t *c, sec_t sector, void *buffer);
+
+bool sector_cache_fill(sector_cache_t *c, sec_t sector, const void *buffer);
+
+void sector_cache_write(sector_cache_t *c, sec_t start, sec_t len, const void *buffer);
+
+bool sector_cache_write_back(sector_cache_t *c, sec_t start, sec_t len, const void *buffer);
+
+bool sector_cache_flush(sector_cache_t *c);
+
+bool sector_cache_read(sector_cache_t *c, sec_t start, sec_t len, void *buffer, blk_t *lower);
@@ -0,0 +1,279 @@
+#include <nds.h>
+#include <malloc.h>
+#include <string.h>
+#include "../term256/term256ext.h"
+#include "sparse.h"
+
+#define SECTOR_SIZE 512
+
+static inline sec_t block_sectors(const raw_sparse_t *s, u32 b) {
+	sec_t left = s->h.sectors - b * SPARSE_BLOCK_LEN;
+	return left < SPARSE_BLOCK_LEN ? left : SPARSE_BLOCK_LEN;
+}
+
+static inline sec_t slot_sector(const raw_sparse_t *s, u32 slot) {
+	return s->h.data_sector + slot * SPARSE_BLOCK_LEN;
+}
+
+static inline void set_dirty(raw_sparse_t *s, u32 b) {
+	s->dirty[b >> 3] |= 1 << (b & 7);
+}
+
+static inline bool is_dirty(const raw_sparse_t *s, u32 b) {
+	return s->dirty[b >> 3] & (1 << (b & 7));
+}
+
+static bool is_zero(const u8 *p, u32 len) {
+	const u32 *w = (const u32*)p;
+	for (u32 i = 0; i < len / sizeof(u32); ++i) {
+		if (w[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// what an implicit block reads as, len sectors from sector off of block b, into block_buf
+static void fill_implicit(raw_sparse_t *s, u32 loc, u32 b, sec_t off, sec_t len) {
+	memset(s->block_buf, 0, len * SECTOR_SIZE);
+	if (loc == SPARSE_ZERO_PLAIN) {
+		sec_t sector = b * SPARSE_BLOCK_LEN + off;
+		dsi_nand_crypt(s->ctx, s->block_buf, s->block_buf,
+			sector * SECTOR_SIZE / AES_BLOCK_SIZE, len * SECTOR_SIZE / AES_BLOCK_SIZE);
+	}
+}
+
+static void hash_implicit(raw_sparse_t *s, u32 b) {
+	sec_t n = block_sectors(s, b);
+	fill_implicit(s, s->map[b].loc, b, 0, n);
+	swiSHA1Calc(s->map[b].sha1, s->block_buf, n * SECTOR_SIZE);
+}
+
+// slots are appended, always whole blocks so the next one starts right at the end of the container
+static bool store_block(raw_sparse_t *s, u32 b, const u8 *data) {
+	u32 slot = s->h.slots;
+	if (!raw_file_rw(s->file, BLK_WRITE, slot_sector(s, slot), SPARSE_BLOCK_LEN, (void*)data)) {
+		return false;
+	}
+	++s->h.slots;
+	s->map[b].loc = slot;
+	s->map_dirty = true;
+	set_dirty(s, b);
+	return true;
+}
+
+static bool write_piece(raw_sparse_t *s, u32 b, sec_t off, sec_t n, const u8 *data) {
+	u32 loc = s->map[b].loc;
+	if (loc < SPARSE_ZERO_PLAIN) {
+		set_dirty(s, b);
+		return raw_file_rw(s->file, BLK_WRITE, slot_sector(s, loc) + off, n, (void*)data);
+	}
+	if (off == 0 && n == SPARSE_BLOCK_LEN) {
+		// still what it implies, nothing to store
+		if (loc == SPARSE_ZERO_RAW && is_zero(data, n * SECTOR_SIZE)) {
+			return true;
+		}
+		if (loc == SPARSE_ZERO_PLAIN) {
+			fill_implicit(s, loc, b, 0, n);
+			if (memcmp(s->block_buf, data, n * SECTOR_SIZE) == 0) {
+				return true;
+			}
+		}
+		return store_block(s, b, data);
+	}
+	// partly written, the rest of it comes from what it implied, past the end of the image is zero
+	fill_implicit(s, loc, b, 0, block_sectors(s, b));
+	memset(s->block_buf + block_sectors(s, b) * SECTOR_SIZE, 0,
+		(SPARSE_BLOCK_LEN - block_sectors(s, b)) * SECTOR_SIZE);
+	memcpy(s->block_buf + off * SECTOR_SIZE, data, n * SECTOR_SIZE);
+	return store_block(s, b, s->block_buf);
+}
+
+static bool read_piece(raw_sparse_t *s, u32 b, sec_t off, sec_t n, u8 *data) {
+	u32 loc = s->map[b].loc;
+	if (loc < SPARSE_ZERO_PLAIN) {
+		return raw_file_rw(s->file, BLK_READ, slot_sector(s, loc) + off, n, data);
+	}
+	if (loc == SPARSE_ZERO_RAW) {
+		memset(data, 0, n * SECTOR_SIZE);
+	} else {
+		fill_implicit(s, loc, b, off, n);
+		memcpy(data, s->block_buf, n * SECTOR_SIZE);
+	}
+	return true;
+}
+
+bool raw_sparse_rw(raw_sparse_t *s, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	if (start + len > s->h.sectors || start + len < start) {
+		return false;
+	}
+	u8 *p = (u8*)buffer;
+	while (len > 0) {
+		u32 b = start / SPARSE_BLOCK_LEN;
+		sec_t off = start % SPARSE_BLOCK_LEN;
+		sec_t n = SPARSE_BLOCK_LEN - off < len ? SPARSE_BLOCK_LEN - off : len;
+		bool ok = op == BLK_READ
+			? read_piece(s, b, off, n, p)
+			: write_piece(s, b, off, n, p);
+		if (!ok) {
+			return false;
+		}
+		start += n;
+		len -= n;
+		p += n * SECTOR_SIZE;
+	}
+	return true;
+}
+
+bool raw_sparse_set_implicit(raw_sparse_t *s, u32 block, u32 loc) {
+	if (block >= s->h.blocks || (loc == SPARSE_ZERO_PLAIN && s->ctx == 0)) {
+		return false;
+	}
+	s->map[block].loc = loc;
+	s->dirty[block >> 3] &= ~(1 << (block & 7));
+	s->map_dirty = true;
+	hash_implicit(s, block);
+	return true;
+}
+
+bool raw_sparse_flush(raw_sparse_t *s) {
+	for (u32 b = 0; b < s->h.blocks; ++b) {
+		if (!is_dirty(s, b)) {
+			continue;
+		}
+		sec_t n = block_sectors(s, b);
+		if (!raw_file_rw(s->file, BLK_READ, slot_sector(s, s->map[b].loc), n, s->block_buf)) {
+			return false;
+		}
+		swiSHA1Calc(s->map[b].sha1, s->block_buf, n * SECTOR_SIZE);
+		s->dirty[b >> 3] &= ~(1 << (b & 7));
+		s->map_dirty = true;
+	}
+	if (s->map_dirty) {
+		memset(s->block_buf, 0, SECTOR_SIZE);
+		memcpy(s->block_buf, &s->h, sizeof(s->h));
+		if (!raw_file_rw(s->file, BLK_WRITE, 0, 1, s->block_buf)
+			|| !raw_file_rw(s->file, BLK_WRITE, s->h.map_sector, s->map_sectors, s->map))
+		{
+			return false;
+		}
+		s->map_dirty = false;
+	}
+	return raw_file_flush(s->file);
+}
+
+static bool sparse_rw(raw_sync_t *r, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	return raw_sparse_rw((raw_sparse_t*)r, op, start, len, buffer);
+}
+
+static bool sparse_alloc(raw_sparse_t *s) {
+	s->map_sectors = (s->h.blocks * sizeof(sparse_entry_t) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	s->map = (sparse_entry_t*)memalign(32, s->map_sectors * SECTOR_SIZE);
+	s->dirty = (u8*)malloc((s->h.blocks + 7) / 8);
+	s->block_buf = (u8*)memalign(32, SPARSE_BLOCK_LEN * SECTOR_SIZE);
+	if (s->map == 0 || s->dirty == 0 || s->block_buf == 0) {
+		raw_sparse_free(s);
+		return false;
+	}
+	memset(s->map, 0, s->map_sectors * SECTOR_SIZE);
+	memset(s->dirty, 0, (s->h.blocks + 7) / 8);
+	return true;
+}
+
+static void sparse_base(raw_sparse_t *s, raw_file_t *file, const dsi_crypt_ctx_t *ctx) {
+	raw_sync_init(&s->sync, sparse_rw, file->sync.base.is_direct);
+	s->file = file;
+	s->ctx = ctx;
+	s->map = 0;
+	s->dirty = 0;
+	s->block_buf = 0;
+	s->map_dirty = false;
+}
+
+static void key_check(const dsi_crypt_ctx_t *ctx, u8 *out) {
+	u32 zero[AES_BLOCK_SIZE / sizeof(u32)] = { 0 };
+	u32 ks[AES_BLOCK_SIZE / sizeof(u32)];
+	dsi_nand_crypt(ctx, (u8*)ks, (u8*)zero, 0, 1);
+	memcpy(out, ks, AES_BLOCK_SIZE);
+}
+
+bool raw_sparse_open(raw_sparse_t *s, raw_file_t *file, const dsi_crypt_ctx_t *ctx) {
+	sparse_base(s, file, ctx);
+	u32 sector[SECTOR_SIZE / sizeof(u32)];
+	if (!raw_file_rw(file, BLK_READ, 0, 1, sector)) {
+		return false;
+	}
+	memcpy(&s->h, sector, sizeof(s->h));
+	if (s->h.magic != SPARSE_MAGIC || s->h.version != SPARSE_VERSION || s->h.block_len != SPARSE_BLOCK_LEN
+		|| s->h.blocks != (s->h.sectors + SPARSE_BLOCK_LEN - 1) / SPARSE_BLOCK_LEN)
+	{
+		prt("not a sparse image\n");
+		return false;
+	}
+	if (!sparse_alloc(s)) {
+		prt("failed to alloc sparse map\n");
+		return false;
+	}
+	if (!raw_file_rw(file, BLK_READ, s->h.map_sector, s->map_sectors, s->map)) {
+		raw_sparse_free(s);
+		return false;
+	}
+	u8 check[AES_BLOCK_SIZE];
+	if (ctx != 0) {
+		key_check(ctx, check);
+	}
+	for (u32 b = 0; b < s->h.blocks; ++b) {
+		u32 loc = s->map[b].loc;
+		if (loc == SPARSE_ZERO_PLAIN && (ctx == 0 || memcmp(check, s->h.key_check, AES_BLOCK_SIZE) != 0)) {
+			prt("sparse image is from another console\n");
+			raw_sparse_free(s);
+			return false;
+		}
+		if (loc < SPARSE_ZERO_PLAIN && loc >= s->h.slots) {
+			prt("sparse map corrupted\n");
+			raw_sparse_free(s);
+			return false;
+		}
+	}
+	s->sync.base.sectors = s->h.sectors;
+	return true;
+}
+
+bool raw_sparse_create(raw_sparse_t *s, raw_file_t *file, sec_t sectors, const dsi_crypt_ctx_t *ctx) {
+	sparse_base(s, file, ctx);
+	memset(&s->h, 0, sizeof(s->h));
+	s->h.magic = SPARSE_MAGIC;
+	s->h.version = SPARSE_VERSION;
+	s->h.block_len = SPARSE_BLOCK_LEN;
+	s->h.sectors = sectors;
+	s->h.blocks = (sectors + SPARSE_BLOCK_LEN - 1) / SPARSE_BLOCK_LEN;
+	if (s->h.blocks == 0 || !sparse_alloc(s)) {
+		return false;
+	}
+	s->h.map_sector = 1;
+	s->h.data_sector = 1 + s->map_sectors;
+	s->h.slots = 0;
+	if (ctx != 0) {
+		key_check(ctx, s->h.key_check);
+	}
+	for (u32 b = 0; b < s->h.blocks; ++b) {
+		s->map[b].loc = SPARSE_ZERO_RAW;
+		if (b == 0 || block_sectors(s, b) != SPARSE_BLOCK_LEN) {
+			hash_implicit(s, b);
+		} else {
+			memcpy(s->map[b].sha1, s->map[0].sha1, SHA1_LEN);
+		}
+	}
+	s->sync.base.sectors = sectors;
+	s->map_dirty = true;
+	return raw_sparse_flush(s);
+}
+
+void raw_sparse_free(raw_sparse_t *s) {
+	free(s->map);
+	s->map = 0;
+	free(s->dirty);
+	s->dirty = 0;
+	free(s->block_buf);
+	s->block_buf = 0;
+}
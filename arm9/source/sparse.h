@@ -0,0 +1,66 @@
+#pragma once
+
+#include <nds.h>
+#include "blkdev.h"
+#include "crypto.h"
+#include "rawfile.h"
+
+// sparse NAND image, nand.sparse
+// the image is cut into blocks, a block is either stored in a slot of the container or implicit:
+// all zero on the medium, or all zero once decrypted, which only the console's keys can rebuild
+// every block has the SHA1 of what it reads as, encrypted
+// the container: a header sector, the map, one entry per block, then the slots
+
+#define SPARSE_MAGIC 0x5250534e // "NSPR"
+#define SPARSE_VERSION 1
+// sectors, 32KB
+#define SPARSE_BLOCK_LEN 64
+
+#define SPARSE_ZERO_RAW 0xffffffff
+#define SPARSE_ZERO_PLAIN 0xfffffffe
+
+typedef struct {
+	u32 magic;
+	u16 version;
+	u16 block_len;
+	u32 sectors; // of the image
+	u32 blocks;
+	u32 map_sector; // in the container
+	u32 data_sector; // slot 0
+	u32 slots;
+	// AES-CTR keystream at offset 0, SPARSE_ZERO_PLAIN blocks need keys giving the same
+	u8 key_check[16];
+} sparse_header_t;
+
+typedef struct {
+	u32 loc; // slot, or SPARSE_ZERO_*
+	u8 sha1[SHA1_LEN];
+} sparse_entry_t;
+
+typedef struct {
+	raw_sync_t sync;
+	raw_file_t *file; // the container, growable
+	const dsi_crypt_ctx_t *ctx;
+	sparse_header_t h;
+	sparse_entry_t *map; // padded to whole sectors
+	u32 map_sectors;
+	u8 *dirty; // one bit per block, its hash and entry are stale
+	bool map_dirty;
+	u8 *block_buf;
+} raw_sparse_t;
+
+// ctx may be 0 as long as there are no SPARSE_ZERO_PLAIN blocks
+bool raw_sparse_open(raw_sparse_t *s, raw_file_t *file, const dsi_crypt_ctx_t *ctx);
+
+// every block starts as SPARSE_ZERO_RAW
+bool raw_sparse_create(raw_sparse_t *s, raw_file_t *file, sec_t sectors, const dsi_crypt_ctx_t *ctx);
+
+bool raw_sparse_rw(raw_sparse_t *s, blk_op_t op, sec_t start, sec_t len, void *buffer);
+
+// for converters, drops the block back to implicit, loc is one of SPARSE_ZERO_*
+bool raw_sparse_set_implicit(raw_sparse_t *s, u32 block, u32 loc);
+
+// hashes of what changed, the map and the header, then the container
+bool raw_sparse_flush(raw_sparse_t *s);
+
+void raw_sparse_free(raw_sparse_t *s);
@@ -16,6 +16,8 @@ extern int is3DS;
 
 extern swiSHA1context_t sha1ctx;
 
+extern dsi_crypt_ctx_t crypt_ctx;
+
 // http://problemkaputt.de/gbatek.htm#dsisdmmcinternalnandlayout
 
 typedef struct {
@@ -36,25 +38,27 @@ typedef struct {
 static_assert(sizeof(DSi_Stage2_Boot_Info_Block) == 0x20 + sizeof(DSi_Stage2_Boot_Code_Descriptor) * 2,
 	"DSi_Stage2_Boot_Info_Block invalid size");
 
+// sectors per read, 32KB
+#define STAGE2_BUF_LEN 64
+// print progress every this many sectors
+#define STAGE2_PROGRESS_LEN 256
+
 int dump_stage2(DSi_Stage2_Index s2idx , const char *filename) {
 	if (is3DS) {
 		iprtf("%s: this doesn't work on 3DS\n", __FUNCTION__);
 		return -1;
 	}
 	iprtf("dump stage2 %s to: %s\n", s2idx == STAGE2_ARM9 ? "ARM9" : "ARM7", filename);
-	/*
-	FILE *f = fopen(filename, "w");
-	if (f == 0) {
-		iprtf("failed to open %s for writing\n", filename);
-		return -1;
-	}
-	*/
-	u8* buf = (u8*)memalign(32, SECTOR_SIZE);
+	u8* buf = (u8*)memalign(32, SECTOR_SIZE * STAGE2_BUF_LEN);
 	if (buf == 0) {
 		prt("failed to alloc buffer\n");
 		return -1;
 	}
-	read_raw_sectors(1, 1, buf);
+	if (!read_raw_sectors(1, 1, buf)) {
+		prt("failed to read stage2 info block\n");
+		free(buf);
+		return -1;
+	}
 	DSi_Stage2_Boot_Info_Block *s2bib = (DSi_Stage2_Boot_Info_Block*)buf;
 	u32 offset = s2bib->s2bcd[s2idx].offset;
 	u32 size_r = s2bib->s2bcd[s2idx].size_r;
@@ -62,7 +66,15 @@ int dump_stage2(DSi_Stage2_Index s2idx , const char *filename) {
 	iprtf("\tsize_r: 0x%lx(%ld)\n", size_r, size_r);
 
 	assert(size_r % SECTOR_SIZE == 0);
-	dsi_boot2_crypt_set_ctr(size_r);
+
+	FILE *f = fopen(filename, "wb");
+	if (f == 0) {
+		iprtf("failed to open %s for writing\n", filename);
+		free(buf);
+		return -1;
+	}
+
+	dsi_boot2_crypt_set_ctr(&crypt_ctx, size_r);
 
 	swiSHA1context_t sha1ctx_raw;
 	sha1ctx_raw.sha_block = 0;
@@ -71,28 +83,51 @@ int dump_stage2(DSi_Stage2_Index s2idx , const char *filename) {
 	sha1ctx.sha_block = 0;
 	swiSHA1Init(&sha1ctx);
 
-	for (unsigned i = 0; i < size_r / SECTOR_SIZE; ++i) {
-		if (!read_raw_sectors(offset / SECTOR_SIZE + i, 1, buf)) {
-			iprtf("\nerror reading sector %ld\n", offset / SECTOR_SIZE + i);
+	int ret = 0;
+	u32 sector = offset / SECTOR_SIZE;
+	u32 total = size_r / SECTOR_SIZE;
+	u32 next_progress = 0;
+	for (u32 i = 0; i < total;) {
+		u32 n = total - i < STAGE2_BUF_LEN ? total - i : STAGE2_BUF_LEN;
+		if (!read_raw_sectors(sector + i, n, buf)) {
+			iprtf("\nerror reading sector %ld\n", sector + i);
+			ret = -1;
+			break;
+		}
+		swiSHA1Update(&sha1ctx_raw, buf, n * SECTOR_SIZE);
+		// the counter runs on across calls, so one call per run is the same as one per sector
+		dsi_boot2_crypt(&crypt_ctx, buf, buf, n * SECTOR_SIZE / AES_BLOCK_SIZE);
+		swiSHA1Update(&sha1ctx, buf, n * SECTOR_SIZE);
+		if (fwrite(buf, SECTOR_SIZE, n, f) != n) {
+			iprtf("\nerror writing %s\n", filename);
+			ret = -1;
+			break;
 		}
-		swiSHA1Update(&sha1ctx_raw, buf, SECTOR_SIZE);
-		dsi_boot2_crypt(buf, buf, SECTOR_SIZE / AES_BLOCK_SIZE);
-		swiSHA1Update(&sha1ctx, buf, SECTOR_SIZE);
-		// fwrite(buf, SECTOR_SIZE, 1, f);
-		iprtf("\r%d/%ld", i + 1, size_r / SECTOR_SIZE);
+		i += n;
+		if (i >= next_progress || i == total) {
+			iprtf("\r%ld/%ld", i, total);
+			next_progress = i + STAGE2_PROGRESS_LEN;
+		}
+	}
+	fclose(f);
+	free(buf);
+	if (ret != 0) {
+		return ret;
 	}
 	prt("\ndone\n");
 
-	// fclose(f);
-	// save_sha1_file(filename);
 	u32 sha1[5];
 	swiSHA1Final(sha1, &sha1ctx_raw);
+	prt("raw: ");
 	print_bytes(sha1, 20);
 	prt("\n");
-	swiSHA1Final(sha1, &sha1ctx);
+	// save_sha1_file() finalizes sha1ctx, print from a copy
+	swiSHA1context_t sha1ctx_dec = sha1ctx;
+	swiSHA1Final(sha1, &sha1ctx_dec);
+	prt("dec: ");
 	print_bytes(sha1, 20);
 	prt("\n");
+	save_sha1_file(filename);
 
-	free(buf);
 	return 0;
 }
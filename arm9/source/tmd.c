@@ -19,6 +19,8 @@
 
 extern const char nand_root[];
 
+extern dsi_crypt_ctx_t crypt_ctx;
+
 const char cert_sys_path[] = "sys/cert.sys";
 
 const char cert_cp07_name[] = "CP00000007";
@@ -123,7 +125,7 @@ static int find_ticket_cb(const char* full_path, const char* name, size_t size,
 	assert(ticket_original != 0);
 	memcpy(ticket_original, ticket_template, TICKET_SIZE);
 #endif
-	if (dsi_es_block_crypt(ticket_template, TICKET_SIZE, DECRYPT) != 0) {
+	if (dsi_es_block_crypt(&crypt_ctx, ticket_template, TICKET_SIZE, DECRYPT) != 0) {
 		iprtf("failed to decrypt ticket: %s\n", name);
 		return 0;
 	}
@@ -131,7 +133,7 @@ static int find_ticket_cb(const char* full_path, const char* name, size_t size,
 	uint8_t *ticket_enc = memalign(TICKET_ALIGN, TICKET_SIZE);
 	assert(ticket_enc != 0);
 	memcpy(ticket_enc, ticket_template, TICKET_SIZE);
-	assert(dsi_es_block_crypt(ticket_enc, TICKET_SIZE, ENCRYPT) == 0);
+	assert(dsi_es_block_crypt(&crypt_ctx, ticket_enc, TICKET_SIZE, ENCRYPT) == 0);
 	if (memcmp(ticket_original, ticket_enc, TICKET_SIZE) == 0) {
 		prtf("ES encryption test OK\n");
 	} else {
@@ -309,7 +311,7 @@ int tmd_verify(const uint8_t *tmd_buf, const char *tmd_dir,
 	// forge ticket
 	memcpy(ticket_buf, ticket_template, TICKET_SIZE);
 	PUT_UINT32_BE(title_id[0], ((ticket_v0_t*)ticket_buf)->title_id, 4);
-	if (dsi_es_block_crypt(ticket_buf, TICKET_SIZE, ENCRYPT) != 0) {
+	if (dsi_es_block_crypt(&crypt_ctx, ticket_buf, TICKET_SIZE, ENCRYPT) != 0) {
 		prt("weird, failed to forge ticket\n");
 		return -1;
 	}
@@ -0,0 +1,109 @@
+#include <nds.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "../term256/term256ext.h"
+#include "blkdev.h"
+#include "trace.h"
+
+// records are gathered here and written out when it's full, 6KB
+#define TRACE_BUF_LEN 512
+#define TRACE_COUNT_MAX 0xffff
+
+static FILE *f = 0;
+static nandtrace_record_t buf[TRACE_BUF_LEN];
+static unsigned buf_count;
+static u32 total;
+static u32 last_clock;
+static u64 elapsed; // BUS_CLOCK, blk_clock wraps
+
+static bool trace_flush() {
+	if (buf_count == 0) {
+		return true;
+	}
+	bool ok = fwrite(buf, sizeof(nandtrace_record_t), buf_count, f) == buf_count;
+	buf_count = 0;
+	return ok;
+}
+
+bool trace_active() {
+	return f != 0;
+}
+
+bool trace_start(const char *filename) {
+	if (f != 0) {
+		return true;
+	}
+	f = fopen(filename, "wb");
+	if (f == 0) {
+		iprtf("failed to open %s\n", filename);
+		return false;
+	}
+	nandtrace_header_t h = {
+		.magic = NANDTRACE_MAGIC,
+		.version = NANDTRACE_VERSION,
+		.record_size = sizeof(nandtrace_record_t),
+		.clock = BUS_CLOCK,
+		.reserved = 0
+	};
+	if (fwrite(&h, sizeof(h), 1, f) != 1) {
+		iprtf("failed to write %s\n", filename);
+		fclose(f);
+		f = 0;
+		return false;
+	}
+	buf_count = 0;
+	total = 0;
+	elapsed = 0;
+	blk_clock_start();
+	last_clock = blk_clock();
+	iprtf("recording sector trace to %s\n", filename);
+	return true;
+}
+
+bool trace_stop() {
+	if (f == 0) {
+		return true;
+	}
+	bool ok = trace_flush();
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	f = 0;
+	if (ok) {
+		iprtf("sector trace: %" PRIu32 " records\n", total);
+	} else {
+		prt("sector trace: write failed\n");
+	}
+	return ok;
+}
+
+// a gap of over 128 seconds between two requests loses whole wraps of blk_clock
+// requests over TRACE_COUNT_MAX sectors are split
+void trace_record(nandtrace_op_t op, nandtrace_dev_t dev, sec_t sector, sec_t count) {
+	if (f == 0) {
+		return;
+	}
+	u32 now = blk_clock();
+	elapsed += now - last_clock;
+	last_clock = now;
+	u32 time = (u32)(elapsed * 1000000 / BUS_CLOCK);
+	do {
+		sec_t n = count < TRACE_COUNT_MAX ? count : TRACE_COUNT_MAX;
+		nandtrace_record_t *r = &buf[buf_count++];
+		r->time = time;
+		r->sector = sector;
+		r->count = n;
+		r->op = op;
+		r->dev = dev;
+		++total;
+		sector += n;
+		count -= n;
+		if (buf_count == TRACE_BUF_LEN && !trace_flush()) {
+			// the SD is full or gone, keep what made it
+			fclose(f);
+			f = 0;
+			prt("sector trace: write failed\n");
+			return;
+		}
+	} while (count > 0);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <nds.h>
+#include <nds/disc_io.h>
+#include "nandtrace.h"
+
+// sector access trace recorder, the stats layer of nandio/imgio feeds it while it's recording
+
+bool trace_start(const char *filename);
+
+bool trace_stop();
+
+bool trace_active();
+
+void trace_record(nandtrace_op_t op, nandtrace_dev_t dev, sec_t sector, sec_t count);
@@ -159,6 +159,21 @@ int save_sha1_file(const char *filename) {
 	return ret;
 }
 
+// the digest save_sha1_file wrote for filename
+int load_sha1_file(void *digest, const char *filename) {
+	size_t len_fn = strlen(filename);
+	char *sha1_fn = (char *)malloc(len_fn + 6);
+	siprintf(sha1_fn, "%s.sha1", filename);
+	char hex[2 * 20 + 1];
+	hex[2 * 20] = 0;
+	int ret = load_block_from_file(hex, sha1_fn, 0, 2 * 20);
+	free(sha1_fn);
+	if (ret != 0) {
+		return ret;
+	}
+	return hex2bytes((uint8_t*)digest, 20, hex);
+}
+
 void print_bytes(const void *buf, size_t len) {
 	const unsigned char *p = (const unsigned char *)buf;
 	for(size_t i = 0; i < len; ++i) {
@@ -15,6 +15,8 @@ int load_block_from_file(void *buf, const char *filename, unsigned offset, unsig
 
 int save_sha1_file(const char *filename);
 
+int load_sha1_file(void *digest, const char *filename);
+
 void print_bytes(const void *buf, size_t len);
 
 void utf16_to_ascii(uint8_t *out, const uint16_t *in, unsigned len);
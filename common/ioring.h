@@ -0,0 +1,89 @@
+#pragma once
+
+#include <nds/ndstypes.h>
+
+// asynchronous NAND sector I/O, the ARM9 queues descriptors, the ARM7 carries them out in order
+// so the ARM9 can decrypt or hash one chunk while the ARM7 transfers the next
+// the ring lives in main RAM, allocated by the ARM9, its address goes over FIFO_USER_01
+// nothing in here touches hardware, the ARM9 side does the cache maintenance
+// and the medium is a pair of callbacks, so the state machine also runs against a file on a PC
+
+// FIFO_USER_01 commands, after 1/4/5 in arm7/source/main.c
+// SETUP is followed by the ring's address, both are answered with 0
+#define IORING_CMD_SETUP 6
+#define IORING_CMD_TEARDOWN 7
+
+// ARM9 -> ARM7 one value whenever descriptors were queued
+// ARM7 -> ARM9 one value per descriptor done, its index
+#define IORING_FIFO FIFO_USER_02
+
+#define IORING_LEN 8
+
+typedef enum {
+	IORING_READ = 1,
+	IORING_WRITE = 2
+} ioring_op_t;
+
+// one cache line each, so the ARM9 can flush or invalidate one without touching its neighbours
+typedef struct {
+	u32 op;
+	u32 sector;
+	u32 count;
+	void *buffer; // main RAM, whole cache lines
+	s32 result; // 0 on success, written by the ARM7
+	u32 reserved[3];
+} ioring_desc_t;
+
+typedef struct {
+	ioring_desc_t desc[IORING_LEN];
+	vu32 head; // queued, written by the ARM9 only
+	u32 reserved0[7];
+	vu32 tail; // done, written by the ARM7 only
+	u32 reserved1[7];
+} ioring_t;
+
+// sdmmc_nand_readsectors/writesectors on the ARM7
+typedef struct {
+	int (*read)(u32 sector, u32 count, void *buffer);
+	int (*write)(u32 sector, u32 count, void *buffer);
+} ioring_medium_t;
+
+// ARM7 side, carries out the oldest queued descriptor
+// returns its index, or -1 if there was none
+static inline int ioring_process(ioring_t *r, const ioring_medium_t *m) {
+	u32 tail = r->tail;
+	if (tail == r->head) {
+		return -1;
+	}
+	int i = tail % IORING_LEN;
+	ioring_desc_t *d = &r->desc[i];
+	switch (d->op) {
+	case IORING_READ:
+		d->result = m->read(d->sector, d->count, d->buffer);
+		break;
+	case IORING_WRITE:
+		d->result = m->write(d->sector, d->count, d->buffer);
+		break;
+	default:
+		d->result = -1;
+	}
+	r->tail = tail + 1;
+	return i;
+}
+
+// ARM9 side, fills the next descriptor, returns its index, or -1 if the ring is full
+// done counts the descriptors whose completion the ARM9 already took
+static inline int ioring_queue(ioring_t *r, u32 done, u32 op, u32 sector, u32 count, void *buffer) {
+	u32 head = r->head;
+	if (head - done >= IORING_LEN) {
+		return -1;
+	}
+	int i = head % IORING_LEN;
+	ioring_desc_t *d = &r->desc[i];
+	d->op = op;
+	d->sector = sector;
+	d->count = count;
+	d->buffer = buffer;
+	d->result = -1;
+	return i;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+// sector access trace, what the recorder in arm9 writes and host/replay reads
+// a header, then records until the end of the file, all little endian
+
+#define NANDTRACE_MAGIC 0x4352544e // "NTRC"
+#define NANDTRACE_VERSION 1
+
+typedef enum {
+	NANDTRACE_READ = 1,
+	NANDTRACE_WRITE = 2,
+	NANDTRACE_SYNC = 3,
+	// past the cache, with SHA1 of the decrypted data
+	NANDTRACE_READ_SHA1 = 4
+} nandtrace_op_t;
+
+typedef enum {
+	NANDTRACE_NANDIO = 0,
+	NANDTRACE_IMGIO = 1
+} nandtrace_dev_t;
+
+typedef struct {
+	u32 magic;
+	u16 version;
+	u16 record_size;
+	// BUS_CLOCK of the recorder, timestamps are in microseconds anyway
+	u32 clock;
+	u32 reserved;
+} nandtrace_header_t;
+
+// timestamps are when the request came in, microseconds since recording started
+typedef struct {
+	u32 time;
+	u32 sector;
+	u16 count;
+	u8 op;
+	u8 dev;
+} nandtrace_record_t;
+
+_Static_assert(sizeof(nandtrace_header_t) == 16, "nandtrace_header_t");
+_Static_assert(sizeof(nandtrace_record_t) == 12, "nandtrace_record_t");
@@ -0,0 +1,97 @@
+#include <nds.h>
+#include <stdlib.h>
+#include <time.h>
+#include "aes.h"
+
+// known answers for aes_encrypt_128_be, then the same random blocks through it and the old
+// DTCM global version, and how long each takes per block
+// aestest [blocks to time]
+
+#ifndef AES_ENCRYPT_REF
+#error aestest compares against aes_encrypt_128_be_ref, build with -DAES_ENCRYPT_REF
+#endif
+
+#define RANDOM_BLOCKS 100000
+
+typedef void (*encrypt_t)(const uint32_t*, const unsigned char*, unsigned char*);
+
+// the all zero key and block, from the AES known answer tests, byte reversed like FIPS-197 in aes.c
+static const unsigned char zero_ct[16] = {
+	0x2e, 0x2b, 0x34, 0xca, 0x59, 0xfa, 0x4c, 0x88,
+	0x3b, 0x2c, 0x8a, 0xef, 0xd4, 0x4b, 0xe9, 0x66
+};
+
+static u32 rnd_state = 0x2545f491;
+
+static u32 rnd() {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static void rnd_fill(unsigned char *p, unsigned len) {
+	for (unsigned i = 0; i < len; ++i) {
+		p[i] = (unsigned char)rnd();
+	}
+}
+
+static double ns_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// chained so the compiler can't drop or overlap the calls
+static double bench(encrypt_t encrypt, unsigned blocks) {
+	uint32_t rk[RK_LEN];
+	unsigned char key[16], block[16];
+	rnd_fill(key, sizeof(key));
+	rnd_fill(block, sizeof(block));
+	aes_set_key_enc_128_be(rk, key);
+	double t = ns_now();
+	for (unsigned i = 0; i < blocks; ++i) {
+		encrypt(rk, block, block);
+	}
+	return (ns_now() - t) / blocks;
+}
+
+int main(int argc, const char * const argv[]) {
+	unsigned blocks = argc > 1 ? strtoul(argv[1], 0, 0) : 1000000;
+	int fails = 0;
+
+	int ret = aes_self_test();
+	printf("FIPS-197 C.1: %s\n", ret == 0 ? "ok" : ret == 1 ? "FAILED" : "FAILED (ref)");
+	fails += ret != 0;
+
+	uint32_t rk[RK_LEN];
+	unsigned char key[16] = { 0 }, pt[16] = { 0 }, ct[16], ref[16];
+	aes_set_key_enc_128_be(rk, key);
+	aes_encrypt_128_be(rk, pt, ct);
+	bool ok = memcmp(ct, zero_ct, sizeof(ct)) == 0;
+	printf("zero key and block: %s\n", ok ? "ok" : "FAILED");
+	fails += !ok;
+
+	unsigned bad = 0;
+	for (unsigned i = 0; i < RANDOM_BLOCKS; ++i) {
+		// a new key every 16 blocks
+		if (i % 16 == 0) {
+			rnd_fill(key, sizeof(key));
+			aes_set_key_enc_128_be(rk, key);
+		}
+		rnd_fill(pt, sizeof(pt));
+		aes_encrypt_128_be(rk, pt, ct);
+		aes_encrypt_128_be_ref(rk, pt, ref);
+		bad += memcmp(ct, ref, sizeof(ct)) != 0;
+		// in place, the way the NAND code calls it
+		aes_encrypt_128_be(rk, pt, pt);
+		bad += memcmp(pt, ref, sizeof(pt)) != 0;
+	}
+	printf("%u random blocks against the ref: %u differ\n", RANDOM_BLOCKS, bad);
+	fails += bad != 0;
+
+	double t_reg = bench(aes_encrypt_128_be, blocks);
+	double t_ref = bench(aes_encrypt_128_be_ref, blocks);
+	printf("%.1f ns/block, ref %.1f ns/block, %.2fx\n", t_reg, t_ref, t_ref / t_reg);
+	return fails != 0;
+}
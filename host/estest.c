@@ -0,0 +1,234 @@
+#include <nds.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include "crypto.h"
+
+// ES block crypt (AES-CCM) test vectors, the interleaved kernel against separate CTR and CBC-MAC
+// kernel: aes_ccm_crypt_128_be against aes_crypt_ctr_128_be plus a CBC-MAC of aes_encrypt_128_be
+// blocks: dsi_es_block_crypt and the streaming API against the one-after-the-other loop it replaced,
+// ticket sized and others, then decrypt back, and a tampered block has to fail the MAC
+// estest [seed]
+
+#define KERNEL_RUNS 2000
+#define KERNEL_MAX_BLOCKS 64
+#define MAX_BLOCK (64 * 1024)
+
+static u32 rnd_state;
+
+static u32 rnd() {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static void rnd_fill(void *p, unsigned len) {
+	for (unsigned i = 0; i < len; ++i) {
+		((u8*)p)[i] = (u8)rnd();
+	}
+}
+
+static void xor_128(uint32_t *x, const uint32_t *a, const uint32_t *b) {
+	x[0] = a[0] ^ b[0];
+	x[1] = a[1] ^ b[1];
+	x[2] = a[2] ^ b[2];
+	x[3] = a[3] ^ b[3];
+}
+
+static void add_128_1(uint32_t *a) {
+	if (++a[0] == 0 && ++a[1] == 0 && ++a[2] == 0) {
+		++a[3];
+	}
+}
+
+static void aes_ctr(const uint32_t *rk, const uint32_t *ctr, uint32_t *in, uint32_t *out) {
+	uint32_t xor[4];
+	aes_encrypt_128_be(rk, (uint8_t*)ctr, (uint8_t*)xor);
+	xor_128(out, in, xor);
+}
+
+// the payload loop dsi_es_block_crypt had before the interleaved kernel
+static void ref_ccm(const uint32_t *rk, uint32_t *ctr32, uint32_t *mac32, uint32_t *buf, unsigned count, int decrypt) {
+	for (unsigned i = 0; i < count; ++i, buf += 4) {
+		if (decrypt) {
+			aes_ctr(rk, ctr32, buf, buf);
+			add_128_1(ctr32);
+			xor_128(mac32, mac32, buf);
+			aes_encrypt_128_be(rk, (uint8_t*)mac32, (uint8_t*)mac32);
+		} else {
+			xor_128(mac32, mac32, buf);
+			aes_encrypt_128_be(rk, (uint8_t*)mac32, (uint8_t*)mac32);
+			aes_ctr(rk, ctr32, buf, buf);
+			add_128_1(ctr32);
+		}
+	}
+}
+
+// random keys, counters close to carrying into the upper words, random lengths
+static unsigned test_kernel() {
+	static uint32_t in[KERNEL_MAX_BLOCKS * 4], a[KERNEL_MAX_BLOCKS * 4], b[KERNEL_MAX_BLOCKS * 4];
+	unsigned bad = 0;
+	for (unsigned r = 0; r < KERNEL_RUNS; ++r) {
+		uint32_t rk[RK_LEN];
+		u8 key[16];
+		rnd_fill(key, sizeof(key));
+		aes_set_key_enc_128_be(rk, key);
+		uint32_t ctr_a[4], ctr_b[4], mac_a[4], mac_b[4];
+		rnd_fill(ctr_a, sizeof(ctr_a));
+		switch (r % 4) {
+		case 1:
+			ctr_a[0] = -(rnd() % 8);
+			break;
+		case 2:
+			ctr_a[0] = -(rnd() % 8);
+			ctr_a[1] = ctr_a[2] = 0xffffffff;
+			break;
+		}
+		rnd_fill(mac_a, sizeof(mac_a));
+		memcpy(ctr_b, ctr_a, sizeof(ctr_a));
+		memcpy(mac_b, mac_a, sizeof(mac_a));
+		unsigned count = 1 + rnd() % KERNEL_MAX_BLOCKS;
+		int decrypt = r & 1;
+		rnd_fill(in, count * AES_BLOCK_SIZE);
+		memcpy(b, in, count * AES_BLOCK_SIZE);
+		// out of place on odd runs, in place otherwise
+		if (r & 2) {
+			aes_ccm_crypt_128_be(rk, ctr_a, mac_a, a, in, count, decrypt);
+		} else {
+			memcpy(a, in, count * AES_BLOCK_SIZE);
+			aes_ccm_crypt_128_be(rk, ctr_a, mac_a, a, a, count, decrypt);
+		}
+		ref_ccm(rk, ctr_b, mac_b, b, count, decrypt);
+		bad += memcmp(a, b, count * AES_BLOCK_SIZE) != 0
+			|| memcmp(ctr_a, ctr_b, sizeof(ctr_a)) != 0
+			|| memcmp(mac_a, mac_b, sizeof(mac_a)) != 0;
+	}
+	return bad;
+}
+
+// dsi_es_block_crypt as it was before the interleaved kernel, encrypt only, which is all it's compared on
+static void ref_es_encrypt(const dsi_crypt_ctx_t *crypt, uint8_t *buf, unsigned buf_len) {
+	const uint32_t *rk = crypt->es_rk;
+	es_block_footer_t *footer = (es_block_footer_t*)(buf + buf_len - sizeof(es_block_footer_t));
+	uint8_t nonce[AES_CCM_NONCE_LEN];
+	memcpy(nonce, footer->nonce, AES_CCM_NONCE_LEN);
+	uint32_t ctr32[4] = { 0 }, pad32[4] = { 0 }, mac32[4] = { 0 };
+	uint8_t *ctr = (uint8_t*)ctr32, *mac = (uint8_t*)mac32;
+	uint32_t block_size = buf_len - sizeof(es_block_footer_t);
+	// the plain text is padded with zero, the footer is restored below
+	uint8_t saved[AES_BLOCK_SIZE];
+	uint32_t remainder = block_size & 0xf;
+	memcpy(saved, buf + block_size, AES_BLOCK_SIZE);
+	if (remainder != 0) {
+		memset(buf + block_size, 0, 16 - remainder);
+		block_size += 16 - remainder;
+	}
+	mac32[0] = block_size;
+	memcpy(mac + 3, nonce, AES_CCM_NONCE_LEN);
+	mac[0xf] = 0x3a;
+	aes_encrypt_128_be(rk, mac, mac);
+	memcpy(ctr + 3, nonce, AES_CCM_NONCE_LEN);
+	ctr[0xf] = 2;
+	aes_ctr(rk, ctr32, pad32, pad32);
+	add_128_1(ctr32);
+	ref_ccm(rk, ctr32, mac32, (uint32_t*)buf, block_size / AES_BLOCK_SIZE, 0);
+	block_size = buf_len - sizeof(es_block_footer_t);
+	memcpy(buf + block_size, saved, AES_BLOCK_SIZE);
+	xor_128(mac32, mac32, pad32);
+	memcpy(footer->ccm_mac, mac, AES_CCM_MAC_LEN);
+	memset(ctr32, 0, sizeof(ctr32));
+	memcpy(ctr + 1, nonce, AES_CCM_NONCE_LEN);
+	memcpy(pad32, footer->encrypted, AES_BLOCK_SIZE);
+	aes_ctr(rk, ctr32, pad32, pad32);
+	memcpy(footer->encrypted, pad32, AES_BLOCK_SIZE);
+	memcpy(footer->nonce, nonce, AES_CCM_NONCE_LEN);
+}
+
+static void make_block(uint8_t *buf, unsigned block_size) {
+	rnd_fill(buf, block_size);
+	es_block_footer_t *footer = (es_block_footer_t*)(buf + block_size);
+	memset(footer, 0, sizeof(*footer));
+	footer->fixed_3a = 0x3a;
+	rnd_fill(footer->nonce, AES_CCM_NONCE_LEN);
+	footer->len24be[0] = block_size >> 16;
+	footer->len24be[1] = block_size >> 8;
+	footer->len24be[2] = block_size;
+}
+
+// the streaming API in random pieces, multiples of 16 but the last
+static int es_stream(const dsi_crypt_ctx_t *crypt, uint8_t *buf, unsigned buf_len, crypt_mode_t mode) {
+	es_block_footer_t *footer = (es_block_footer_t*)(buf + buf_len - sizeof(es_block_footer_t));
+	dsi_es_ctx_t ctx;
+	int block_size = dsi_es_block_crypt_init(crypt, &ctx, footer, mode);
+	if (block_size < 0) {
+		return 1;
+	}
+	unsigned done = 0;
+	while (done < (unsigned)block_size) {
+		unsigned len = (1 + rnd() % 64) * AES_BLOCK_SIZE;
+		dsi_es_block_crypt_update(&ctx, buf + done, buf + done, len);
+		done += len;
+	}
+	return dsi_es_block_crypt_final(&ctx, footer);
+}
+
+static unsigned test_blocks(const dsi_crypt_ctx_t *crypt) {
+	static const unsigned sizes[] = { sizeof(ticket_v0_t), 16, 17, 0x100, 0x3f0, 4099, MAX_BLOCK };
+	uint8_t *plain = (uint8_t*)memalign(32, MAX_BLOCK + 0x20);
+	uint8_t *ref = (uint8_t*)memalign(32, MAX_BLOCK + 0x20);
+	uint8_t *buf = (uint8_t*)memalign(32, MAX_BLOCK + 0x20);
+	unsigned bad = 0;
+	for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		for (unsigned r = 0; r < 20; ++r) {
+			unsigned block_size = sizes[i];
+			unsigned len = block_size + 0x20;
+			make_block(plain, block_size);
+			memcpy(ref, plain, len);
+			ref_es_encrypt(crypt, ref, len);
+			// whole block, then streamed, both have to give what the old loop gave
+			memcpy(buf, plain, len);
+			bool ok = dsi_es_block_crypt(crypt, buf, len, ENCRYPT) == 0 && memcmp(buf, ref, len) == 0;
+			memcpy(buf, plain, len);
+			ok = ok && es_stream(crypt, buf, len, ENCRYPT) == 0 && memcmp(buf, ref, len) == 0;
+			// and back
+			ok = ok && dsi_es_block_crypt(crypt, buf, len, DECRYPT) == 0
+				&& memcmp(buf, plain, block_size) == 0;
+			memcpy(buf, ref, len);
+			ok = ok && es_stream(crypt, buf, len, DECRYPT) == 0 && memcmp(buf, plain, block_size) == 0;
+			// one bit flipped anywhere in the payload
+			memcpy(buf, ref, len);
+			buf[rnd() % block_size] ^= 1 << (rnd() % 8);
+			ok = ok && dsi_es_block_crypt(crypt, buf, len, DECRYPT) != 0;
+			if (!ok) {
+				printf("block of 0x%x bytes differs\n", block_size);
+				++bad;
+			}
+		}
+	}
+	free(plain);
+	free(ref);
+	free(buf);
+	return bad;
+}
+
+int main(int argc, const char * const argv[]) {
+	rnd_state = argc > 1 ? strtoul(argv[1], 0, 0) : 0x2545f491;
+	if (rnd_state == 0) {
+		rnd_state = 1;
+	}
+	int fails = 0;
+	unsigned bad = test_kernel();
+	printf("kernel, %u runs: %u differ\n", KERNEL_RUNS, bad);
+	fails += bad != 0;
+
+	u8 console_id[8], cid[16];
+	rnd_fill(console_id, sizeof(console_id));
+	rnd_fill(cid, sizeof(cid));
+	static dsi_crypt_ctx_t crypt;
+	dsi_crypt_init(&crypt, console_id, cid, 0);
+	// the tampered blocks print their MAC failures
+	bad = test_blocks(&crypt);
+	printf("ES blocks: %u differ\n", bad);
+	fails += bad != 0;
+	return fails != 0;
+}
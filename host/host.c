@@ -0,0 +1,135 @@
+#include <nds.h>
+#include <stdarg.h>
+#include <time.h>
+#include <nds/disc_io.h>
+#include "nandtrace.h"
+
+// what libnds, term256 and the recorder provide on the DS
+
+vu16 host_timer_cr[4];
+static vu16 timer_data[4];
+
+// 2 and 3 cascaded are the low and high half of BUS_CLOCK ticks
+vu16 *host_timer_data(int timer) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	u32 ticks = (u32)(((u64)ts.tv_sec * 1000000000 + ts.tv_nsec) * BUS_CLOCK / 1000000000);
+	timer_data[timer] = timer & 1 ? ticks >> 16 : ticks & 0xffff;
+	return &timer_data[timer];
+}
+
+void prt(const char *s) {
+	fputs(s, stdout);
+}
+
+void iprtf(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+void activity(int color) {
+}
+
+// nothing is recorded while replaying
+void trace_record(nandtrace_op_t op, nandtrace_dev_t dev, sec_t sector, sec_t count) {
+}
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(swiSHA1context_t *ctx, const u8 *p) {
+	u32 w[80];
+	for (unsigned i = 0; i < 16; ++i) {
+		w[i] = (u32)p[i * 4] << 24 | (u32)p[i * 4 + 1] << 16 | (u32)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	}
+	for (unsigned i = 16; i < 80; ++i) {
+		w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+	u32 a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3], e = ctx->state[4];
+	for (unsigned i = 0; i < 80; ++i) {
+		u32 f, k;
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		u32 t = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+}
+
+void swiSHA1Init(swiSHA1context_t *ctx) {
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->state[4] = 0xc3d2e1f0;
+	ctx->total[0] = 0;
+	ctx->total[1] = 0;
+	ctx->fragment_size = 0;
+}
+
+void swiSHA1Update(swiSHA1context_t *ctx, const void *data, size_t len) {
+	const u8 *p = (const u8*)data;
+	u64 total = ((u64)ctx->total[1] << 32 | ctx->total[0]) + len;
+	ctx->total[0] = (u32)total;
+	ctx->total[1] = (u32)(total >> 32);
+	while (len > 0) {
+		size_t n = 64 - ctx->fragment_size;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(ctx->buffer + ctx->fragment_size, p, n);
+		ctx->fragment_size += n;
+		p += n;
+		len -= n;
+		if (ctx->fragment_size == 64) {
+			sha1_block(ctx, ctx->buffer);
+			ctx->fragment_size = 0;
+		}
+	}
+}
+
+void swiSHA1Final(void *digest, swiSHA1context_t *ctx) {
+	u64 bits = ((u64)ctx->total[1] << 32 | ctx->total[0]) * 8;
+	static const u8 pad[64] = { 0x80 };
+	size_t n = ctx->fragment_size < 56 ? 56 - ctx->fragment_size : 120 - ctx->fragment_size;
+	swiSHA1Update(ctx, pad, n);
+	u8 len_be[8];
+	for (unsigned i = 0; i < 8; ++i) {
+		len_be[i] = (u8)(bits >> (56 - i * 8));
+	}
+	swiSHA1Update(ctx, len_be, 8);
+	u8 *out = (u8*)digest;
+	for (unsigned i = 0; i < 5; ++i) {
+		out[i * 4] = (u8)(ctx->state[i] >> 24);
+		out[i * 4 + 1] = (u8)(ctx->state[i] >> 16);
+		out[i * 4 + 2] = (u8)(ctx->state[i] >> 8);
+		out[i * 4 + 3] = (u8)ctx->state[i];
+	}
+}
+
+void swiSHA1Calc(void *digest, const void *data, size_t len) {
+	swiSHA1context_t ctx;
+	swiSHA1Init(&ctx);
+	swiSHA1Update(&ctx, data, len);
+	swiSHA1Final(digest, &ctx);
+}
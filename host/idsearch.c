@@ -0,0 +1,228 @@
+#include <nds.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include "crypto.h"
+
+// console ID search of the firmware, dsi_id_search, spread over threads
+// the high word of the console ID is kept, the low word is searched from the one given on,
+// every candidate one block matches is checked on the whole of sector 0 like the firmware does
+// idsearch <image> <console ID> <CID> [threads]
+// idsearch -t [threads] hides random IDs in synthetic sector 0s and has to find them again
+
+#define SECTOR_SIZE 512
+// candidates a thread takes at a time
+#define CHUNK 0x10000
+#define TEST_RUNS 8
+// the right low word is this many candidates at most from where the test starts
+#define TEST_SPAN 0x200000
+
+typedef struct {
+	const u8 *sector0; // encrypted
+	u8 console_id[8];
+	u8 cid[16];
+	dsi_id_search_t s;
+	u32 start; // low word searched from
+	u64 span; // candidates
+	// shared by the threads
+	u64 next; // next chunk, from start
+	int found;
+	u32 found_lo;
+	u64 matches; // blocks that matched, the real one included
+} search_t;
+
+static int hex2bytes(u8 *out, unsigned len, const char *in) {
+	if (strlen(in) != len * 2) {
+		return -1;
+	}
+	for (unsigned i = 0; i < len; ++i) {
+		unsigned b;
+		if (sscanf(in + i * 2, "%2x", &b) != 1) {
+			return -1;
+		}
+		out[i] = (u8)b;
+	}
+	return 0;
+}
+
+// the whole sector with its keys, the empty 4th partition entry and 55 AA
+static bool check_sector0(const search_t *sr, u32 lo) {
+	u8 id[8];
+	memcpy(id, sr->console_id, 4);
+	PUT_UINT32_BE(lo, id, 4);
+	dsi_crypt_ctx_t ctx;
+	dsi_crypt_init(&ctx, id, sr->cid, 0);
+	u8 plain[SECTOR_SIZE];
+	dsi_nand_crypt(&ctx, plain, sr->sector0, 0, SECTOR_SIZE / AES_BLOCK_SIZE);
+	for (unsigned i = 0x1ee; i < 0x1fe; ++i) {
+		if (plain[i] != 0) {
+			return false;
+		}
+	}
+	return plain[0x1fe] == 0x55 && plain[0x1ff] == 0xaa;
+}
+
+static void *run(void *param) {
+	search_t *sr = (search_t*)param;
+	while (!__atomic_load_n(&sr->found, __ATOMIC_RELAXED)) {
+		u64 first = __atomic_fetch_add(&sr->next, CHUNK, __ATOMIC_RELAXED);
+		if (first >= sr->span) {
+			break;
+		}
+		unsigned count = sr->span - first < CHUNK ? sr->span - first : CHUNK;
+		uint32_t lo = sr->start + (u32)first;
+		while (count > 0) {
+			uint32_t from = lo;
+			if (!dsi_id_search(&sr->s, &lo, count)) {
+				break;
+			}
+			__atomic_fetch_add(&sr->matches, 1, __ATOMIC_RELAXED);
+			if (check_sector0(sr, lo)) {
+				__atomic_store_n(&sr->found_lo, lo, __ATOMIC_RELAXED);
+				__atomic_store_n(&sr->found, 1, __ATOMIC_RELEASE);
+				break;
+			}
+			count -= lo - from + 1;
+			++lo;
+		}
+	}
+	return 0;
+}
+
+static double ms_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// 0 found, sr->found_lo has it
+static int search(search_t *sr, unsigned threads, bool verbose) {
+	u32 plain32[AES_BLOCK_SIZE / sizeof(u32)] = { 0 };
+	u8 *plain = (u8*)plain32;
+	plain[14] = 0x55;
+	plain[15] = 0xaa;
+	u32 offset = SECTOR_SIZE / AES_BLOCK_SIZE - 1;
+	dsi_id_search_init(&sr->s, sr->console_id, sr->cid, offset, sr->sector0 + offset * AES_BLOCK_SIZE, plain);
+	GET_UINT32_BE(sr->start, sr->console_id, 4);
+	sr->next = 0;
+	sr->found = 0;
+	sr->matches = 0;
+	pthread_t *t = (pthread_t*)malloc(threads * sizeof(pthread_t));
+	double start = ms_now();
+	for (unsigned i = 0; i < threads; ++i) {
+		if (pthread_create(&t[i], 0, run, sr) != 0) {
+			fprintf(stderr, "failed to start thread %u\n", i);
+			exit(1);
+		}
+	}
+	for (unsigned i = 0; i < threads; ++i) {
+		pthread_join(t[i], 0);
+	}
+	double ms = ms_now() - start;
+	free(t);
+	u64 tested = sr->next < sr->span ? sr->next : sr->span;
+	if (verbose) {
+		printf("%" PRIu64 " tested in %.0f ms by %u threads, %.0f/s, %" PRIu64 " block matches\n",
+			tested, ms, threads, tested * 1000 / (ms > 0 ? ms : 1), sr->matches);
+	}
+	return sr->found ? 0 : -1;
+}
+
+static u32 rnd_state = 0x2545f491;
+
+static u32 rnd() {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+// random IDs, a sector 0 with an MBR encrypted with them, then searched with the low word off
+static int self_test(unsigned threads) {
+	static search_t sr;
+	static u8 sector0[SECTOR_SIZE];
+	int fails = 0;
+	u32 lo = 0;
+	for (unsigned r = 0; r < TEST_RUNS; ++r) {
+		u8 id[8];
+		for (unsigned i = 0; i < 8; ++i) {
+			id[i] = rnd();
+		}
+		for (unsigned i = 0; i < 16; ++i) {
+			sr.cid[i] = rnd();
+		}
+		u32 distance = rnd() % TEST_SPAN;
+		// the first runs cross the wrap of the low word
+		u32 from = r < 2 ? 0xffffffff - distance / 2 : rnd();
+		lo = from + distance;
+		PUT_UINT32_BE(lo, id, 4);
+		for (unsigned i = 0; i < 0x1be; ++i) {
+			sector0[i] = rnd();
+		}
+		memset(sector0 + 0x1be, 0, 0x40);
+		sector0[0x1fe] = 0x55;
+		sector0[0x1ff] = 0xaa;
+		dsi_crypt_ctx_t ctx;
+		dsi_crypt_init(&ctx, id, sr.cid, 0);
+		dsi_nand_crypt(&ctx, sector0, sector0, 0, SECTOR_SIZE / AES_BLOCK_SIZE);
+		memcpy(sr.console_id, id, 8);
+		PUT_UINT32_BE(from, sr.console_id, 4);
+		sr.sector0 = sector0;
+		sr.span = TEST_SPAN;
+		bool ok = search(&sr, threads, false) == 0 && sr.found_lo == lo;
+		printf("%08" PRIx32 " from %08" PRIx32 ": %s\n", lo, from, ok ? "found" : "FAILED");
+		fails += !ok;
+	}
+	// and one it mustn't find, the span ends just before the right one
+	sr.span = TEST_SPAN;
+	u32 from = lo - TEST_SPAN;
+	PUT_UINT32_BE(from, sr.console_id, 4);
+	bool ok = search(&sr, threads, false) != 0;
+	printf("out of span: %s\n", ok ? "not found" : "FAILED");
+	fails += !ok;
+	return fails != 0;
+}
+
+int main(int argc, const char * const argv[]) {
+	if (argc >= 2 && strcmp(argv[1], "-t") == 0) {
+		return self_test(argc > 2 ? strtoul(argv[2], 0, 0) : 4);
+	}
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s <image> <console ID> <CID> [threads]\n       %s -t [threads]\n", argv[0], argv[0]);
+		return 1;
+	}
+	static search_t sr;
+	if (hex2bytes(sr.console_id, sizeof(sr.console_id), argv[2]) != 0) {
+		fprintf(stderr, "invalid console ID: %s\n", argv[2]);
+		return 1;
+	}
+	if (hex2bytes(sr.cid, sizeof(sr.cid), argv[3]) != 0) {
+		fprintf(stderr, "invalid CID: %s\n", argv[3]);
+		return 1;
+	}
+	unsigned threads = argc > 4 ? strtoul(argv[4], 0, 0) : 4;
+	if (threads == 0) {
+		threads = 1;
+	}
+	static u8 sector0[SECTOR_SIZE];
+	FILE *f = fopen(argv[1], "rb");
+	if (f == 0 || fread(sector0, 1, SECTOR_SIZE, f) != SECTOR_SIZE) {
+		fprintf(stderr, "failed to read sector 0 of %s\n", argv[1]);
+		return 1;
+	}
+	fclose(f);
+	sr.sector0 = sector0;
+	sr.span = 0x100000000ull;
+	if (search(&sr, threads, true) != 0) {
+		printf("Console ID not found\n");
+		return 1;
+	}
+	PUT_UINT32_BE(sr.found_lo, sr.console_id, 4);
+	printf("Console ID: ");
+	for (int i = 0; i < 8; ++i) {
+		printf("%02X", sr.console_id[i]);
+	}
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+// just enough of libnds for the NAND block stack to build on the host
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef volatile uint16_t vu16;
+typedef volatile uint32_t vu32;
+typedef uint32_t uint32;
+
+#define BIT(n) (1 << (n))
+
+#define DTCM_BSS
+#define DTCM_DATA
+#define ITCM_CODE
+#define ARM_CODE
+
+#define BUS_CLOCK 33513982
+
+// timers run off the host's monotonic clock, scaled to BUS_CLOCK, writes are ignored
+vu16 *host_timer_data(int timer);
+extern vu16 host_timer_cr[4];
+
+#define TIMER_DATA(n) (*host_timer_data(n))
+#define TIMER_CR(n) host_timer_cr[n]
+#define TIMER_ENABLE BIT(7)
+#define TIMER_CASCADE BIT(2)
+#define TIMER_DIV_1 0
+
+static inline u32 timerTicks2usec(u32 ticks) {
+	return (u32)((u64)ticks * 1000000 / BUS_CLOCK);
+}
+
+typedef struct swiSHA1context {
+	u32 state[5];
+	u32 total[2];
+	u8 buffer[64];
+	u32 fragment_size;
+	void (*sha_block)(struct swiSHA1context *ctx, const void *src, size_t len);
+} swiSHA1context_t;
+
+void swiSHA1Init(swiSHA1context_t *ctx);
+
+void swiSHA1Update(swiSHA1context_t *ctx, const void *data, size_t len);
+
+void swiSHA1Final(void *digest, swiSHA1context_t *ctx);
+
+void swiSHA1Calc(void *digest, const void *data, size_t len);
@@ -0,0 +1,4 @@
+#pragma once
+
+// the types are in the host nds.h
+#include <nds.h>
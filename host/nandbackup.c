@@ -0,0 +1,158 @@
+#include <nds.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include "rawfile.h"
+#include "backup.h"
+#include "partdump.h"
+
+// the DS's backup and restore, with an image file standing in for the eMMC
+// the first run writes <backup> in full, later ones only the blocks that changed in <source>
+// <backup>.sha1 is written too, the index is only used with the image that has it
+// with -r, <backup> goes back to <source>, only the blocks that differ
+// with -p, <source> is a decrypted image, its FAT partition goes to <backup> as a sparse image
+// nandbackup [-r|-p] <source> <backup>
+
+#define SECTOR_SIZE 512
+
+static double ticks_to_ms(u64 ticks) {
+	return ticks * 1000.0 / BUS_CLOCK;
+}
+
+// <name>.sha1, the same as save_sha1_file on the DS
+static char *sha1_name(const char *name) {
+	char *s = (char*)malloc(strlen(name) + 6);
+	sprintf(s, "%s.sha1", name);
+	return s;
+}
+
+static void save_sha1(const char *name, const u8 *digest) {
+	char *s = sha1_name(name);
+	FILE *f = fopen(s, "w");
+	if (f != 0) {
+		for (int i = 0; i < SHA1_LEN; ++i) {
+			fprintf(f, "%02X", digest[i]);
+		}
+		fprintf(f, " *%s\n", name);
+		fclose(f);
+	}
+	free(s);
+}
+
+static bool load_sha1(const char *name, u8 *digest) {
+	char *s = sha1_name(name);
+	FILE *f = fopen(s, "r");
+	free(s);
+	if (f == 0) {
+		return false;
+	}
+	bool ok = true;
+	for (int i = 0; ok && i < SHA1_LEN; ++i) {
+		unsigned b;
+		ok = fscanf(f, "%2x", &b) == 1;
+		digest[i] = (u8)b;
+	}
+	fclose(f);
+	return ok;
+}
+
+static int restore(raw_t *dst, const char *name, const char *index_name, u8 *buf) {
+	restore_stats_t st;
+	u8 image_sha1[SHA1_LEN];
+	bool have_sha1 = load_sha1(name, image_sha1);
+	int ret = restore_image(dst, name, index_name, buf, dst->sectors * SECTOR_SIZE, have_sha1 ? image_sha1 : 0, 0, &st);
+	printf("\n%s, %" PRIu32 " of %" PRIu32 " blocks written in %" PRIu32 " runs, %" PRIu32 " bad, %.1fms, read %.1fms, write %.1fms, verify %.1fms\n",
+		st.indexed ? "checked against the index" : "no index", st.changed, st.blocks, st.runs, st.bad,
+		ticks_to_ms(st.elapsed), ticks_to_ms(st.read_ticks), ticks_to_ms(st.write_ticks), ticks_to_ms(st.verify_ticks));
+	return ret;
+}
+
+// the decrypted image as the disc the partition dump reads
+static FILE *disc_f;
+
+static bool disc_read(sec_t sector, sec_t count, void *buffer) {
+	return fseek(disc_f, (long)sector * SECTOR_SIZE, SEEK_SET) == 0
+		&& fread(buffer, SECTOR_SIZE, count, disc_f) == count;
+}
+
+static const DISC_INTERFACE disc = {
+	0, FEATURE_MEDIUM_CANREAD, 0, 0, disc_read, 0, 0, 0
+};
+
+static int dump(FILE *f, const char *name, u8 *buf) {
+	disc_f = f;
+	partdump_stats_t st;
+	if (dump_partition(&disc, name, buf, 0, &st) != 0) {
+		return -1;
+	}
+	printf("\n%" PRIu32 " of %" PRIu32 " sectors read, %.1f%% skipped, %" PRIu32 " of %" PRIu32 " blocks holes, %.1fms, read %.1fms, write %.1fms\n",
+		st.read, st.sectors, 100.0 * (st.sectors - st.read) / st.sectors, st.holes, st.blocks,
+		ticks_to_ms(st.elapsed), ticks_to_ms(st.read_ticks), ticks_to_ms(st.write_ticks));
+	return 0;
+}
+
+static int backup(raw_t *src, const char *name, const char *index_name, u8 *buf) {
+	swiSHA1context_t sha1ctx;
+	backup_stats_t st;
+	u8 image_sha1[SHA1_LEN];
+	bool have_sha1 = load_sha1(name, image_sha1);
+	// the host's disk is taken to have room
+	if (backup_image(src, name, index_name, buf, 0, 0, have_sha1 ? image_sha1 : 0, (size_t)-1,
+		&sha1ctx, 0, &st) != 0)
+	{
+		if (st.touched) {
+			char *s = sha1_name(name);
+			remove(s);
+			free(s);
+		}
+		return -1;
+	}
+	u8 digest[SHA1_LEN];
+	swiSHA1Final(digest, &sha1ctx);
+	save_sha1(name, digest);
+	printf("\n%s, %" PRIu32 " of %" PRIu32 " blocks written, %.1fms, read %.1fms, hash %.1fms, write %.1fms, "
+		"in place %.1fms, %.1fms saved\nSHA1 ",
+		st.incremental ? "incremental" : "full", st.changed, st.blocks,
+		ticks_to_ms(st.elapsed), ticks_to_ms(st.read_ticks), ticks_to_ms(st.write_ticks - st.sd_ticks),
+		ticks_to_ms(st.sd_ticks), ticks_to_ms(st.apply_ticks), ticks_to_ms(st.saved_ticks));
+	for (int i = 0; i < SHA1_LEN; ++i) {
+		printf("%02x", digest[i]);
+	}
+	printf("\n");
+	return 0;
+}
+
+int main(int argc, const char * const argv[]) {
+	bool to_source = argc > 1 && strcmp(argv[1], "-r") == 0;
+	bool partition = argc > 1 && strcmp(argv[1], "-p") == 0;
+	int opt = to_source || partition;
+	if (argc < 3 + opt) {
+		fprintf(stderr, "usage: %s [-r|-p] <source> <backup>\n", argv[0]);
+		return 1;
+	}
+	const char *source = argv[1 + opt];
+	const char *name = argv[2 + opt];
+	FILE *f = fopen(source, to_source ? "r+b" : "rb");
+	if (f == 0) {
+		perror(source);
+		return 1;
+	}
+	static raw_file_t raw;
+	if (!raw_file_init(&raw, f, 0) || raw.sync.base.sectors == 0) {
+		fprintf(stderr, "%s: can't read\n", source);
+		return 1;
+	}
+	char *index_name = (char*)malloc(strlen(name) + 5);
+	sprintf(index_name, "%s.idx", name);
+	u8 *buf = (u8*)memalign(32, 2 * BACKUP_BLOCK_LEN * SECTOR_SIZE);
+	int ret = partition ? dump(f, name, buf)
+		: to_source ? restore(&raw.sync.base, name, index_name, buf)
+		: backup(&raw.sync.base, name, index_name, buf);
+	if (fclose(f) != 0) {
+		ret = -1;
+	}
+	raw_file_free(&raw);
+	free(buf);
+	free(index_name);
+	return ret != 0 ? 1 : 0;
+}
@@ -0,0 +1,152 @@
+#include <nds.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <pthread.h>
+#include "crypto.h"
+
+// NAND images of several consoles at once, one thread each, every one with its own dsi_crypt_ctx_t
+// each image is run through AES-CTR with its console's keys, which decrypts it, or encrypts a
+// decrypted one, sector 0 has to come out as an MBR, the SHA1 is of what came out
+// with -w, that's also written to <image>.out
+// nandbatch [-w] <image> <console ID> <CID> [<image> <console ID> <CID> ...]
+
+#define SECTOR_SIZE 512
+#define CHUNK_SIZE (1024 * 1024)
+
+typedef struct {
+	const char *name;
+	bool write;
+	dsi_crypt_ctx_t ctx;
+	// results, printed once all are done
+	bool ok;
+	bool mbr;
+	u32 sectors;
+	u8 sha1[SHA1_LEN];
+	char error[64];
+} job_t;
+
+static int hex2bytes(u8 *out, unsigned len, const char *in) {
+	if (strlen(in) != len * 2) {
+		return -1;
+	}
+	for (unsigned i = 0; i < len; ++i) {
+		unsigned b;
+		if (sscanf(in + i * 2, "%2x", &b) != 1) {
+			return -1;
+		}
+		out[i] = (u8)b;
+	}
+	return 0;
+}
+
+static void *run(void *param) {
+	job_t *j = (job_t*)param;
+	FILE *in = fopen(j->name, "rb");
+	if (in == 0) {
+		snprintf(j->error, sizeof(j->error), "can't open");
+		return 0;
+	}
+	FILE *out = 0;
+	if (j->write) {
+		char *out_name = (char*)malloc(strlen(j->name) + 5);
+		sprintf(out_name, "%s.out", j->name);
+		out = fopen(out_name, "wb");
+		free(out_name);
+		if (out == 0) {
+			snprintf(j->error, sizeof(j->error), "can't open the output");
+			fclose(in);
+			return 0;
+		}
+	}
+	u8 *buf = (u8*)memalign(32, CHUNK_SIZE);
+	swiSHA1context_t sha1ctx;
+	sha1ctx.sha_block = 0;
+	swiSHA1Init(&sha1ctx);
+	j->ok = true;
+	size_t n;
+	while ((n = fread(buf, 1, CHUNK_SIZE, in)) > 0) {
+		if (n % SECTOR_SIZE != 0) {
+			snprintf(j->error, sizeof(j->error), "not a whole number of sectors");
+			j->ok = false;
+			break;
+		}
+		dsi_nand_crypt(&j->ctx, buf, buf, j->sectors * (SECTOR_SIZE / AES_BLOCK_SIZE), n / AES_BLOCK_SIZE);
+		if (j->sectors == 0) {
+			j->mbr = buf[0x1fe] == 0x55 && buf[0x1ff] == 0xaa;
+		}
+		swiSHA1Update(&sha1ctx, buf, n);
+		if (out != 0 && fwrite(buf, 1, n, out) != n) {
+			snprintf(j->error, sizeof(j->error), "error writing the output");
+			j->ok = false;
+			break;
+		}
+		j->sectors += n / SECTOR_SIZE;
+	}
+	if (ferror(in)) {
+		snprintf(j->error, sizeof(j->error), "error reading");
+		j->ok = false;
+	}
+	swiSHA1Final(j->sha1, &sha1ctx);
+	free(buf);
+	fclose(in);
+	if (out != 0 && fclose(out) != 0) {
+		snprintf(j->error, sizeof(j->error), "error writing the output");
+		j->ok = false;
+	}
+	return 0;
+}
+
+int main(int argc, const char * const argv[]) {
+	bool write = argc > 1 && strcmp(argv[1], "-w") == 0;
+	int first = 1 + write;
+	if (argc < first + 3 || (argc - first) % 3 != 0) {
+		fprintf(stderr, "usage: %s [-w] <image> <console ID> <CID> [<image> <console ID> <CID> ...]\n", argv[0]);
+		return 1;
+	}
+	unsigned count = (argc - first) / 3;
+	job_t *jobs = (job_t*)calloc(count, sizeof(job_t));
+	for (unsigned i = 0; i < count; ++i) {
+		const char * const *a = argv + first + i * 3;
+		u8 console_id[8], cid[16];
+		if (hex2bytes(console_id, sizeof(console_id), a[1]) != 0) {
+			fprintf(stderr, "invalid console ID: %s\n", a[1]);
+			return 1;
+		}
+		if (hex2bytes(cid, sizeof(cid), a[2]) != 0) {
+			fprintf(stderr, "invalid CID: %s\n", a[2]);
+			return 1;
+		}
+		jobs[i].name = a[0];
+		jobs[i].write = write;
+		dsi_crypt_init(&jobs[i].ctx, console_id, cid, 0);
+	}
+	pthread_t *threads = (pthread_t*)malloc(count * sizeof(pthread_t));
+	for (unsigned i = 0; i < count; ++i) {
+		if (pthread_create(&threads[i], 0, run, &jobs[i]) != 0) {
+			fprintf(stderr, "failed to start a thread for %s\n", jobs[i].name);
+			return 1;
+		}
+	}
+	int ret = 0;
+	for (unsigned i = 0; i < count; ++i) {
+		pthread_join(threads[i], 0);
+		job_t *j = &jobs[i];
+		if (!j->ok) {
+			printf("%s: %s\n", j->name, j->error);
+			ret = 1;
+			continue;
+		}
+		printf("%s: %" PRIu32 " sectors, %s, SHA1 ", j->name, j->sectors, j->mbr ? "MBR ok" : "no MBR, wrong keys?");
+		for (int k = 0; k < SHA1_LEN; ++k) {
+			printf("%02x", j->sha1[k]);
+		}
+		printf("\n");
+		if (!j->mbr) {
+			ret = 1;
+		}
+	}
+	free(threads);
+	free(jobs);
+	return ret;
+}
@@ -0,0 +1,170 @@
+#include <nds.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include "crypto.h"
+#include "rawfile.h"
+#include "sparse.h"
+
+// converts between nand.bin and nand.sparse
+// with the console's keys, blocks that are zero once decrypted, unused space mostly, are elided too
+// nandsparse pack <nand.bin> <nand.sparse> [console ID, 16 hex digits] [CID, 32 hex digits]
+// nandsparse unpack <nand.sparse> <nand.bin> [console ID] [CID]
+
+#define SECTOR_SIZE 512
+#define BLOCK_SIZE (SPARSE_BLOCK_LEN * SECTOR_SIZE)
+
+static int hex2bytes(u8 *out, unsigned len, const char *in) {
+	if (strlen(in) != len * 2) {
+		return -1;
+	}
+	for (unsigned i = 0; i < len; ++i) {
+		unsigned b;
+		if (sscanf(in + i * 2, "%2x", &b) != 1) {
+			return -1;
+		}
+		out[i] = (u8)b;
+	}
+	return 0;
+}
+
+static bool is_zero(const u8 *p, u32 len) {
+	for (u32 i = 0; i < len; ++i) {
+		if (p[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int pack(FILE *in, FILE *out, const dsi_crypt_ctx_t *ctx) {
+	fseek(in, 0, SEEK_END);
+	long size = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	if (size <= 0 || size % SECTOR_SIZE != 0) {
+		fprintf(stderr, "not a NAND image\n");
+		return 1;
+	}
+	static raw_file_t file;
+	static raw_sparse_t s;
+	if (!raw_file_init(&file, out, 0)) {
+		return 1;
+	}
+	file.growable = true;
+	if (!raw_sparse_create(&s, &file, size / SECTOR_SIZE, ctx)) {
+		fprintf(stderr, "failed to create the sparse image\n");
+		return 1;
+	}
+	u8 *buf = (u8*)memalign(32, BLOCK_SIZE);
+	u8 *plain = (u8*)memalign(32, BLOCK_SIZE);
+	u32 zero_raw = 0, zero_plain = 0;
+	for (u32 b = 0; b < s.h.blocks; ++b) {
+		sec_t start = b * SPARSE_BLOCK_LEN;
+		sec_t n = s.h.sectors - start < SPARSE_BLOCK_LEN ? s.h.sectors - start : SPARSE_BLOCK_LEN;
+		if (fread(buf, SECTOR_SIZE, n, in) != n) {
+			fprintf(stderr, "read failed\n");
+			return 1;
+		}
+		// blocks start as SPARSE_ZERO_RAW
+		if (is_zero(buf, n * SECTOR_SIZE)) {
+			++zero_raw;
+			continue;
+		}
+		if (ctx != 0) {
+			dsi_nand_crypt(ctx, plain, buf, start * SECTOR_SIZE / AES_BLOCK_SIZE, n * SECTOR_SIZE / AES_BLOCK_SIZE);
+			if (is_zero(plain, n * SECTOR_SIZE)) {
+				raw_sparse_set_implicit(&s, b, SPARSE_ZERO_PLAIN);
+				++zero_plain;
+				continue;
+			}
+		}
+		if (!raw_sparse_rw(&s, BLK_WRITE, start, n, buf)) {
+			fprintf(stderr, "write failed\n");
+			return 1;
+		}
+	}
+	if (!raw_sparse_flush(&s)) {
+		fprintf(stderr, "write failed\n");
+		return 1;
+	}
+	printf("%" PRIu32 " blocks, %" PRIu32 " stored, %" PRIu32 " zero, %" PRIu32 " zero decrypted\n",
+		s.h.blocks, s.h.slots, zero_raw, zero_plain);
+	raw_sparse_free(&s);
+	raw_file_free(&file);
+	free(buf);
+	free(plain);
+	return 0;
+}
+
+// every block is checked against the hash in the map on the way out
+static int unpack(FILE *in, FILE *out, const dsi_crypt_ctx_t *ctx) {
+	static raw_file_t file;
+	static raw_sparse_t s;
+	if (!raw_file_init(&file, in, 0) || !raw_sparse_open(&s, &file, ctx)) {
+		return 1;
+	}
+	u8 *buf = (u8*)memalign(32, BLOCK_SIZE);
+	u32 bad = 0;
+	for (u32 b = 0; b < s.h.blocks; ++b) {
+		sec_t start = b * SPARSE_BLOCK_LEN;
+		sec_t n = s.h.sectors - start < SPARSE_BLOCK_LEN ? s.h.sectors - start : SPARSE_BLOCK_LEN;
+		if (!raw_sparse_rw(&s, BLK_READ, start, n, buf)) {
+			fprintf(stderr, "read failed\n");
+			return 1;
+		}
+		u8 sha1[SHA1_LEN];
+		swiSHA1Calc(sha1, buf, n * SECTOR_SIZE);
+		if (memcmp(sha1, s.map[b].sha1, SHA1_LEN) != 0) {
+			fprintf(stderr, "block %" PRIu32 ": SHA1 mismatch\n", b);
+			++bad;
+		}
+		if (fwrite(buf, SECTOR_SIZE, n, out) != n) {
+			fprintf(stderr, "write failed\n");
+			return 1;
+		}
+	}
+	printf("%" PRIu32 " blocks, %" PRIu32 " stored, %" PRIu32 " bad\n", s.h.blocks, s.h.slots, bad);
+	raw_sparse_free(&s);
+	raw_file_free(&file);
+	free(buf);
+	return bad > 0 ? 1 : 0;
+}
+
+int main(int argc, const char * const argv[]) {
+	if (argc < 4 || (strcmp(argv[1], "pack") != 0 && strcmp(argv[1], "unpack") != 0)) {
+		fprintf(stderr, "usage: %s pack|unpack <from> <to> [console ID] [CID]\n", argv[0]);
+		return 1;
+	}
+	u8 console_id[8];
+	u8 cid[16];
+	static dsi_crypt_ctx_t ctx;
+	const dsi_crypt_ctx_t *pctx = 0;
+	if (argc > 5) {
+		if (hex2bytes(console_id, sizeof(console_id), argv[4]) != 0) {
+			fprintf(stderr, "invalid console ID: %s\n", argv[4]);
+			return 1;
+		}
+		if (hex2bytes(cid, sizeof(cid), argv[5]) != 0) {
+			fprintf(stderr, "invalid CID: %s\n", argv[5]);
+			return 1;
+		}
+		dsi_crypt_init(&ctx, console_id, cid, 0);
+		pctx = &ctx;
+	}
+	FILE *in = fopen(argv[2], "rb");
+	if (in == 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	FILE *out = fopen(argv[3], "w+b");
+	if (out == 0) {
+		perror(argv[3]);
+		return 1;
+	}
+	int ret = strcmp(argv[1], "pack") == 0 ? pack(in, out, pctx) : unpack(in, out, pctx);
+	fclose(in);
+	if (fclose(out) != 0) {
+		ret = 1;
+	}
+	return ret;
+}
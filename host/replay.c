@@ -0,0 +1,205 @@
+#include <nds.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include "nandtrace.h"
+#include "crypto.h"
+#include "blkstack.h"
+
+// replays a sector trace recorded on the DS against a NAND image, through the same block stack
+// the image is held in memory and never written back, the raw layer only counts what reaches it
+// replay <trace> <nand.bin> [console ID, 16 hex digits] [CID, 32 hex digits] [nandio|imgio]
+
+#define SECTOR_SIZE 512
+
+typedef struct {
+	raw_t base;
+	u8 *data;
+	u32 calls;
+	u64 sectors;
+} raw_host_t;
+
+static bool host_start(raw_t *r, blk_op_t op, sec_t start, sec_t len, void *buffer) {
+	raw_host_t *h = (raw_host_t*)r;
+	if (start + len > r->sectors || start + len < start) {
+		return false;
+	}
+	++h->calls;
+	h->sectors += len;
+	if (op == BLK_READ) {
+		memcpy(buffer, h->data + (u64)start * SECTOR_SIZE, len * SECTOR_SIZE);
+	} else {
+		memcpy(h->data + (u64)start * SECTOR_SIZE, buffer, len * SECTOR_SIZE);
+	}
+	return true;
+}
+
+static bool host_wait(raw_t *r) {
+	return true;
+}
+
+static bool host_is_direct(const void *p) {
+	return ((uintptr_t)p & 31) == 0;
+}
+
+static int hex2bytes(u8 *out, unsigned len, const char *in) {
+	if (strlen(in) != len * 2) {
+		return -1;
+	}
+	for (unsigned i = 0; i < len; ++i) {
+		unsigned b;
+		if (sscanf(in + i * 2, "%2x", &b) != 1) {
+			return -1;
+		}
+		out[i] = (u8)b;
+	}
+	return 0;
+}
+
+static double ticks_to_ms(u64 ticks) {
+	return ticks * 1000.0 / BUS_CLOCK;
+}
+
+static void print_op(const char *op, const blk_op_stats_t *st) {
+	if (st->calls == 0) {
+		return;
+	}
+	printf("%-5s %8" PRIu32 " calls %10" PRIu32 " sectors %10.1fms %8.1fus avg %" PRIu32 " errors\n",
+		op, st->calls, st->sectors, ticks_to_ms(st->ticks), ticks_to_ms(st->ticks) * 1000 / st->calls, st->errors);
+	printf("      size");
+	for (unsigned i = 0; i < BLK_SIZE_HIST_LEN; ++i) {
+		printf(" %" PRIu32, st->size_hist[i]);
+	}
+	printf("\n      latency");
+	for (unsigned i = 0; i < BLK_LAT_HIST_LEN; ++i) {
+		printf(" %" PRIu32, st->lat_hist[i]);
+	}
+	printf("\n");
+}
+
+int main(int argc, const char * const argv[]) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <trace> <nand.bin> [console ID] [CID] [nandio|imgio]\n", argv[0]);
+		return 1;
+	}
+	u8 console_id[8] = { 0 };
+	u8 cid[16] = { 0 };
+	// without keys the plain text is garbage, which makes no difference to what reaches the raw layer
+	if (argc > 3 && hex2bytes(console_id, sizeof(console_id), argv[3]) != 0) {
+		fprintf(stderr, "invalid console ID: %s\n", argv[3]);
+		return 1;
+	}
+	if (argc > 4 && hex2bytes(cid, sizeof(cid), argv[4]) != 0) {
+		fprintf(stderr, "invalid CID: %s\n", argv[4]);
+		return 1;
+	}
+	int dev = -1;
+	if (argc > 5) {
+		dev = strcmp(argv[5], "imgio") == 0 ? NANDTRACE_IMGIO : NANDTRACE_NANDIO;
+	}
+
+	FILE *tf = fopen(argv[1], "rb");
+	if (tf == 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	nandtrace_header_t h;
+	if (fread(&h, sizeof(h), 1, tf) != 1 || h.magic != NANDTRACE_MAGIC
+		|| h.version != NANDTRACE_VERSION || h.record_size != sizeof(nandtrace_record_t))
+	{
+		fprintf(stderr, "%s: not a sector trace\n", argv[1]);
+		return 1;
+	}
+
+	FILE *f = fopen(argv[2], "rb");
+	if (f == 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	raw_host_t raw;
+	raw.base.start = host_start;
+	raw.base.wait = host_wait;
+	raw.base.is_direct = host_is_direct;
+	raw.base.sectors = size / SECTOR_SIZE;
+	raw.calls = 0;
+	raw.sectors = 0;
+	raw.data = (u8*)memalign(32, size);
+	if (raw.data == 0 || fread(raw.data, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "%s: failed to load\n", argv[2]);
+		return 1;
+	}
+	fclose(f);
+
+	static dsi_crypt_ctx_t ctx;
+	dsi_crypt_init(&ctx, console_id, cid, 0);
+	static blkstack_t stack;
+	blkstack_set_crypt_ctx(&stack, &ctx);
+	if (!blkstack_startup(&stack, &raw.base, "REPLAY")) {
+		return 1;
+	}
+
+	// largest request the recorder splits to
+	u8 *buf = (u8*)memalign(32, 0xffff * SECTOR_SIZE);
+	memset(buf, 0x5a, 0xffff * SECTOR_SIZE);
+	swiSHA1context_t sha1ctx;
+	nandtrace_record_t r;
+	u32 records = 0, skipped = 0, last_time = 0;
+	u64 elapsed = 0;
+	while (fread(&r, sizeof(r), 1, tf) == 1) {
+		last_time = r.time;
+		if (dev >= 0 && r.dev != dev) {
+			++skipped;
+			continue;
+		}
+		if (r.sector + r.count > raw.base.sectors) {
+			++skipped;
+			continue;
+		}
+		u32 t0 = blk_clock();
+		switch (r.op) {
+		case NANDTRACE_READ:
+			blkstack_read(&stack, r.sector, r.count, buf);
+			break;
+		case NANDTRACE_WRITE:
+			blkstack_write(&stack, r.sector, r.count, buf);
+			break;
+		case NANDTRACE_SYNC:
+			blkstack_sync(&stack);
+			break;
+		case NANDTRACE_READ_SHA1:
+			swiSHA1Init(&sha1ctx);
+			blkstack_read_sha1(&stack, r.sector, r.count, buf, &sha1ctx);
+			break;
+		default:
+			++skipped;
+			continue;
+		}
+		elapsed += blk_clock() - t0;
+		++records;
+	}
+	fclose(tf);
+	blkstack_sync(&stack);
+
+	printf("%" PRIu32 " records replayed, %" PRIu32 " skipped, recorded over %.1fs, replayed in %.1fms\n",
+		records, skipped, last_time / 1000000.0, ticks_to_ms(elapsed));
+	const blk_stats_t *st = &stack.stats.stats;
+	print_op("read", &st->read);
+	print_op("write", &st->write);
+	const blk_time_t *bt = &stack.crypt.time;
+	printf("media %.1fms, AES %.1fms, FAT fix %.1fms\n",
+		ticks_to_ms(bt->media), ticks_to_ms(bt->aes), ticks_to_ms(bt->fat_fix));
+	printf("raw: %" PRIu32 " calls, %" PRIu64 " sectors\n", raw.calls, raw.sectors);
+	const sector_cache_stats_t *cs = &stack.cache.cache.stats;
+	printf("cache: %" PRIu32 " hits, %" PRIu32 " misses, %" PRIu32 " sectors written as %" PRIu32 " in %" PRIu32 " runs\n",
+		cs->hits, cs->misses, cs->writes, cs->run_sectors, cs->runs);
+	const readahead_stats_t *rs = &stack.crypt.ra.stats;
+	printf("read ahead: %" PRIu32 " streams, %" PRIu32 " hits, %" PRIu32 " misses, %" PRIu32 " of %" PRIu32 " unused\n",
+		rs->streams, rs->hits, rs->misses, rs->dropped, rs->prefetched);
+	blkstack_shutdown(&stack);
+	free(buf);
+	free(raw.data);
+	return 0;
+}
@@ -0,0 +1,256 @@
+#include <nds.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "ioring.h"
+
+// the ARM7 descriptor ring of common/ioring.h, with a thread for the ARM7 and a file for the eMMC
+// the ARM9 end is ring_start/ring_wait of arm9/source/rawdev.c, cache maintenance left out,
+// the FIFO is a queue of values each way, the ARM7 end is ioring_kick of arm7/source/main.c
+// random reads and writes, up to the whole ring in flight, checked against a copy in memory:
+// completions come back in order, reads see the writes queued before them, a full ring
+// refuses more, a failed transfer fails its own descriptor only
+// the counters start just short of wrapping, so head, tail and done all wrap early on
+// ringtest [ops] [seed]
+
+#define SECTOR_SIZE 512
+#define SECTORS 4096
+#define MAX_COUNT 16
+#define FIFO_LEN 64
+#define COUNTER_START 0xfffffff0u
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	u32 values[FIFO_LEN];
+	unsigned first, count;
+} fifo_t;
+
+static fifo_t to_arm7 = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static fifo_t to_arm9 = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// a full FIFO holds the sender up, like the hardware one, kicks the ARM7 found nothing for can pile up
+static void fifo_send(fifo_t *f, u32 value) {
+	pthread_mutex_lock(&f->lock);
+	while (f->count == FIFO_LEN) {
+		pthread_cond_wait(&f->cond, &f->lock);
+	}
+	f->values[(f->first + f->count++) % FIFO_LEN] = value;
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static u32 fifo_wait(fifo_t *f) {
+	pthread_mutex_lock(&f->lock);
+	while (f->count == 0) {
+		pthread_cond_wait(&f->cond, &f->lock);
+	}
+	u32 value = f->values[f->first];
+	f->first = (f->first + 1) % FIFO_LEN;
+	--f->count;
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+	return value;
+}
+
+static int fd;
+static u32 rnd_state;
+// the ARM7 thread's own, so the two don't race on rnd_state
+static u32 delay_state = 0x9e3779b9;
+
+static u32 rnd_next(u32 *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static u32 rnd() {
+	return rnd_next(&rnd_state);
+}
+
+// now and then slow, so the ARM9 gets to queue while a transfer is going on
+static void medium_delay() {
+	if (rnd_next(&delay_state) % 8 == 0) {
+		usleep(rnd_next(&delay_state) % 50);
+	}
+}
+
+static int file_read(u32 sector, u32 count, void *buffer) {
+	medium_delay();
+	if (sector >= SECTORS || count > SECTORS - sector) {
+		return -1;
+	}
+	return pread(fd, buffer, count * SECTOR_SIZE, (off_t)sector * SECTOR_SIZE) == count * SECTOR_SIZE ? 0 : -1;
+}
+
+static int file_write(u32 sector, u32 count, void *buffer) {
+	medium_delay();
+	if (sector >= SECTORS || count > SECTORS - sector) {
+		return -1;
+	}
+	return pwrite(fd, buffer, count * SECTOR_SIZE, (off_t)sector * SECTOR_SIZE) == count * SECTOR_SIZE ? 0 : -1;
+}
+
+static const ioring_medium_t file_medium = { file_read, file_write };
+
+static ioring_t ring __attribute__((aligned(32)));
+
+// ioring_kick, a value of 1 stops the thread
+static void *arm7(void *param) {
+	while (fifo_wait(&to_arm7) == 0) {
+		int i;
+		while ((i = ioring_process(&ring, &file_medium)) >= 0) {
+			fifo_send(&to_arm9, i);
+		}
+	}
+	return 0;
+}
+
+// ARM9 end
+static u32 done;
+
+static int ring_start(u32 op, u32 sector, u32 count, void *buffer) {
+	int i = ioring_queue(&ring, done, op, sector, count, buffer);
+	if (i < 0) {
+		return -1;
+	}
+	// where the ARM9 flushes the descriptor before it moves head
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	++ring.head;
+	fifo_send(&to_arm7, 0);
+	return i;
+}
+
+// index of the descriptor done, which has to be the oldest one queued
+static int ring_wait() {
+	int i = fifo_wait(&to_arm9) % IORING_LEN;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	++done;
+	return i;
+}
+
+typedef struct {
+	u32 op;
+	u32 sector, count;
+	bool bad; // past the end, has to fail
+	u8 buf[MAX_COUNT * SECTOR_SIZE] __attribute__((aligned(32)));
+	u8 expect[MAX_COUNT * SECTOR_SIZE]; // reads, what the copy had when it was queued
+} slot_t;
+
+static slot_t slots[IORING_LEN];
+static u8 shadow[SECTORS * SECTOR_SIZE];
+
+int main(int argc, const char * const argv[]) {
+	unsigned ops = argc > 1 ? strtoul(argv[1], 0, 0) : 100000;
+	rnd_state = argc > 2 ? strtoul(argv[2], 0, 0) : 0x2545f491;
+	if (rnd_state == 0) {
+		rnd_state = 1;
+	}
+	FILE *f = tmpfile();
+	if (f == 0) {
+		fprintf(stderr, "failed to create the image\n");
+		return 1;
+	}
+	fd = fileno(f);
+	for (unsigned i = 0; i < sizeof(shadow); ++i) {
+		shadow[i] = rnd();
+	}
+	if (pwrite(fd, shadow, sizeof(shadow), 0) != sizeof(shadow)) {
+		fprintf(stderr, "failed to write the image\n");
+		return 1;
+	}
+
+	ring.head = ring.tail = done = COUNTER_START;
+	pthread_t t;
+	if (pthread_create(&t, 0, arm7, 0) != 0) {
+		fprintf(stderr, "failed to start the ARM7 thread\n");
+		return 1;
+	}
+
+	unsigned queued = 0, completed = 0, full = 0, failed = 0, bad = 0;
+	while (completed < ops) {
+		u32 in_flight = ring.head - done;
+		// queue while there's room and ops left, a random depth so it's sometimes full, sometimes not
+		if (queued < ops && (in_flight == 0 || rnd() % (IORING_LEN + 1) > in_flight)) {
+			int i = ring.head % IORING_LEN;
+			slot_t *s = &slots[i];
+			s->op = rnd() % 2 ? IORING_READ : IORING_WRITE;
+			s->count = 1 + rnd() % MAX_COUNT;
+			s->sector = rnd() % (SECTORS - s->count + 1);
+			s->bad = rnd() % 64 == 0;
+			if (s->bad) {
+				s->sector = SECTORS - s->count + 1 + rnd() % 4;
+			}
+			u8 *p = shadow + s->sector * SECTOR_SIZE;
+			if (s->op == IORING_WRITE) {
+				for (unsigned k = 0; k < s->count * SECTOR_SIZE; ++k) {
+					s->buf[k] = rnd();
+				}
+				if (!s->bad) {
+					memcpy(p, s->buf, s->count * SECTOR_SIZE);
+				}
+			} else {
+				memset(s->buf, 0, sizeof(s->buf));
+				if (!s->bad) {
+					memcpy(s->expect, p, s->count * SECTOR_SIZE);
+				}
+			}
+			if (ring_start(s->op, s->sector, s->count, s->buf) != i) {
+				printf("descriptor %u not queued at %d\n", queued, i);
+				++bad;
+				break;
+			}
+			++queued;
+			continue;
+		}
+		if (in_flight == IORING_LEN) {
+			// one more has to be refused, and leave the ring as it was
+			u32 head = ring.head;
+			if (ioring_queue(&ring, done, IORING_READ, 0, 1, slots[0].buf) >= 0 || ring.head != head) {
+				printf("full ring took another descriptor\n");
+				++bad;
+			}
+			++full;
+		}
+		u32 expect = done % IORING_LEN;
+		int i = ring_wait();
+		slot_t *s = &slots[i];
+		ioring_desc_t *d = &ring.desc[i];
+		++completed;
+		if ((u32)i != expect) {
+			printf("descriptor %d done, %" PRIu32 " was the oldest\n", i, expect);
+			++bad;
+			continue;
+		}
+		if (s->bad) {
+			++failed;
+			if (d->result == 0) {
+				printf("transfer past the end at %" PRIu32 " didn't fail\n", s->sector);
+				++bad;
+			}
+			continue;
+		}
+		if (d->result != 0) {
+			printf("transfer at %" PRIu32 " failed\n", s->sector);
+			++bad;
+		} else if (s->op == IORING_READ && memcmp(s->buf, s->expect, s->count * SECTOR_SIZE) != 0) {
+			printf("read at %" PRIu32 ", %" PRIu32 " sectors, differs\n", s->sector, s->count);
+			++bad;
+		}
+	}
+	fifo_send(&to_arm7, 1);
+	pthread_join(t, 0);
+
+	// and what's in the file at the end
+	static u8 image[SECTORS * SECTOR_SIZE];
+	if (pread(fd, image, sizeof(image), 0) != sizeof(image) || memcmp(image, shadow, sizeof(image)) != 0) {
+		printf("image differs from the copy\n");
+		++bad;
+	}
+	fclose(f);
+	printf("%u descriptors, ring full %u times, %u failed as they should, counters at %08" PRIx32 ", %u wrong\n",
+		completed, full, failed, (u32)ring.tail, bad);
+	return bad != 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// for checkouts without term256 linked in, host.c prints to stdout
+
+#include <nds.h>
+
+#define COLOR_RED 1
+#define COLOR_GREEN 2
+#define COLOR_BRIGHT_RED 9
+#define COLOR_BRIGHT_GREEN 10
+
+void prt(const char *s);
+
+void iprtf(const char *fmt, ...);
+
+void activity(int color);